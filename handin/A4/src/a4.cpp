@@ -1,5 +1,1278 @@
 #include "a4.hpp"
 #include "image.hpp"
+#include "raybatch.hpp"
+#include "arena.hpp"
+#include "rng.hpp"
+#include "photonmap.hpp"
+#include "irradiancecache.hpp"
+#include "denoise.hpp"
+#include "aov.hpp"
+#include "texture.hpp"
+#include "accel.hpp"
+#include <cstring>
+#include <vector>
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+A4Options a4_options;
+
+A4Options::A4Options()
+  : order(TRAVERSE_MORTON),
+    tile_size(16),
+    max_depth(5),
+    threads(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN))),
+    samples(1),
+    seed(0),
+    path_trace(false),
+    noise_threshold(0.0),
+    denoise(false),
+    write_guides(false),
+    write_aov(false),
+    texture_memory(256 << 20),
+    crop_x(0), crop_y(0), crop_width(0), crop_height(0),
+    composite(false),
+    budget(0.0),
+    photons(0),
+    photon_gather(50),
+    photon_radius(0.0),
+    irradiance_accuracy(0.0),
+    irradiance_samples(256),
+    gather_spheres(false)
+{
+}
+
+// Offset used to keep rays from re-hitting the surface they leave
+static const double EPSILON = 1e-4;
+
+// Secondary rays whose contribution would be less than this in every
+// channel aren't worth tracing
+static const double MIN_WEIGHT = 1.0 / 512.0;
+
+// Fraction of the scene's bounding box diagonal used as the photon
+// gather radius when none is given
+static const double PHOTON_RADIUS_FRACTION = 0.01;
+
+// Mixed into the render seed for hemisphere sampling, so it doesn't
+// share random numbers with the eye rays
+static const unsigned int IRRADIANCE_SEED = 0x49525243;
+
+// Rounds of the irradiance cache pass: each looks at every stride-th
+// pixel across and down, from coarse to fine
+static const int IRRADIANCE_STRIDES[] = { 16, 8, 4, 2, 1 };
+
+// Path tracing takes samples in blocks of PATH_STRATA x PATH_STRATA,
+// each block stratified over the pixel and over every bounce
+static const int PATH_STRATA = 4;
+static const int PATH_BLOCK = PATH_STRATA * PATH_STRATA;
+
+// Mixed into the render seed to shuffle the strata of each block
+static const unsigned int STRATA_SEED = 0x53545241;
+
+// Mixed into the render seed for the times within the shutter that
+// samples are taken at
+static const unsigned int TIME_SEED = 0x54494d45;
+
+// Paths are only ended at random (Russian roulette) after this many
+// bounces, so the first bounces of every path are always followed
+static const int ROULETTE_DEPTH = 2;
+
+// Two-sided 95% point of the normal distribution, for the confidence
+// interval of a pixel's mean
+static const double CONFIDENCE_Z = 1.96;
+
+// Pixels darker than this are held to the noise threshold as if they
+// were this bright, so they don't need endless samples to converge
+static const double NOISE_FLOOR = 1.0 / 64.0;
+
+// Material used for geometry that was never given one
+static const PhongMaterial DEFAULT_MATERIAL(Colour(0.5, 0.5, 0.5),
+                                            Colour(0.0, 0.0, 0.0), 1.0);
+
+// Wall-clock time in seconds, for reporting render times.
+static double wall_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double max_channel(const Colour& c)
+{
+  return std::max(c.R(), std::max(c.G(), c.B()));
+}
+
+static Vector3D normalized(Vector3D v)
+{
+  v.normalize();
+  return v;
+}
+
+// Everything the tracer needs to know about the scene and camera.
+struct RenderContext {
+  RenderContext(SceneNode* root_, const Colour& ambient_,
+                const std::list<Light*>& lights_)
+    : root(root_), ambient(ambient_), lights(lights_)
+  {
+  }
+
+  SceneNode* root;
+  Colour ambient;
+  const std::list<Light*>& lights;
+
+  // Size of the full frame, and the part of it being rendered
+  int width, height;
+  int crop_x, crop_y, crop_width, crop_height;
+
+  unsigned int seed;
+
+  // Whether to follow indirect light by path tracing, and the relative
+  // error at which a pixel has had enough samples
+  bool path_trace;
+  double noise_threshold;
+
+  // Caustic photons, if any, and the gather size and radius
+  const PhotonMap* caustics;
+  int photon_gather;
+  double photon_radius;
+
+  // Cached indirect irradiance, if any, and the hemisphere rays to
+  // trace for a new record
+  const IrradianceCache* irradiance;
+  int irradiance_samples;
+
+  // Camera frame. The ray through image position (u, v), each in
+  // [-1, 1], has direction forward + u * right + v * up.
+  Point3D eye;
+  Vector3D forward, right, up;
+
+  // Angle a pixel subtends at the eye, for sizing texture lookups
+  double pixel_angle;
+};
+
+// Per-thread state. Each worker has its own arena, ray batches and
+// counters, so the only thing the workers share is the index of the
+// next tile. Workers last for the whole frame, so their arenas only
+// have to grow once.
+struct TileWorker {
+  TileWorker()
+    : current(arena), next(arena),
+      tiles(0), primary_rays(0), secondary_rays(0), seconds(0.0)
+  {
+  }
+
+  // Transient storage for tracing, reset at the start of each tile
+  Arena arena;
+  RayBatch current, next;
+
+  // Statistics for the current pass
+  long tiles;
+  long primary_rays;
+  long secondary_rays;
+  double seconds;
+
+  // Photon gathers and irradiance lookups over the whole frame
+  GatherStats gather;
+  IrradianceStats irradiance;
+};
+
+// One pass over the image: samples [first_sample, first_sample +
+// samples) of every pixel, traced to the given depth. If deadline is
+// non-zero, no tile is started that wouldn't finish before it.
+struct RenderPass {
+  int first_sample;
+  int samples;
+  int depth;
+  double deadline;
+};
+
+// Running luminance statistics of one pixel's samples, for deciding
+// when it has had enough.
+struct PixelNoise {
+  PixelNoise() : sum(0.0), sum_squares(0.0), converged(false) {}
+
+  double sum, sum_squares;
+  bool converged;
+};
+
+// What a pass got through.
+struct PassStats {
+  long tiles;
+  long primary_rays;
+  long secondary_rays;
+  double seconds;
+};
+
+// Generate the eye ray through image position (x, y) in pixels, at
+// the given time within the shutter.
+static Ray primary_ray(const RenderContext& ctx, double x, double y, double time)
+{
+  double u = 2.0 * x / ctx.width - 1.0;
+  double v = 1.0 - 2.0 * y / ctx.height;
+  return Ray(ctx.eye, normalized(ctx.forward + u * ctx.right + v * ctx.up), time);
+}
+
+// Index of a pixel of the crop region in the full frame, for keying
+// random numbers.
+static uint32_t frame_pixel(const RenderContext& ctx, int x, int y)
+{
+  return (ctx.crop_y + y) * ctx.width + ctx.crop_x + x;
+}
+
+// A point in [0, 1)^2 for dimension "dim" (0 for the pixel position, d
+// for the bounce off the d'th hit) of a path tracing sample. Within
+// each block of PATH_BLOCK samples, every dimension puts one sample in
+// each of PATH_STRATA x PATH_STRATA strata. Each dimension shuffles
+// the strata its own way, so the dimensions aren't correlated. The
+// jitter within the stratum is taken from rng.
+static void stratified_sample(const RenderContext& ctx, uint32_t pixel, int sample,
+                              int dim, SampleRng& rng, double& u, double& v)
+{
+  int strata[PATH_BLOCK];
+  for (int i = 0; i < PATH_BLOCK; i++) strata[i] = i;
+
+  SampleRng shuffle(ctx.seed ^ STRATA_SEED, pixel, sample / PATH_BLOCK, dim);
+  int slot = sample % PATH_BLOCK;
+  for (int i = PATH_BLOCK - 1; i >= slot; i--) {
+    std::swap(strata[i], strata[shuffle.next_uint() % (i + 1)]);
+  }
+
+  u = (strata[slot] % PATH_STRATA + rng.next()) / PATH_STRATA;
+  v = (strata[slot] / PATH_STRATA + rng.next()) / PATH_STRATA;
+}
+
+// The time in [0, 1) within the shutter at which a pixel's sample is
+// taken. Each block of PATH_BLOCK samples puts one in each of
+// PATH_BLOCK slices of the shutter, in an order of its own so times
+// aren't tied to where in the pixel the samples fall.
+static double shutter_time(const RenderContext& ctx, uint32_t pixel, int sample)
+{
+  int slices[PATH_BLOCK];
+  for (int i = 0; i < PATH_BLOCK; i++) slices[i] = i;
+
+  SampleRng shuffle(ctx.seed ^ TIME_SEED, pixel, sample / PATH_BLOCK, 0);
+  int slot = sample % PATH_BLOCK;
+  for (int i = PATH_BLOCK - 1; i >= slot; i--) {
+    std::swap(slices[i], slices[shuffle.next_uint() % (i + 1)]);
+  }
+
+  SampleRng jitter(ctx.seed ^ TIME_SEED, pixel, sample, 1);
+  return (slices[slot] + jitter.next()) / PATH_BLOCK;
+}
+
+// A hash of a point's coordinates, used to key the random numbers for
+// work done at that point so they don't depend on which pixel or
+// thread got there first.
+static uint32_t position_key(const Point3D& p)
+{
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 3; i++) {
+    double c = p[i];
+    uint64_t bits;
+    std::memcpy(&bits, &c, sizeof(bits));
+    hash = (hash ^ (uint32_t)bits) * 16777619u;
+    hash = (hash ^ (uint32_t)(bits >> 32)) * 16777619u;
+  }
+  return hash;
+}
+
+static Colour local_light(const RenderContext& ctx, const PhongMaterial& material,
+                          const Point3D& p, const Vector3D& n, const Vector3D& d,
+                          double time, bool use_cache, TileWorker& worker);
+
+// The material of the surface a ray hit. If it's textured, the
+// texture is looked up over the pixel's footprint on the surface and a
+// copy with that diffuse colour is made in "textured".
+//
+// The footprint is the width of the pixel's cone at distance t. That's
+// exact for eye rays and an underestimate after a bounce.
+static const PhongMaterial* surface_material(const RenderContext& ctx, const Ray& ray,
+                                             const Intersection& hit,
+                                             PhongMaterial& textured)
+{
+  const PhongMaterial* material = dynamic_cast<const PhongMaterial*>(hit.material);
+  if (!material) return &DEFAULT_MATERIAL;
+  if (!material->texture() || !hit.primitive) return material;
+
+  double u, v;
+  hit.primitive->texture_coords(hit.local, u, v);
+
+  // Surfaces seen edge-on stretch the footprint along one direction;
+  // cap the stretch so grazing hits don't blur to a single colour
+  double cos_angle = fabs(normalized(hit.normal).dot(normalized(ray.dir)));
+  double width = ctx.pixel_angle * hit.t * hit.primitive->texture_density()
+    / (hit.tangent.length() * std::max(cos_angle, 0.1));
+
+  textured = *material;
+  textured.set_diffuse(material->diffuse() * material->texture()->sample(u, v, width));
+  return &textured;
+}
+
+// Estimate the indirect irradiance at p by tracing rays over the
+// hemisphere around n, and work out its gradients (Ward and Heckbert
+// 1992). The hemisphere is split into M strata in theta (spaced so
+// each gets an equal share of cos-weighted solid angle) by N in phi,
+// with N about pi M, and one ray is jittered within each stratum.
+// Surfaces the rays hit contribute their direct and ambient light
+// only, so this is a single bounce.
+static void compute_irradiance(const RenderContext& ctx, const IrradianceCache& cache,
+                               const Point3D& p, const Vector3D& n,
+                               TileWorker& worker, IrradianceRecord& record)
+{
+  int strata_theta = std::max(1, (int)(sqrt(ctx.irradiance_samples / M_PI) + 0.5));
+  int strata_phi = std::max(3, (int)((double)ctx.irradiance_samples / strata_theta + 0.5));
+  int strata = strata_theta * strata_phi;
+
+  Vector3D u = normalized(n.cross(fabs(n[0]) < 0.9 ? Vector3D(1.0, 0.0, 0.0)
+                                                   : Vector3D(0.0, 1.0, 0.0)));
+  Vector3D v = n.cross(u);
+
+  Arena& arena = worker.arena;
+  Arena::Mark mark = arena.mark();
+  double* radiance = arena.allocate_array<double>(3 * strata);
+  double* dist = arena.allocate_array<double>(strata);
+
+  SampleRng rng(ctx.seed ^ IRRADIANCE_SEED, position_key(p), 0, 0);
+  // Records are shared by samples at all times, so each ray looks at
+  // the scene at a time of its own
+  SampleRng time_rng(ctx.seed ^ IRRADIANCE_SEED, position_key(p), 0, 1);
+  double sum[3] = { 0.0, 0.0, 0.0 };
+  double inverse_dist = 0.0;
+
+  for (int j = 0; j < strata_theta; j++) {
+    for (int k = 0; k < strata_phi; k++) {
+      double sin_theta = sqrt((j + rng.next()) / strata_theta);
+      double cos_theta = sqrt(std::max(0.0, 1.0 - sin_theta * sin_theta));
+      double phi = 2.0 * M_PI * (k + rng.next()) / strata_phi;
+      Vector3D dir = (sin_theta * cos(phi)) * u + (sin_theta * sin(phi)) * v + cos_theta * n;
+      Ray ray(p, dir, time_rng.next());
+
+      int i = j * strata_phi + k;
+      Colour colour(0.0);
+      dist[i] = HUGE_VAL;
+
+      Intersection hit;
+      if (ctx.root->intersect(ray, EPSILON, HUGE_VAL, hit, arena)) {
+        PhongMaterial textured(DEFAULT_MATERIAL);
+        const PhongMaterial* material = surface_material(ctx, ray, hit, textured);
+        Vector3D hn = normalized(hit.normal);
+        if (hn.dot(dir) > 0.0) hn = -hn;
+        colour = (1.0 - material->transparency())
+          * local_light(ctx, *material, ray.at(hit.t), hn, dir, ray.time, false, worker);
+        dist[i] = hit.t;
+        inverse_dist += 1.0 / hit.t;
+      }
+
+      radiance[3 * i] = colour.R();
+      radiance[3 * i + 1] = colour.G();
+      radiance[3 * i + 2] = colour.B();
+      for (int c = 0; c < 3; c++) sum[c] += radiance[3 * i + c];
+    }
+  }
+
+  record.pos = p;
+  record.normal = n;
+  double scale = M_PI / strata;
+  record.irradiance = Colour(scale * sum[0], scale * sum[1], scale * sum[2]);
+  record.radius = inverse_dist > 0.0 ? strata / inverse_dist : HUGE_VAL;
+  record.radius = std::min(std::max(record.radius, cache.min_radius()), cache.max_radius());
+
+  for (int c = 0; c < 3; c++) {
+    record.rotation_gradient[c] = Vector3D(0.0, 0.0, 0.0);
+    record.translation_gradient[c] = Vector3D(0.0, 0.0, 0.0);
+  }
+
+  for (int k = 0; k < strata_phi; k++) {
+    // Centre and start of this phi stratum, and directions in the
+    // tangent plane along and across them
+    double phi = 2.0 * M_PI * (k + 0.5) / strata_phi;
+    double phi_start = 2.0 * M_PI * k / strata_phi;
+    Vector3D along = cos(phi) * u + sin(phi) * v;
+    Vector3D across = -sin(phi) * u + cos(phi) * v;
+    Vector3D across_start = -sin(phi_start) * u + cos(phi_start) * v;
+    int prev_k = (k + strata_phi - 1) % strata_phi;
+
+    for (int c = 0; c < 3; c++) {
+      double rotation = 0.0, radial = 0.0, angular = 0.0;
+      for (int j = 0; j < strata_theta; j++) {
+        int i = j * strata_phi + k;
+        double L = radiance[3 * i + c];
+
+        double sin_centre = sqrt((j + 0.5) / strata_theta);
+        rotation -= sin_centre / sqrt(1.0 - sin_centre * sin_centre) * L;
+
+        // Change across the boundary with the stratum below in theta
+        double sin_lo = sqrt((double)j / strata_theta);
+        if (j > 0) {
+          int below = i - strata_phi;
+          double r = std::min(dist[i], dist[below]);
+          radial += sin_lo * (1.0 - sin_lo * sin_lo) / r * (L - radiance[3 * below + c]);
+        }
+
+        // ...and across the boundary with the previous stratum in phi
+        double sin_hi = sqrt((j + 1.0) / strata_theta);
+        int before = j * strata_phi + prev_k;
+        double r = std::min(dist[i], dist[before]);
+        angular += (sin_hi - sin_lo) / r * (L - radiance[3 * before + c]);
+      }
+
+      record.rotation_gradient[c] = record.rotation_gradient[c] + (scale * rotation) * across;
+      record.translation_gradient[c] = record.translation_gradient[c]
+        + (2.0 * M_PI / strata_phi * radial) * along + angular * across_start;
+    }
+  }
+
+  arena.rewind(mark);
+}
+
+// Indirect irradiance at p, interpolated from the cache if it can be,
+// or computed from scratch (and not kept) if not.
+static Colour indirect_irradiance(const RenderContext& ctx, const Point3D& p,
+                                  const Vector3D& n, TileWorker& worker)
+{
+  const IrradianceCache& cache = *ctx.irradiance;
+  worker.irradiance.lookups++;
+
+  IrradianceEstimate estimate(p, n, cache.accuracy());
+  cache.lookup(estimate);
+  if (estimate.valid()) {
+    worker.irradiance.interpolated++;
+    return estimate.irradiance();
+  }
+
+  worker.irradiance.computed++;
+  IrradianceRecord record;
+  compute_irradiance(ctx, cache, p, n, worker, record);
+  return record.irradiance;
+}
+
+// Light leaving a surface point back along d, apart from reflection
+// and refraction: ambient (or, with use_cache, cached indirect) light,
+// direct light from each visible light source, and caustics. When
+// path tracing, indirect light comes from the path instead.
+static Colour local_light(const RenderContext& ctx, const PhongMaterial& material,
+                          const Point3D& p, const Vector3D& n, const Vector3D& d,
+                          double time, bool use_cache, TileWorker& worker)
+{
+  bool diffuse = max_channel(material.diffuse()) > 0.0;
+
+  // Irradiance E from a uniformly bright surrounding of radiance L is
+  // pi L, so E / pi plays the part the ambient colour otherwise does
+  Colour colour(0.0);
+  if (ctx.path_trace) {
+    // Nothing here; continue_path follows the indirect light
+  } else if (use_cache && ctx.irradiance && diffuse) {
+    colour = (1.0 / M_PI) * indirect_irradiance(ctx, p, n, worker) * material.diffuse();
+  } else {
+    colour = ctx.ambient * material.diffuse();
+  }
+
+  for (std::list<Light*>::const_iterator I = ctx.lights.begin(); I != ctx.lights.end(); ++I) {
+    const Light& light = **I;
+
+    Vector3D l = light.position - p;
+    double dist = l.normalize();
+
+    double ndotl = n.dot(l);
+    if (ndotl <= 0.0) continue;
+
+    Intersection blocker;
+    if (ctx.root->intersect(Ray(p, l, time), EPSILON, dist, blocker, worker.arena)) continue;
+
+    double atten = 1.0 / (light.falloff[0]
+                          + light.falloff[1] * dist
+                          + light.falloff[2] * dist * dist);
+
+    Vector3D r = 2.0 * ndotl * n - l;
+    double rdotv = std::max(0.0, -r.dot(d));
+
+    colour = colour + atten * (light.colour
+                               * (ndotl * material.diffuse()
+                                  + pow(rdotv, material.shininess()) * material.specular()));
+  }
+
+  // Light focused onto the surface by mirrors and lenses
+  if (ctx.caustics && diffuse) {
+    colour = colour + material.diffuse()
+      * ctx.caustics->irradiance(p, n, ctx.photon_gather, ctx.photon_radius,
+                                 worker.arena, worker.gather);
+  }
+
+  return colour;
+}
+
+// Carry a path on from the hit at p, which is its depth'th bounce
+// (counting the eye ray's hit as 0). One way on is picked, with odds in
+// proportion to how much light it passes back: a cosine-distributed
+// diffuse bounce, the mirror reflection, or the refraction. After
+// ROULETTE_DEPTH bounces, a path whose weight has dropped below one
+// may also be ended there (Russian roulette). Whichever ray goes on is
+// weighted up by the odds against it, so the estimate stays unbiased.
+static void continue_path(const RenderContext& ctx, const PhongMaterial& material,
+                          const Point3D& p, const Vector3D& n, const Vector3D& d,
+                          double time, bool entering, const Colour& weight,
+                          int x, int y, int sample, int depth, RayBatch& next)
+{
+  double transparency = material.transparency();
+  Colour diffuse_weight = (1.0 - transparency) * weight * material.diffuse();
+  Colour reflect_weight = weight * (material.reflectivity() * material.specular());
+  Colour transmit_weight = transparency * weight;
+
+  Vector3D refracted;
+  if (transparency > 0.0) {
+    double eta = entering ? 1.0 / material.ior() : material.ior();
+    double cos_i = -d.dot(n);
+    double k = 1.0 - eta * eta * (1.0 - cos_i * cos_i);
+    if (k < 0.0) {
+      // Total internal reflection
+      reflect_weight = reflect_weight + transmit_weight;
+      transmit_weight = Colour(0.0);
+    } else {
+      refracted = normalized(eta * d + (eta * cos_i - sqrt(k)) * n);
+    }
+  }
+
+  double diffuse = max_channel(diffuse_weight);
+  double reflect = max_channel(reflect_weight);
+  double transmit = max_channel(transmit_weight);
+  double total = diffuse + reflect + transmit;
+  if (total <= 0.0) return;
+
+  // Odds of going on are total / scale
+  double scale = depth >= ROULETTE_DEPTH ? std::max(total, 1.0) : total;
+
+  uint32_t pixel = frame_pixel(ctx, x, y);
+  SampleRng rng(ctx.seed, pixel, sample, depth + 1);
+  double u, v;
+  stratified_sample(ctx, pixel, sample, depth + 1, rng, u, v);
+  double choice = scale * rng.next();
+
+  if (choice < diffuse) {
+    Vector3D a = normalized(n.cross(fabs(n[0]) < 0.9 ? Vector3D(1.0, 0.0, 0.0)
+                                                     : Vector3D(0.0, 1.0, 0.0)));
+    Vector3D b = n.cross(a);
+    double sin_theta = sqrt(u);
+    double cos_theta = sqrt(1.0 - u);
+    double phi = 2.0 * M_PI * v;
+    Vector3D dir = (sin_theta * cos(phi)) * a + (sin_theta * sin(phi)) * b + cos_theta * n;
+    next.push(Ray(p, dir, time), (scale / diffuse) * diffuse_weight, x, y, sample);
+  } else if (choice < diffuse + reflect) {
+    Vector3D mirror = d - 2.0 * d.dot(n) * n;
+    next.push(Ray(p, mirror, time), (scale / reflect) * reflect_weight, x, y, sample);
+  } else if (choice < total) {
+    next.push(Ray(p, refracted, time), (scale / transmit) * transmit_weight, x, y, sample);
+  }
+}
+
+// Compute the light leaving a hit, and queue any reflection and
+// refraction rays it spawns into "next" (if it isn't null), scaled by
+// the weight of the ray that got here. When path tracing, the one ray
+// that carries the path on is queued instead.
+static Colour shade(const RenderContext& ctx, const Ray& ray,
+                    const Intersection& hit, const Colour& weight,
+                    int x, int y, int sample, int depth,
+                    RayBatch* next, TileWorker& worker)
+{
+  PhongMaterial textured(DEFAULT_MATERIAL);
+  const PhongMaterial* material = surface_material(ctx, ray, hit, textured);
+
+  Point3D p = ray.at(hit.t);
+  Vector3D d = normalized(ray.dir);
+  Vector3D n = normalized(hit.normal);
+  bool entering = d.dot(n) < 0.0;
+  if (!entering) n = -n;
+
+  Colour colour = local_light(ctx, *material, p, n, d, ray.time, true, worker);
+
+  double transparency = material->transparency();
+  colour = (1.0 - transparency) * colour;
+
+  if (!next) return colour;
+
+  if (ctx.path_trace) {
+    continue_path(ctx, *material, p, n, d, ray.time, entering, weight, x, y, sample, depth, *next);
+    return colour;
+  }
+
+  Vector3D mirror = d - 2.0 * d.dot(n) * n;
+
+  Colour reflect_weight = weight * (material->reflectivity() * material->specular());
+
+  if (transparency > 0.0) {
+    double eta = entering ? 1.0 / material->ior() : material->ior();
+    double cos_i = -d.dot(n);
+    double k = 1.0 - eta * eta * (1.0 - cos_i * cos_i);
+
+    Colour transmit_weight = transparency * weight;
+    if (k < 0.0) {
+      // Total internal reflection
+      reflect_weight = reflect_weight + transmit_weight;
+    } else if (max_channel(transmit_weight) > MIN_WEIGHT) {
+      Vector3D t = eta * d + (eta * cos_i - sqrt(k)) * n;
+      next->push(Ray(p, normalized(t), ray.time), transmit_weight, x, y, sample);
+    }
+  }
+
+  if (max_channel(reflect_weight) > MIN_WEIGHT) {
+    next->push(Ray(p, mirror, ray.time), reflect_weight, x, y, sample);
+  }
+
+  return colour;
+}
+
+// Trace one ray, the depth'th of its path, returning the weighted
+// colour it sees.
+static Colour trace(const RenderContext& ctx, const Ray& ray, const Colour& weight,
+                    int x, int y, int sample, int depth,
+                    RayBatch* next, TileWorker& worker)
+{
+  Intersection hit;
+  if (!ctx.root->intersect(ray, EPSILON, HUGE_VAL, hit, worker.arena)) {
+    return Colour(0.0);
+  }
+  return weight * shade(ctx, ray, hit, weight, x, y, sample, depth, next, worker);
+}
+
+static void add_pixel(Image& img, int x, int y, const Colour& c)
+{
+  img(x, y, 0) += c.R();
+  img(x, y, 1) += c.G();
+  img(x, y, 2) += c.B();
+}
+
+// Add what an eye ray hit to the denoiser's guides.
+static void add_guides(const RenderContext& ctx, DenoiseGuides& guides,
+                       int x, int y, int sample, const Ray& ray, const Intersection& hit)
+{
+  PhongMaterial textured(DEFAULT_MATERIAL);
+  const PhongMaterial* material = surface_material(ctx, ray, hit, textured);
+
+  double transparency = material->transparency();
+  Colour albedo = (1.0 - transparency) * material->diffuse()
+    + material->reflectivity() * material->specular() + Colour(transparency);
+  add_pixel(guides.albedo, x, y, Colour(std::min(albedo.R(), 1.0),
+                                        std::min(albedo.G(), 1.0),
+                                        std::min(albedo.B(), 1.0)));
+
+  Vector3D d = normalized(ray.dir);
+  Vector3D n = normalized(hit.normal);
+  if (n.dot(d) > 0.0) n = -n;
+  for (int i = 0; i < 3; i++) guides.normal(x, y, i) += n[i];
+
+  guides.depth(x, y, 0) += hit.t * ray.dir.length();
+  if (sample == 0) guides.object(x, y, 0) = hit.object;
+}
+
+// Render one tile's share of a pass into the accumulation buffer.
+// Eye rays are traced pixel by pixel; the secondary rays they spawn
+// are then traced a bounce at a time, each bounce sorted for coherence
+// before it's traced.
+//
+// Tiles, and the buffers, cover only the crop region. Rays and random
+// numbers are still derived from full-frame pixel coordinates, so a
+// crop comes out identical to the same pixels of a full render.
+//
+// If noise isn't null, pixels it marks converged are skipped, and the
+// rest have this pass's samples added to their statistics and are
+// checked against ctx.noise_threshold at the end. If guides isn't
+// null, each eye ray's hit is added to it.
+static void render_tile(const RenderContext& ctx, const RenderPass& pass,
+                        TileWorker& worker, Image& accum, std::vector<int>& counts,
+                        std::vector<PixelNoise>* noise, DenoiseGuides* guides,
+                        const GridCell& tile, int tile_size,
+                        const std::vector<GridCell>& pixels)
+{
+  RayBatch& current = worker.current;
+  RayBatch& next = worker.next;
+
+  current.clear();
+  next.clear();
+  worker.arena.reset();
+  RayBatch* spawn = (pass.depth > 0) ? &current : 0;
+
+  // Luminance of each sample, by pixel within the tile and sample
+  // within the pass, summed as its rays come back
+  double* luminance = 0;
+  if (noise) {
+    size_t slots = tile_size * tile_size * pass.samples;
+    luminance = worker.arena.allocate_array<double>(slots);
+    std::fill(luminance, luminance + slots, 0.0);
+  }
+
+  for (std::vector<GridCell>::const_iterator P = pixels.begin(); P != pixels.end(); ++P) {
+    int x = tile.x * tile_size + P->x;
+    int y = tile.y * tile_size + P->y;
+    if (x >= ctx.crop_width || y >= ctx.crop_height) continue;
+    if (noise && (*noise)[y * ctx.crop_width + x].converged) continue;
+
+    int frame_x = ctx.crop_x + x;
+    int frame_y = ctx.crop_y + y;
+
+    for (int i = 0; i < pass.samples; i++) {
+      int sample = pass.first_sample + i;
+
+      // The first sample goes through the pixel centre, the rest are
+      // jittered. Path tracing stratifies every sample.
+      double dx = 0.5, dy = 0.5;
+      if (ctx.path_trace) {
+        SampleRng rng(ctx.seed, frame_y * ctx.width + frame_x, sample, 0);
+        stratified_sample(ctx, frame_y * ctx.width + frame_x, sample, 0, rng, dx, dy);
+      } else if (sample > 0) {
+        SampleRng rng(ctx.seed, frame_y * ctx.width + frame_x, sample, 0);
+        dx = rng.next();
+        dy = rng.next();
+      }
+
+      double time = shutter_time(ctx, frame_y * ctx.width + frame_x, sample);
+      Ray ray = primary_ray(ctx, frame_x + dx, frame_y + dy, time);
+      Intersection hit;
+      Colour c(0.0);
+      if (ctx.root->intersect(ray, EPSILON, HUGE_VAL, hit, worker.arena)) {
+        c = shade(ctx, ray, hit, Colour(1.0), x, y, sample, 0, spawn, worker);
+        if (guides) add_guides(ctx, *guides, x, y, sample, ray, hit);
+      }
+      add_pixel(accum, x, y, c);
+      if (luminance) {
+        luminance[(P->y * tile_size + P->x) * pass.samples + i] = (c.R() + c.G() + c.B()) / 3.0;
+      }
+    }
+    counts[y * ctx.crop_width + x] += pass.samples;
+    worker.primary_rays += pass.samples;
+  }
+
+  for (int depth = 1; depth <= pass.depth && !current.empty(); depth++) {
+    current.sort();
+    next.clear();
+    spawn = (depth < pass.depth) ? &next : 0;
+
+    for (size_t i = 0; i < current.size(); i++) {
+      const SecondaryRay& s = current[i];
+      Colour c = trace(ctx, s.ray, s.weight, s.x, s.y, s.sample, depth, spawn, worker);
+      add_pixel(accum, s.x, s.y, c);
+      if (luminance) {
+        int slot = (s.y % tile_size) * tile_size + s.x % tile_size;
+        luminance[slot * pass.samples + s.sample - pass.first_sample] += (c.R() + c.G() + c.B()) / 3.0;
+      }
+    }
+    worker.secondary_rays += current.size();
+
+    current.swap(next);
+  }
+
+  if (!noise) return;
+
+  for (std::vector<GridCell>::const_iterator P = pixels.begin(); P != pixels.end(); ++P) {
+    int x = tile.x * tile_size + P->x;
+    int y = tile.y * tile_size + P->y;
+    if (x >= ctx.crop_width || y >= ctx.crop_height) continue;
+
+    PixelNoise& pixel = (*noise)[y * ctx.crop_width + x];
+    if (pixel.converged) continue;
+
+    const double* l = luminance + (P->y * tile_size + P->x) * pass.samples;
+    for (int i = 0; i < pass.samples; i++) {
+      pixel.sum += l[i];
+      pixel.sum_squares += l[i] * l[i];
+    }
+
+    // Half-width of the confidence interval of the mean, from the
+    // sample variance
+    int n = counts[y * ctx.crop_width + x];
+    if (n < 2) continue;
+    double mean = pixel.sum / n;
+    double variance = std::max(0.0, (pixel.sum_squares - n * mean * mean) / (n - 1));
+    double error = CONFIDENCE_Z * sqrt(variance / n);
+    pixel.converged = error <= ctx.noise_threshold * std::max(mean, NOISE_FLOOR);
+  }
+}
+
+// Paste a cropped render into the width x height image already saved
+// in filename. If there isn't one (or it's the wrong size), the rest of
+// the frame is left black.
+static void composite_crop(const Image& crop, int crop_x, int crop_y,
+                           int width, int height, const std::string& filename)
+{
+  Image frame;
+  if (!frame.loadPng(filename) || frame.width() != width || frame.height() != height
+      || frame.elements() < 3) {
+    std::cerr << "No " << width << "x" << height << " image in " << filename
+              << " to composite into; starting from black" << std::endl;
+    frame = Image(width, height, 3);
+    std::fill(frame.data(), frame.data() + width * height * 3, 0.0);
+  }
+
+  for (int y = 0; y < crop.height(); y++) {
+    for (int x = 0; x < crop.width(); x++) {
+      for (int i = 0; i < 3; i++) {
+        frame(crop_x + x, crop_y + y, i) = crop(x, y, i);
+      }
+    }
+  }
+
+  frame.savePng(filename);
+}
+
+// Work shared by the render threads: tiles are handed out in
+// traversal order, one at a time, from next_tile.
+struct TileQueue {
+  const RenderContext* ctx;
+  const RenderPass* pass;
+  Image* accum;
+  std::vector<int>* counts;
+  std::vector<PixelNoise>* noise;
+  DenoiseGuides* guides;
+  const std::vector<GridCell>* tiles;
+  const std::vector<GridCell>* pixels;
+  int tile_size;
+
+  volatile long next_tile;
+};
+
+struct WorkerArgs {
+  TileQueue* queue;
+  TileWorker* worker;
+};
+
+static void* render_thread(void* data)
+{
+  WorkerArgs* args = static_cast<WorkerArgs*>(data);
+  TileQueue& queue = *args->queue;
+  TileWorker& worker = *args->worker;
+  double deadline = queue.pass->deadline;
+
+  for (;;) {
+    double now = wall_time();
+    if (deadline > 0.0) {
+      // Don't start a tile we don't expect to finish in time
+      double tile_estimate = worker.tiles ? worker.seconds / worker.tiles : 0.0;
+      if (now + tile_estimate > deadline) break;
+    }
+
+    long i = __sync_fetch_and_add(&queue.next_tile, 1);
+    if (i >= (long)queue.tiles->size()) break;
+
+    render_tile(*queue.ctx, *queue.pass, worker, *queue.accum, *queue.counts,
+                queue.noise, queue.guides,
+                (*queue.tiles)[i], queue.tile_size, *queue.pixels);
+
+    worker.tiles++;
+    worker.seconds += wall_time() - now;
+  }
+  return 0;
+}
+
+// Work shared by the irradiance cache threads during one round. Each
+// tile's new records go in its own slot of "records", so no thread
+// writes to anything another thread reads.
+struct CacheRound {
+  const RenderContext* ctx;
+  const IrradianceCache* cache;
+  const std::vector<GridCell>* tiles;
+  const std::vector<GridCell>* pixels;
+  int tile_size;
+  int stride;
+  std::vector<std::vector<IrradianceRecord> >* records;
+
+  volatile long next_tile;
+};
+
+struct CacheArgs {
+  CacheRound* round;
+  TileWorker* worker;
+};
+
+// Make records for one tile's share of a round: every stride-th pixel
+// whose eye ray hits a diffuse surface not already covered by the
+// cache or by records this tile has made in this round.
+static void cache_tile(const CacheRound& round, TileWorker& worker, const GridCell& tile,
+                       std::vector<IrradianceRecord>& records)
+{
+  const RenderContext& ctx = *round.ctx;
+  worker.arena.reset();
+
+  for (std::vector<GridCell>::const_iterator P = round.pixels->begin();
+       P != round.pixels->end(); ++P) {
+    int x = tile.x * round.tile_size + P->x;
+    int y = tile.y * round.tile_size + P->y;
+    if (x >= ctx.crop_width || y >= ctx.crop_height) continue;
+
+    int frame_x = ctx.crop_x + x;
+    int frame_y = ctx.crop_y + y;
+    if (frame_x % round.stride != 0 || frame_y % round.stride != 0) continue;
+
+    // Records are placed where surfaces are half way through the
+    // shutter
+    Ray ray = primary_ray(ctx, frame_x + 0.5, frame_y + 0.5, 0.5);
+    Intersection hit;
+    if (!ctx.root->intersect(ray, EPSILON, HUGE_VAL, hit, worker.arena)) continue;
+
+    const PhongMaterial* material = dynamic_cast<const PhongMaterial*>(hit.material);
+    if (!material) material = &DEFAULT_MATERIAL;
+    if (max_channel(material->diffuse()) <= 0.0) continue;
+
+    Point3D p = ray.at(hit.t);
+    Vector3D n = normalized(hit.normal);
+    if (n.dot(ray.dir) > 0.0) n = -n;
+
+    IrradianceEstimate estimate(p, n, round.cache->accuracy());
+    round.cache->lookup(estimate);
+    for (size_t i = 0; i < records.size(); i++) {
+      estimate.add(records[i]);
+    }
+    if (estimate.valid()) continue;
+
+    records.push_back(IrradianceRecord());
+    compute_irradiance(ctx, *round.cache, p, n, worker, records.back());
+  }
+}
+
+static void* cache_thread(void* data)
+{
+  CacheArgs* args = static_cast<CacheArgs*>(data);
+  CacheRound& round = *args->round;
+
+  for (;;) {
+    long i = __sync_fetch_and_add(&round.next_tile, 1);
+    if (i >= (long)round.tiles->size()) break;
+
+    cache_tile(round, *args->worker, (*round.tiles)[i], (*round.records)[i]);
+  }
+  return 0;
+}
+
+// Fill the irradiance cache ahead of the render, in rounds of
+// decreasing stride. Tiles within a round run in parallel against the
+// cache as the previous rounds left it; the new records are inserted
+// in tile order once the round is over. Which records get made is then
+// the same however many threads there are, and the render that
+// follows only ever reads the cache.
+//
+// If deadline is non-zero, no round is started that isn't expected to
+// finish before it. Each round looks at four times the pixels of the
+// one before, so is taken to cost four times as much. Returns the
+// number of rounds run; points the skipped rounds would have covered
+// are computed fresh when the render looks them up.
+static int fill_irradiance_cache(const RenderContext& ctx, IrradianceCache& cache,
+                                 double deadline,
+                                 std::vector<TileWorker*>& workers,
+                                 const std::vector<GridCell>& tiles, int tile_size,
+                                 const std::vector<GridCell>& pixels)
+{
+  int thread_count = workers.size();
+  std::vector<CacheArgs> args(thread_count);
+  std::vector<pthread_t> threads(thread_count);
+
+  int rounds = sizeof(IRRADIANCE_STRIDES) / sizeof(IRRADIANCE_STRIDES[0]);
+  double round_seconds = 0.0;
+  for (int r = 0; r < rounds; r++) {
+    double round_start = wall_time();
+    if (deadline > 0.0 && round_start + 4.0 * round_seconds > deadline) return r;
+
+    std::vector<std::vector<IrradianceRecord> > records(tiles.size());
+
+    CacheRound round;
+    round.ctx = &ctx;
+    round.cache = &cache;
+    round.tiles = &tiles;
+    round.pixels = &pixels;
+    round.tile_size = tile_size;
+    round.stride = IRRADIANCE_STRIDES[r];
+    round.records = &records;
+    round.next_tile = 0;
+
+    for (int i = 0; i < thread_count; i++) {
+      args[i].round = &round;
+      args[i].worker = workers[i];
+      pthread_create(&threads[i], 0, cache_thread, &args[i]);
+    }
+    for (int i = 0; i < thread_count; i++) {
+      pthread_join(threads[i], 0);
+    }
+
+    for (size_t t = 0; t < records.size(); t++) {
+      for (size_t i = 0; i < records[t].size(); i++) {
+        cache.insert(records[t][i]);
+      }
+    }
+    round_seconds = wall_time() - round_start;
+  }
+  return rounds;
+}
+
+// Render one pass over every tile, with a thread for each worker.
+// Pixel statistics are kept in noise, and denoiser guides gathered in
+// guides, if they aren't null.
+static PassStats run_pass(const RenderContext& ctx, const RenderPass& pass,
+                          std::vector<TileWorker*>& workers,
+                          Image& accum, std::vector<int>& counts,
+                          std::vector<PixelNoise>* noise, DenoiseGuides* guides,
+                          const std::vector<GridCell>& tiles, int tile_size,
+                          const std::vector<GridCell>& pixels)
+{
+  TileQueue queue;
+  queue.ctx = &ctx;
+  queue.pass = &pass;
+  queue.accum = &accum;
+  queue.counts = &counts;
+  queue.noise = noise;
+  queue.guides = guides;
+  queue.tiles = &tiles;
+  queue.pixels = &pixels;
+  queue.tile_size = tile_size;
+  queue.next_tile = 0;
+
+  int thread_count = workers.size();
+  std::vector<WorkerArgs> args(thread_count);
+  std::vector<pthread_t> threads(thread_count);
+
+  double start = wall_time();
+
+  for (int i = 0; i < thread_count; i++) {
+    TileWorker& worker = *workers[i];
+    worker.tiles = worker.primary_rays = worker.secondary_rays = 0;
+    worker.seconds = 0.0;
+
+    args[i].queue = &queue;
+    args[i].worker = &worker;
+    pthread_create(&threads[i], 0, render_thread, &args[i]);
+  }
+
+  PassStats stats;
+  stats.tiles = stats.primary_rays = stats.secondary_rays = 0;
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], 0);
+    stats.tiles += workers[i]->tiles;
+    stats.primary_rays += workers[i]->primary_rays;
+    stats.secondary_rays += workers[i]->secondary_rays;
+  }
+  stats.seconds = wall_time() - start;
+
+  return stats;
+}
+
+// Average the accumulated samples into img. Pixels without any
+// samples are left alone.
+static void resolve(const Image& accum, const std::vector<int>& counts, Image& img)
+{
+  for (int y = 0; y < img.height(); y++) {
+    for (int x = 0; x < img.width(); x++) {
+      int count = counts[y * img.width() + x];
+      if (count == 0) continue;
+      for (int i = 0; i < 3; i++) {
+        img(x, y, i) = accum(x, y, i) / count;
+      }
+    }
+  }
+}
+
+static void clear_accumulation(Image& accum, std::vector<int>& counts)
+{
+  std::fill(accum.data(), accum.data() + accum.width() * accum.height() * 3, 0.0);
+  std::fill(counts.begin(), counts.end(), 0);
+}
+
+// Samples per pixel to stop at in budget mode, unless -samples asks
+// for more
+static const int BUDGET_MAX_SAMPLES = 256;
+
+// In budget mode, the photon map and irradiance cache may use up to
+// this share of the budget between them; the render gets the rest
+static const double BUDGET_PREPASS_SHARE = 0.5;
+
+// Photons shot to time the photon pass before the budget sets how
+// many can be afforded
+static const long BUDGET_PHOTON_PILOT = 1000;
+
+// Render the best image we can before the deadline, which a4_render
+// sets options.budget seconds after it was called.
+//
+// A quick preview pass (one eye ray per pixel, one bounce) goes first,
+// both as a fallback image and to measure the cost of a ray and how
+// many secondary rays each eye ray spawns. From those we estimate the
+// cost of a pass at each recursion depth and pick the deepest one that
+// leaves room for at least two samples per pixel, then as many samples
+// as fit. The samples are added in passes of doubling size, so if we
+// run short the whole image has been refined about equally. Guides,
+// if wanted, are gathered by the refining passes.
+static void render_budgeted(const RenderContext& ctx, const A4Options& options,
+                            double deadline,
+                            std::vector<TileWorker*>& workers, Image& img,
+                            DenoiseGuides* guides,
+                            const std::vector<GridCell>& tiles, int tile_size,
+                            const std::vector<GridCell>& pixels)
+{
+  Image accum(img.width(), img.height(), 3);
+  std::vector<int> counts(img.width() * img.height());
+  clear_accumulation(accum, counts);
+
+  RenderPass preview;
+  preview.first_sample = 0;
+  preview.samples = 1;
+  preview.depth = std::min(1, options.max_depth);
+  preview.deadline = deadline;
+
+  PassStats stats = run_pass(ctx, preview, workers, accum, counts, 0, 0,
+                             tiles, tile_size, pixels);
+  resolve(accum, counts, img);
+
+  if (stats.tiles < (long)tiles.size()) {
+    std::cerr << "Budget ran out during the preview pass ("
+              << stats.tiles << " of " << tiles.size() << " tiles)" << std::endl;
+    return;
+  }
+
+  double ray_cost = stats.seconds / (stats.primary_rays + stats.secondary_rays);
+  double spawn_rate = (double)stats.secondary_rays / stats.primary_rays;
+  double remaining = deadline - wall_time();
+
+  // Estimated seconds for one sample per pixel traced to "depth"
+  std::vector<double> pass_cost(options.max_depth + 1);
+  double rays_per_sample = 0.0, spawned = 1.0;
+  for (int depth = 0; depth <= options.max_depth; depth++) {
+    rays_per_sample += spawned;
+    spawned *= spawn_rate;
+    pass_cost[depth] = ray_cost * stats.primary_rays * rays_per_sample;
+  }
+
+  int depth = options.max_depth;
+  while (depth > preview.depth && 2.0 * pass_cost[depth] > remaining) depth--;
+
+  int max_samples = std::max(options.samples, BUDGET_MAX_SAMPLES);
+  int samples = (int)std::min((double)max_samples, 0.9 * remaining / pass_cost[depth]);
+
+  std::cerr << "Preview took " << stats.seconds << "s; budget allows about "
+            << samples << " samples per pixel at depth " << depth << std::endl;
+  if (samples < 1) return;
+
+  clear_accumulation(accum, counts);
+
+  RenderPass pass;
+  pass.first_sample = 0;
+  pass.samples = 1;
+  pass.depth = depth;
+  pass.deadline = deadline;
+
+  while (pass.first_sample < samples) {
+    pass.samples = std::min(pass.samples, samples - pass.first_sample);
+    stats = run_pass(ctx, pass, workers, accum, counts, 0, guides,
+                     tiles, tile_size, pixels);
+    if (stats.tiles < (long)tiles.size()) break;
+
+    pass.first_sample += pass.samples;
+    pass.samples *= 2;
+  }
+
+  // Refined pixels replace the preview; any the deadline cut off keep it
+  resolve(accum, counts, img);
+  if (guides) guides->resolve(&counts[0]);
+}
+
+// Path trace up to options.samples samples per pixel, a block of
+// PATH_BLOCK at a time. With a noise threshold, pixels drop out of
+// later passes as they converge, and rendering stops early if they all
+// do.
+static void render_path_traced(const RenderContext& ctx, const A4Options& options,
+                               std::vector<TileWorker*>& workers, Image& img,
+                               DenoiseGuides* guides,
+                               const std::vector<GridCell>& tiles, int tile_size,
+                               const std::vector<GridCell>& pixels)
+{
+  Image accum(img.width(), img.height(), 3);
+  std::vector<int> counts(img.width() * img.height());
+  clear_accumulation(accum, counts);
+
+  std::vector<PixelNoise> noise(counts.size());
+  std::vector<PixelNoise>* tracked = ctx.noise_threshold > 0.0 ? &noise : 0;
+
+  int max_samples = std::max(1, options.samples);
+
+  RenderPass pass;
+  pass.first_sample = 0;
+  pass.depth = options.max_depth;
+  pass.deadline = 0.0;
+
+  double seconds = 0.0;
+  long secondary_rays = 0;
+  size_t converged = 0;
+  while (pass.first_sample < max_samples && converged < noise.size()) {
+    pass.samples = std::min(PATH_BLOCK, max_samples - pass.first_sample);
+    PassStats stats = run_pass(ctx, pass, workers, accum, counts, tracked, guides,
+                               tiles, tile_size, pixels);
+    seconds += stats.seconds;
+    secondary_rays += stats.secondary_rays;
+    pass.first_sample += pass.samples;
+
+    if (tracked) {
+      converged = 0;
+      for (size_t i = 0; i < noise.size(); i++) {
+        if (noise[i].converged) converged++;
+      }
+    }
+  }
+
+  resolve(accum, counts, img);
+  if (guides) guides->resolve(&counts[0]);
+
+  long total_samples = 0;
+  for (size_t i = 0; i < counts.size(); i++) total_samples += counts[i];
+
+  std::cerr << "Path traced " << img.width() << "x" << img.height() << " in "
+            << seconds << "s on " << workers.size() << " threads ("
+            << (double)total_samples / counts.size() << " samples per pixel on average, "
+            << secondary_rays << " secondary rays)" << std::endl;
+  if (tracked) {
+    std::cerr << converged << " of " << noise.size() << " pixels converged to within "
+              << 100.0 * ctx.noise_threshold << "%" << std::endl;
+  }
+}
+
+// Where the extension of a filename starts, or its length if it has
+// none.
+static std::string::size_type extension_start(const std::string& filename)
+{
+  std::string::size_type dot = filename.rfind('.');
+  std::string::size_type slash = filename.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return filename.size();
+  }
+  return dot;
+}
+
+// "scene.png" with "-albedo" (or whatever suffix) added before the
+// extension.
+static std::string suffixed_filename(const std::string& filename, const std::string& suffix)
+{
+  std::string::size_type dot = extension_start(filename);
+  return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+// Save the guides beside the image as PNGs. Normals are mapped from
+// [-1, 1] to [0, 1], and depth is scaled so the farthest hit is white.
+static void write_guides(const DenoiseGuides& guides, const std::string& filename)
+{
+  int width = guides.albedo.width(), height = guides.albedo.height();
+
+  Image albedo(guides.albedo);
+  albedo.savePng(suffixed_filename(filename, "-albedo"));
+
+  Image normal(width, height, 3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int i = 0; i < 3; i++) normal(x, y, i) = 0.5 * guides.normal(x, y, i) + 0.5;
+    }
+  }
+  normal.savePng(suffixed_filename(filename, "-normal"));
+
+  const double* depth = guides.depth.data();
+  double max_depth = *std::max_element(depth, depth + width * height);
+  Image scaled(width, height, 1);
+  for (int i = 0; i < width * height; i++) {
+    scaled.data()[i] = max_depth > 0.0 ? depth[i] / max_depth : 0.0;
+  }
+  scaled.savePng(suffixed_filename(filename, "-depth"));
+
+  std::cerr << "Wrote albedo, normal and depth guides beside " << filename << std::endl;
+}
 
 void a4_render(// What to render
                SceneNode* root,
@@ -12,37 +1285,285 @@ void a4_render(// What to render
                const Vector3D& up, double fov,
                // Lighting parameters
                const Colour& ambient,
-               const std::list<Light*>& lights
+               const std::list<Light*>& lights,
+               // Everything else
+               const A4Options& options
                )
 {
-  // Fill in raytracing code here.
+  std::cerr << "Rendering " << filename << " (" << width << "x" << height << ")" << std::endl;
 
-  std::cerr << "Stub: a4_render(" << root << ",\n     "
-            << filename << ", " << width << ", " << height << ",\n     "
-            << eye << ", " << view << ", " << up << ", " << fov << ",\n     "
-            << ambient << ",\n     {";
+  // A budget covers everything from here on, setup and all. The photon
+  // and irradiance passes are cut short to leave the render its share.
+  double render_start = wall_time();
+  double deadline = 0.0, prepass_deadline = 0.0;
+  if (options.budget > 0.0) {
+    deadline = render_start + options.budget;
+    prepass_deadline = render_start + BUDGET_PREPASS_SHARE * options.budget;
+  }
 
-  for (std::list<Light*>::const_iterator I = lights.begin(); I != lights.end(); ++I) {
-    if (I != lights.begin()) std::cerr << ", ";
-    std::cerr << **I;
+  int gathered = options.gather_spheres ? root->gather_spheres() : 0;
+  if (gathered > 0) {
+    std::cerr << "Gathered " << gathered << " spheres into sets indexed by "
+              << accelerator_name(PrimitiveSet::default_accelerator()) << std::endl;
   }
-  std::cerr << "});" << std::endl;
-  
-  // For now, just make a sample image.
+  root->update_bounds();
+  std::cerr << "Scene: " << SceneNode::count() << " nodes in "
+            << SceneNode::storage_bytes() / 1024 << " KiB" << std::endl;
 
-  Image img(width, height, 3);
+  TextureCache& textures = texture_cache();
+  textures.set_max_bytes(options.texture_memory);
+  textures.reset_stats();
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < height; x++) {
-      // Red: increasing from top to bottom
-      img(x, y, 0) = (double)y / height;
-      // Green: increasing from left to right
-      img(x, y, 1) = (double)x / width;
-      // Blue: in lower-left and upper-right corners
-      img(x, y, 2) = ((y < height/2 && x < height/2)
-                      || (y >= height/2 && x >= height/2)) ? 1.0 : 0.0;
-    }
-  }
-  img.savePng(filename);
-  
+  RenderContext ctx(root, ambient, lights);
+  ctx.width = width;
+  ctx.height = height;
+
+  // Clamp the crop window to the frame
+  ctx.crop_x = 0;
+  ctx.crop_y = 0;
+  ctx.crop_width = width;
+  ctx.crop_height = height;
+  if (options.crop_width > 0 && options.crop_height > 0) {
+    ctx.crop_x = std::min(std::max(options.crop_x, 0), width);
+    ctx.crop_y = std::min(std::max(options.crop_y, 0), height);
+    ctx.crop_width = std::min(options.crop_x + options.crop_width, width) - ctx.crop_x;
+    ctx.crop_height = std::min(options.crop_y + options.crop_height, height) - ctx.crop_y;
+    if (ctx.crop_width <= 0 || ctx.crop_height <= 0) {
+      std::cerr << "Crop window lies outside the " << width << "x" << height
+                << " image; nothing to render" << std::endl;
+      return;
+    }
+    std::cerr << "Cropping to " << ctx.crop_width << "x" << ctx.crop_height
+              << " at (" << ctx.crop_x << ", " << ctx.crop_y << ")" << std::endl;
+  }
+  ctx.seed = options.seed;
+  ctx.path_trace = options.path_trace;
+  ctx.noise_threshold = options.noise_threshold;
+
+  int thread_count = std::max(1, options.threads);
+
+  // Shoot the caustic photons first; shading reads the finished map
+  PhotonMap caustics;
+  ctx.caustics = 0;
+  ctx.photon_gather = options.photon_gather;
+  ctx.photon_radius = options.photon_radius;
+  long photons = options.photons;
+  if (photons > 0 && prepass_deadline > 0.0) {
+    // Time a few photons, then shoot as many as fit in the photon
+    // pass's part of the pre-pass share: all of it, or half if the
+    // irradiance cache needs the rest
+    double share = prepass_deadline - wall_time();
+    if (options.irradiance_accuracy > 0.0 && !options.path_trace) share *= 0.5;
+
+    long pilot = std::min(photons, BUDGET_PHOTON_PILOT);
+    caustics.trace(root, lights, pilot, options.max_depth, options.seed, thread_count);
+    double photon_cost = caustics.trace_seconds() / std::max(1L, caustics.emitted());
+    double affordable = (share - caustics.trace_seconds()) / std::max(photon_cost, 1e-9);
+    // Nothing is emitted if there's nothing specular to aim at
+    if (caustics.emitted() > 0 && affordable < photons) {
+      photons = std::max(0L, (long)affordable);
+      std::cerr << "Budget cuts the photon map to " << photons << " of "
+                << options.photons << " photons" << std::endl;
+    }
+  }
+  if (photons > 0) {
+    caustics.trace(root, lights, photons, options.max_depth, options.seed,
+                   thread_count);
+    caustics.balance(thread_count);
+    ctx.caustics = &caustics;
+
+    if (ctx.photon_radius <= 0.0) {
+      BBox bounds = root->bounds();
+      ctx.photon_radius = PHOTON_RADIUS_FRACTION * (bounds.max() - bounds.min()).length();
+    }
+
+    std::cerr << "Photon map: " << caustics.size() << " caustic photons of "
+              << caustics.emitted() << " shot (traced in " << caustics.trace_seconds()
+              << "s, kd-tree built in " << caustics.balance_seconds() << "s)" << std::endl;
+  }
+
+  // Set up the camera frame, with fov as the vertical field of view
+  double half_height = tan(fov * M_PI / 360.0);
+  double half_width = half_height * width / height;
+  ctx.eye = eye;
+  ctx.forward = normalized(view);
+  ctx.right = half_width * normalized(view.cross(up));
+  ctx.up = half_height * normalized(ctx.right.cross(view));
+  ctx.pixel_angle = 2.0 * half_height / height;
+
+  Image img(ctx.crop_width, ctx.crop_height, 3);
+
+  // Work through the image a tile at a time, visiting the tiles and
+  // the pixels inside each one along the same curve. Neighbouring
+  // samples then stay close together in both image and scene space,
+  // instead of every new scanline starting back at the far edge.
+  int tile_size = std::max(1, options.tile_size);
+  int tiles_x = (ctx.crop_width + tile_size - 1) / tile_size;
+  int tiles_y = (ctx.crop_height + tile_size - 1) / tile_size;
+
+  std::vector<GridCell> tiles, pixels;
+  traversal_order(options.order, tiles_x, tiles_y, tiles);
+  traversal_order(options.order, tile_size, tile_size, pixels);
+
+  std::vector<TileWorker*> workers(thread_count);
+  for (int i = 0; i < thread_count; i++) {
+    workers[i] = new TileWorker();
+  }
+
+  // Fill the irradiance cache; the render only interpolates from it.
+  // Path tracing follows indirect light itself, so has no use for one.
+  IrradianceCache* irradiance = 0;
+  ctx.irradiance = 0;
+  ctx.irradiance_samples = std::max(1, options.irradiance_samples);
+  if (options.irradiance_accuracy > 0.0 && !options.path_trace) {
+    double cache_start = wall_time();
+    if (prepass_deadline > 0.0 && cache_start >= prepass_deadline) {
+      std::cerr << "Budget leaves no time for the irradiance cache; "
+                << "using ambient light" << std::endl;
+    } else {
+      irradiance = new IrradianceCache(root->bounds(), options.irradiance_accuracy);
+      int rounds = fill_irradiance_cache(ctx, *irradiance, prepass_deadline, workers,
+                                         tiles, tile_size, pixels);
+      ctx.irradiance = irradiance;
+
+      std::cerr << "Irradiance cache: " << irradiance->size() << " records in "
+                << irradiance->nodes() << " octree nodes, filled in "
+                << wall_time() - cache_start << "s";
+      int all_rounds = sizeof(IRRADIANCE_STRIDES) / sizeof(IRRADIANCE_STRIDES[0]);
+      if (rounds < all_rounds) {
+        std::cerr << " (budget allowed " << rounds << " of " << all_rounds << " rounds)";
+      }
+      std::cerr << std::endl;
+    }
+  }
+
+  // Albedo, normal and depth, for the denoiser or to be written out
+  DenoiseGuides* guides = 0;
+  if (options.denoise || options.write_guides || options.write_aov) {
+    guides = new DenoiseGuides(ctx.crop_width, ctx.crop_height);
+  }
+
+  double start = wall_time();
+
+  if (options.path_trace && options.budget <= 0.0) {
+    render_path_traced(ctx, options, workers, img, guides, tiles, tile_size, pixels);
+  } else if (options.budget > 0.0) {
+    std::fill(img.data(), img.data() + ctx.crop_width * ctx.crop_height * 3, 0.0);
+    render_budgeted(ctx, options, deadline, workers, img, guides,
+                    tiles, tile_size, pixels);
+
+    double end = wall_time();
+    std::cerr << "Rendered " << ctx.crop_width << "x" << ctx.crop_height << " in "
+              << end - start << "s on " << thread_count << " threads, "
+              << end - render_start << "s in all (budget " << options.budget << "s)"
+              << std::endl;
+  } else {
+    Image accum(ctx.crop_width, ctx.crop_height, 3);
+    std::vector<int> counts(ctx.crop_width * ctx.crop_height);
+    clear_accumulation(accum, counts);
+
+    RenderPass pass;
+    pass.first_sample = 0;
+    pass.samples = std::max(1, options.samples);
+    pass.depth = options.max_depth;
+    pass.deadline = 0.0;
+
+    PassStats stats = run_pass(ctx, pass, workers, accum, counts, 0, guides,
+                               tiles, tile_size, pixels);
+    resolve(accum, counts, img);
+    if (guides) guides->resolve(&counts[0]);
+
+    std::cerr << "Rendered " << ctx.crop_width << "x" << ctx.crop_height << " in "
+              << stats.seconds << "s on " << thread_count << " threads ("
+              << stats.secondary_rays << " secondary rays)" << std::endl;
+  }
+
+  // Transient allocations made while tracing. Once the arenas have
+  // grown to their working size, every one of these is a pointer bump;
+  // the heap is only touched for new arena blocks.
+  long arena_allocations = 0, arena_blocks = 0;
+  size_t arena_bytes = 0;
+  GatherStats gather;
+  IrradianceStats cached;
+  for (int i = 0; i < thread_count; i++) {
+    arena_allocations += workers[i]->arena.allocations();
+    arena_blocks += workers[i]->arena.heap_blocks();
+    arena_bytes += workers[i]->arena.heap_bytes();
+    gather.gathers += workers[i]->gather.gathers;
+    gather.nodes += workers[i]->gather.nodes;
+    gather.photons += workers[i]->gather.photons;
+    gather.seconds += workers[i]->gather.seconds;
+    cached.lookups += workers[i]->irradiance.lookups;
+    cached.interpolated += workers[i]->irradiance.interpolated;
+    cached.computed += workers[i]->irradiance.computed;
+    delete workers[i];
+  }
+  std::cerr << "Arena: " << arena_allocations << " transient allocations, "
+            << arena_blocks << " heap blocks (" << arena_bytes / 1024 << " KiB)"
+            << std::endl;
+
+  if (ctx.caustics && gather.gathers > 0) {
+    std::cerr << "Photon gathers: " << gather.gathers << ", visiting "
+              << (double)gather.nodes / gather.gathers << " nodes and using "
+              << (double)gather.photons / gather.gathers << " photons each ("
+              << gather.seconds / thread_count << "s per thread)" << std::endl;
+  }
+
+  if (ProxyNode::count() > 0) {
+    std::cerr << "Proxies: " << ProxyNode::loaded() << " of " << ProxyNode::count()
+              << " loaded" << std::endl;
+  }
+
+  TextureStats texture_stats = textures.stats();
+  long tile_reads = texture_stats.hits + texture_stats.misses;
+  if (tile_reads > 0) {
+    std::cerr << "Texture cache: " << 100.0 * texture_stats.hits / tile_reads
+              << "% of " << tile_reads << " tile reads hit, "
+              << (texture_stats.bytes_loaded >> 10) << " KiB loaded, "
+              << texture_stats.evictions << " tiles evicted ("
+              << (textures.bytes() >> 10) << " of " << (textures.max_bytes() >> 10)
+              << " KiB in use)" << std::endl;
+  }
+
+  if (ctx.irradiance && cached.lookups > 0) {
+    std::cerr << "Irradiance lookups: " << cached.lookups << ", "
+              << cached.interpolated << " interpolated, " << cached.computed
+              << " computed fresh" << std::endl;
+  }
+  delete irradiance;
+
+  // Save the colour before it's denoised, so the AOV file has exactly
+  // what the renderer produced
+  Image raw;
+  if (options.write_aov) raw = img;
+
+  if (guides && options.denoise) {
+    double denoise_start = wall_time();
+    denoise(img, *guides, DenoiseOptions(), thread_count);
+    std::cerr << "Denoised in " << wall_time() - denoise_start << "s" << std::endl;
+  }
+  if (guides && options.write_guides) {
+    write_guides(*guides, filename);
+  }
+  if (guides && options.write_aov) {
+    std::vector<AovLayer> layers;
+    layers.push_back(AovLayer("colour", raw));
+    if (options.denoise) layers.push_back(AovLayer("denoised", img));
+    layers.push_back(AovLayer("albedo", guides->albedo));
+    layers.push_back(AovLayer("normal", guides->normal, "XYZ"));
+    layers.push_back(AovLayer("depth", guides->depth));
+    layers.push_back(AovLayer("object", guides->object));
+
+    std::string aov_filename = filename.substr(0, extension_start(filename)) + ".aov";
+    if (write_aov(aov_filename, layers)) {
+      std::cerr << "Wrote " << aov_filename << std::endl;
+    }
+  }
+  delete guides;
+
+  if (options.composite && (ctx.crop_width < width || ctx.crop_height < height)) {
+    composite_crop(img, ctx.crop_x, ctx.crop_y, width, height, filename);
+  } else {
+    img.savePng(filename);
+  }
 }
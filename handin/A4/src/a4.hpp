@@ -5,6 +5,77 @@
 #include "algebra.hpp"
 #include "scene.hpp"
 #include "light.hpp"
+#include "traversal.hpp"
+
+// Rendering options that don't come from the scene file. main() fills
+// in a4_options from the command line before running the script.
+struct A4Options {
+  A4Options();
+
+  // Order in which tiles, and pixels within a tile, are rendered
+  TraversalOrder order;
+  // Tiles are tile_size x tile_size pixels
+  int tile_size;
+  // Maximum number of reflection/refraction bounces
+  int max_depth;
+  // Worker threads to render tiles with
+  int threads;
+  // Jittered samples per pixel (the most per pixel, when path
+  // tracing), and the seed for the jitter
+  int samples;
+  unsigned int seed;
+
+  // If true, render with a Monte Carlo path tracer: indirect light is
+  // followed by random bounces instead of coming from the ambient term.
+  // If noise_threshold is positive, a pixel stops taking samples once
+  // its mean is known to within this fraction (95% confidence).
+  bool path_trace;
+  double noise_threshold;
+
+  // Whether to filter the finished image with the denoiser, and whether
+  // to save the albedo, normal and depth buffers that guide it
+  bool denoise;
+  bool write_guides;
+
+  // Whether to save unclamped colour, the guides and object ids to an
+  // AOV file (see aov.hpp) beside the image
+  bool write_aov;
+
+  // Most memory, in bytes, the texture cache may hold
+  size_t texture_memory;
+
+  // Region of the image to render, in pixels. A crop_width of zero
+  // renders the whole image.
+  int crop_x, crop_y, crop_width, crop_height;
+  // If true, a cropped render is pasted into the existing output image
+  // rather than written out as an image of its own
+  bool composite;
+
+  // If positive, render the best image possible in this many seconds,
+  // choosing the sample count and depth (up to max_depth) to fit
+  double budget;
+
+  // Caustic photons to shoot before rendering (none if zero), and how
+  // many of the nearest to gather, from within what radius, for each
+  // estimate. A radius of zero picks one from the size of the scene.
+  long photons;
+  int photon_gather;
+  double photon_radius;
+
+  // If positive, compute indirect diffuse light with an irradiance
+  // cache of this accuracy (Ward's a; smaller is more accurate), using
+  // irradiance_samples hemisphere rays for each record
+  double irradiance_accuracy;
+  int irradiance_samples;
+
+  // If true, a4_render first rewrites the scene it's given, putting
+  // runs of sibling spheres into sets traced through PrimitiveSet's
+  // default accelerator (see SceneNode::gather_spheres). main() sets
+  // this when -accel is given.
+  bool gather_spheres;
+};
+
+extern A4Options a4_options;
 
 void a4_render(// What to render
                SceneNode* root,
@@ -17,7 +88,9 @@ void a4_render(// What to render
                const Vector3D& up, double fov,
                // Lighting parameters
                const Colour& ambient,
-               const std::list<Light*>& lights
+               const std::list<Light*>& lights,
+               // Everything else
+               const A4Options& options = a4_options
                );
 
 #endif
@@ -0,0 +1,676 @@
+#include "accel.hpp"
+#include <algorithm>
+#include <cmath>
+
+// Most shapes a BVH leaf holds
+static const int BVH_LEAF_SHAPES = 4;
+// Candidate split planes tried along each BVH node's widest axis
+static const int BVH_BINS = 12;
+// Deepest a BVH goes, which bounds its traversal stack
+static const int BVH_MAX_DEPTH = 64;
+
+// Grid cells per shape
+static const double GRID_DENSITY = 2.0;
+// Most cells along one axis of a grid
+static const int GRID_MAX_RESOLUTION = 256;
+// Cells listing more shapes than this get a grid of their own, for
+// ACCEL_GRID2
+static const int GRID_CROWDED = 8;
+
+bool parse_accelerator(const std::string& name, AcceleratorType& type)
+{
+  if (name == "bvh") {
+    type = ACCEL_BVH;
+  } else if (name == "grid") {
+    type = ACCEL_GRID;
+  } else if (name == "grid2") {
+    type = ACCEL_GRID2;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* accelerator_name(AcceleratorType type)
+{
+  switch (type) {
+  case ACCEL_BVH: return "bvh";
+  case ACCEL_GRID: return "grid";
+  case ACCEL_GRID2: return "grid2";
+  }
+  return "?";
+}
+
+ShapeSet::~ShapeSet()
+{
+}
+
+static bool enters_before(const Span& a, const Span& b)
+{
+  return a.enter.t < b.enter.t;
+}
+
+void ShapeSet::union_spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  // Gather every shape's spans, sort them and merge the overlaps.
+  // CSG on sets is rare enough that this doesn't use an accelerator.
+  Span* all = 0;
+  int count = 0, capacity = 0;
+  int shapes = shape_count();
+  for (int i = 0; i < shapes; i++) {
+    if (!shape_bounds(i).hit(ray, -HUGE_VAL, HUGE_VAL)) continue;
+
+    SpanList member;
+    shape_spans(i, ray, arena, member);
+    if (count + member.count > capacity) {
+      capacity = std::max(8, std::max(2 * capacity, count + member.count));
+      Span* grown = arena.allocate_array<Span>(capacity);
+      std::copy(all, all + count, grown);
+      all = grown;
+    }
+    std::copy(member.spans, member.spans + member.count, all + count);
+    count += member.count;
+  }
+
+  out.count = 0;
+  if (count == 0) return;
+
+  std::sort(all, all + count, enters_before);
+  out.spans = all;
+  for (int i = 0; i < count; i++) {
+    if (out.count > 0 && all[i].enter.t <= all[out.count - 1].exit.t) {
+      if (all[i].exit.t > all[out.count - 1].exit.t) all[out.count - 1].exit = all[i].exit;
+    } else {
+      all[out.count++] = all[i];
+    }
+  }
+}
+
+Accelerator::~Accelerator()
+{
+}
+
+static double surface_area(const BBox& box)
+{
+  if (box.empty()) return 0.0;
+  Vector3D d = box.max() - box.min();
+  return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static Point3D centre(const BBox& box)
+{
+  return box.min() + 0.5 * (box.max() - box.min());
+}
+
+// Where the ray is inside the box, within (tmin, tmax)
+static bool clip(const BBox& box, const Ray& ray, double tmin, double tmax,
+                 double& t0, double& t1)
+{
+  if (box.empty()) return false;
+
+  for (int a = 0; a < 3; a++) {
+    if (ray.dir[a] == 0.0) {
+      if (ray.origin[a] < box.min()[a] || ray.origin[a] > box.max()[a]) return false;
+      continue;
+    }
+    double inv = 1.0 / ray.dir[a];
+    double near = (box.min()[a] - ray.origin[a]) * inv;
+    double far = (box.max()[a] - ray.origin[a]) * inv;
+    if (near > far) std::swap(near, far);
+    tmin = std::max(tmin, near);
+    tmax = std::min(tmax, far);
+    if (tmin > tmax) return false;
+  }
+  t0 = tmin;
+  t1 = tmax;
+  return true;
+}
+
+// A binary BVH over shape boxes, built and laid out like Mesh's: an
+// interior node's first child follows it and its second is at
+// "offset"; a leaf holds shapes m_order[offset, offset + count).
+class BVHAccelerator : public Accelerator {
+public:
+  explicit BVHAccelerator(const ShapeSet& shapes);
+
+  virtual bool intersect(const ShapeSet& shapes, const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual size_t memory_bytes() const;
+
+private:
+  struct Node {
+    BBox box;
+    int offset;
+    int count;
+    int axis;
+  };
+
+  int build(const std::vector<BBox>& boxes, const std::vector<Point3D>& centres,
+            int first, int last, int depth);
+
+  std::vector<Node> m_nodes;
+  std::vector<int> m_order;
+};
+
+BVHAccelerator::BVHAccelerator(const ShapeSet& shapes)
+{
+  int count = shapes.shape_count();
+  if (count == 0) return;
+
+  std::vector<BBox> boxes(count);
+  std::vector<Point3D> centres(count);
+  m_order.resize(count);
+  for (int i = 0; i < count; i++) {
+    boxes[i] = shapes.shape_bounds(i);
+    centres[i] = centre(boxes[i]);
+    m_order[i] = i;
+  }
+
+  m_nodes.reserve(2 * count / BVH_LEAF_SHAPES + 1);
+  build(boxes, centres, 0, count, 0);
+}
+
+// Comparisons for partitioning shapes by their centres
+struct CentreBelow {
+  CentreBelow(const std::vector<Point3D>& centres, int axis, double split)
+    : centres(centres), axis(axis), split(split)
+  {
+  }
+  bool operator()(int i) const { return centres[i][axis] < split; }
+
+  const std::vector<Point3D>& centres;
+  int axis;
+  double split;
+};
+
+struct CentreLess {
+  CentreLess(const std::vector<Point3D>& centres, int axis)
+    : centres(centres), axis(axis)
+  {
+  }
+  bool operator()(int a, int b) const { return centres[a][axis] < centres[b][axis]; }
+
+  const std::vector<Point3D>& centres;
+  int axis;
+};
+
+int BVHAccelerator::build(const std::vector<BBox>& boxes, const std::vector<Point3D>& centres,
+                          int first, int last, int depth)
+{
+  BBox box, centre_box;
+  for (int i = first; i < last; i++) {
+    box.expand(boxes[m_order[i]]);
+    centre_box.expand(centres[m_order[i]]);
+  }
+
+  int index = m_nodes.size();
+  m_nodes.push_back(Node());
+  m_nodes[index].box = box;
+
+  Vector3D spread = centre_box.max() - centre_box.min();
+  int axis = 0;
+  if (spread[1] > spread[axis]) axis = 1;
+  if (spread[2] > spread[axis]) axis = 2;
+
+  int count = last - first;
+  if (count <= BVH_LEAF_SHAPES || depth >= BVH_MAX_DEPTH - 1 || spread[axis] <= 0.0) {
+    m_nodes[index].offset = first;
+    m_nodes[index].count = count;
+    m_nodes[index].axis = 0;
+    return index;
+  }
+
+  double min = centre_box.min()[axis];
+  double scale = BVH_BINS / spread[axis];
+  BBox bins[BVH_BINS];
+  int counts[BVH_BINS] = { 0 };
+  for (int i = first; i < last; i++) {
+    int bin = std::min((int)((centres[m_order[i]][axis] - min) * scale), BVH_BINS - 1);
+    counts[bin]++;
+    bins[bin].expand(boxes[m_order[i]]);
+  }
+
+  double below_cost[BVH_BINS];
+  BBox below;
+  int below_count = 0;
+  for (int s = 1; s < BVH_BINS; s++) {
+    below.expand(bins[s - 1]);
+    below_count += counts[s - 1];
+    below_cost[s] = surface_area(below) * below_count;
+  }
+  int split = 0;
+  double best = HUGE_VAL;
+  BBox above;
+  int above_count = 0;
+  for (int s = BVH_BINS - 1; s >= 1; s--) {
+    above.expand(bins[s]);
+    above_count += counts[s];
+    double cost = below_cost[s] + surface_area(above) * above_count;
+    if (above_count > 0 && above_count < count && cost < best) {
+      best = cost;
+      split = s;
+    }
+  }
+
+  int middle = first;
+  if (split > 0) {
+    middle = std::partition(m_order.begin() + first, m_order.begin() + last,
+                            CentreBelow(centres, axis, min + split / scale)) - m_order.begin();
+  }
+  if (split == 0 || middle == first || middle == last) {
+    middle = (first + last) / 2;
+    std::nth_element(m_order.begin() + first, m_order.begin() + middle, m_order.begin() + last,
+                     CentreLess(centres, axis));
+  }
+
+  build(boxes, centres, first, middle, depth + 1);
+  int second = build(boxes, centres, middle, last, depth + 1);
+  m_nodes[index].offset = second;
+  m_nodes[index].count = 0;
+  m_nodes[index].axis = axis;
+  return index;
+}
+
+bool BVHAccelerator::intersect(const ShapeSet& shapes, const Ray& ray, double tmin, double tmax,
+                               Intersection& hit) const
+{
+  if (m_nodes.empty()) return false;
+
+  bool found = false;
+  int stack[BVH_MAX_DEPTH];
+  int top = 0;
+  int node = 0;
+
+  for (;;) {
+    const Node& n = m_nodes[node];
+    if (n.box.hit(ray, tmin, tmax)) {
+      if (n.count == 0) {
+        int near = node + 1, far = n.offset;
+        if (ray.dir[n.axis] < 0.0) std::swap(near, far);
+        stack[top++] = far;
+        node = near;
+        continue;
+      }
+
+      for (int i = n.offset; i < n.offset + n.count; i++) {
+        if (shapes.shape_intersect(m_order[i], ray, tmin, tmax, hit)) {
+          tmax = hit.t;
+          found = true;
+        }
+      }
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+  return found;
+}
+
+size_t BVHAccelerator::memory_bytes() const
+{
+  return sizeof(*this) + m_nodes.capacity() * sizeof(Node) + m_order.capacity() * sizeof(int);
+}
+
+// A uniform grid over the shapes' bounds. The shapes listed in each
+// cell are stored together, cell after cell. With nesting, cells
+// listing more than GRID_CROWDED shapes get a grid of their own (only
+// one level deep), so clumps of shapes don't make the whole grid finer.
+class GridAccelerator : public Accelerator {
+public:
+  GridAccelerator(const ShapeSet& shapes, bool nested);
+
+  virtual bool intersect(const ShapeSet& shapes, const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual size_t memory_bytes() const;
+
+  virtual ~GridAccelerator();
+
+private:
+  GridAccelerator(const std::vector<BBox>& boxes, const std::vector<int>& shapes,
+                  const BBox& box, bool nested);
+
+  void build(const std::vector<BBox>& boxes, const std::vector<int>& shapes, bool nested);
+
+  // Range of cells along an axis a coordinate interval overlaps
+  int cell_at(int axis, double x) const;
+
+  BBox m_box;
+  int m_resolution[3];
+  double m_cell_size[3];
+
+  // The shapes in cell c are m_shapes[m_start[c], m_start[c + 1])
+  std::vector<int> m_start;
+  std::vector<int> m_shapes;
+
+  // Grids for crowded cells, and which cell each belongs to (both
+  // empty without nesting)
+  std::vector<int> m_subgrid;
+  std::vector<GridAccelerator*> m_subgrids;
+};
+
+GridAccelerator::GridAccelerator(const ShapeSet& shapes, bool nested)
+{
+  int count = shapes.shape_count();
+  std::vector<BBox> boxes(count);
+  std::vector<int> all(count);
+  for (int i = 0; i < count; i++) {
+    boxes[i] = shapes.shape_bounds(i);
+    m_box.expand(boxes[i]);
+    all[i] = i;
+  }
+  build(boxes, all, nested);
+}
+
+GridAccelerator::GridAccelerator(const std::vector<BBox>& boxes, const std::vector<int>& shapes,
+                                 const BBox& box, bool nested)
+  : m_box(box)
+{
+  build(boxes, shapes, nested);
+}
+
+GridAccelerator::~GridAccelerator()
+{
+  for (size_t i = 0; i < m_subgrids.size(); i++) delete m_subgrids[i];
+}
+
+void GridAccelerator::build(const std::vector<BBox>& boxes, const std::vector<int>& shapes,
+                            bool nested)
+{
+  for (int a = 0; a < 3; a++) {
+    m_resolution[a] = 1;
+    m_cell_size[a] = 0.0;
+  }
+  m_start.assign(2, 0);
+  if (shapes.empty() || m_box.empty()) return;
+
+  // Cells as near cubical as possible, about GRID_DENSITY per shape.
+  // Flat axes still get some thickness, so the volume isn't zero.
+  Vector3D extent = m_box.max() - m_box.min();
+  double largest = std::max(extent[0], std::max(extent[1], extent[2]));
+  double volume = 1.0;
+  for (int a = 0; a < 3; a++) volume *= std::max(extent[a], 1e-3 * largest);
+  double per_unit = pow(GRID_DENSITY * shapes.size() / volume, 1.0 / 3.0);
+  int cells = 1;
+  for (int a = 0; a < 3; a++) {
+    int resolution = (int)(extent[a] * per_unit + 0.5);
+    m_resolution[a] = std::max(1, std::min(resolution, GRID_MAX_RESOLUTION));
+    m_cell_size[a] = extent[a] / m_resolution[a];
+    cells *= m_resolution[a];
+  }
+
+  // Count the cells each shape overlaps, then fill them in
+  std::vector<int> counts(cells + 1, 0);
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t s = 0; s < shapes.size(); s++) {
+      const BBox& box = boxes[shapes[s]];
+      int lo[3], hi[3];
+      for (int a = 0; a < 3; a++) {
+        lo[a] = cell_at(a, box.min()[a]);
+        hi[a] = cell_at(a, box.max()[a]);
+      }
+      for (int z = lo[2]; z <= hi[2]; z++) {
+        for (int y = lo[1]; y <= hi[1]; y++) {
+          for (int x = lo[0]; x <= hi[0]; x++) {
+            int c = (z * m_resolution[1] + y) * m_resolution[0] + x;
+            if (pass == 0) {
+              counts[c]++;
+            } else {
+              m_shapes[counts[c]++] = shapes[s];
+            }
+          }
+        }
+      }
+    }
+
+    if (pass == 0) {
+      m_start.assign(cells + 1, 0);
+      for (int c = 0; c < cells; c++) m_start[c + 1] = m_start[c] + counts[c];
+      m_shapes.resize(m_start[cells]);
+      std::copy(m_start.begin(), m_start.end() - 1, counts.begin());
+    }
+  }
+
+  if (!nested) return;
+
+  m_subgrid.assign(cells, -1);
+  for (int c = 0; c < cells; c++) {
+    int count = m_start[c + 1] - m_start[c];
+    if (count <= GRID_CROWDED) continue;
+
+    int x = c % m_resolution[0];
+    int y = c / m_resolution[0] % m_resolution[1];
+    int z = c / (m_resolution[0] * m_resolution[1]);
+    int cell[3] = { x, y, z };
+    Point3D min, max;
+    for (int a = 0; a < 3; a++) {
+      min[a] = m_box.min()[a] + cell[a] * m_cell_size[a];
+      max[a] = cell[a] == m_resolution[a] - 1 ? m_box.max()[a] : min[a] + m_cell_size[a];
+    }
+
+    // The subgrid only needs to cover the part of the cell its
+    // shapes are in
+    std::vector<int> inside(m_shapes.begin() + m_start[c], m_shapes.begin() + m_start[c + 1]);
+    BBox used;
+    for (size_t i = 0; i < inside.size(); i++) used.expand(boxes[inside[i]]);
+    m_subgrid[c] = m_subgrids.size();
+    m_subgrids.push_back(new GridAccelerator(boxes, inside,
+                                             used.intersection(BBox(min, max)), false));
+  }
+}
+
+int GridAccelerator::cell_at(int axis, double x) const
+{
+  if (m_cell_size[axis] <= 0.0) return 0;
+  int cell = (int)floor((x - m_box.min()[axis]) / m_cell_size[axis]);
+  return std::max(0, std::min(cell, m_resolution[axis] - 1));
+}
+
+// Walk the cells the ray passes through in order (Amanatides and Woo,
+// "A Fast Voxel Traversal Algorithm for Ray Tracing", 1987). A shape
+// can stick out of the cell it was found from, so a hit only ends the
+// walk once the walk has got past it.
+bool GridAccelerator::intersect(const ShapeSet& shapes, const Ray& ray, double tmin, double tmax,
+                                Intersection& hit) const
+{
+  double t0, t1;
+  if (m_shapes.empty() || !clip(m_box, ray, tmin, tmax, t0, t1)) return false;
+
+  Point3D start = ray.at(t0);
+  int cell[3], step[3];
+  double next[3], delta[3];
+  for (int a = 0; a < 3; a++) {
+    cell[a] = cell_at(a, start[a]);
+    if (ray.dir[a] > 0.0) {
+      step[a] = 1;
+      next[a] = (m_box.min()[a] + (cell[a] + 1) * m_cell_size[a] - ray.origin[a]) / ray.dir[a];
+      delta[a] = m_cell_size[a] / ray.dir[a];
+    } else if (ray.dir[a] < 0.0) {
+      step[a] = -1;
+      next[a] = (m_box.min()[a] + cell[a] * m_cell_size[a] - ray.origin[a]) / ray.dir[a];
+      delta[a] = -m_cell_size[a] / ray.dir[a];
+    } else {
+      step[a] = 0;
+      next[a] = HUGE_VAL;
+      delta[a] = HUGE_VAL;
+    }
+  }
+
+  bool found = false;
+  for (;;) {
+    int axis = 0;
+    if (next[1] < next[axis]) axis = 1;
+    if (next[2] < next[axis]) axis = 2;
+    double exit = std::min(next[axis], t1);
+
+    int c = (cell[2] * m_resolution[1] + cell[1]) * m_resolution[0] + cell[0];
+    if (!m_subgrid.empty() && m_subgrid[c] >= 0) {
+      if (m_subgrids[m_subgrid[c]]->intersect(shapes, ray, tmin, tmax, hit)) {
+        tmax = hit.t;
+        found = true;
+      }
+    } else {
+      for (int i = m_start[c]; i < m_start[c + 1]; i++) {
+        if (shapes.shape_intersect(m_shapes[i], ray, tmin, tmax, hit)) {
+          tmax = hit.t;
+          found = true;
+        }
+      }
+    }
+
+    if (found && tmax <= exit) break;
+    if (next[axis] >= t1) break;
+    cell[axis] += step[axis];
+    if (cell[axis] < 0 || cell[axis] >= m_resolution[axis]) break;
+    next[axis] += delta[axis];
+  }
+  return found;
+}
+
+size_t GridAccelerator::memory_bytes() const
+{
+  size_t bytes = sizeof(*this) + m_start.capacity() * sizeof(int)
+    + m_shapes.capacity() * sizeof(int) + m_subgrid.capacity() * sizeof(int)
+    + m_subgrids.capacity() * sizeof(GridAccelerator*);
+  for (size_t i = 0; i < m_subgrids.size(); i++) bytes += m_subgrids[i]->memory_bytes();
+  return bytes;
+}
+
+Accelerator* Accelerator::build(AcceleratorType type, const ShapeSet& shapes)
+{
+  switch (type) {
+  case ACCEL_GRID: return new GridAccelerator(shapes, false);
+  case ACCEL_GRID2: return new GridAccelerator(shapes, true);
+  case ACCEL_BVH: break;
+  }
+  return new BVHAccelerator(shapes);
+}
+
+static AcceleratorType s_default_accelerator = ACCEL_BVH;
+
+void PrimitiveSet::set_default_accelerator(AcceleratorType type)
+{
+  s_default_accelerator = type;
+}
+
+AcceleratorType PrimitiveSet::default_accelerator()
+{
+  return s_default_accelerator;
+}
+
+PrimitiveSet::PrimitiveSet(const std::vector<Primitive*>& primitives)
+  : m_primitives(primitives),
+    m_accelerator(0)
+{
+  init(s_default_accelerator);
+}
+
+PrimitiveSet::PrimitiveSet(const std::vector<Primitive*>& primitives, AcceleratorType type)
+  : m_primitives(primitives),
+    m_accelerator(0)
+{
+  init(type);
+}
+
+void PrimitiveSet::init(AcceleratorType type)
+{
+  for (size_t i = 0; i < m_primitives.size(); i++) m_bounds.expand(m_primitives[i]->bounds());
+  m_accelerator = Accelerator::build(type, *this);
+}
+
+PrimitiveSet::~PrimitiveSet()
+{
+  delete m_accelerator;
+  for (size_t i = 0; i < m_primitives.size(); i++) delete m_primitives[i];
+}
+
+bool PrimitiveSet::intersect(const Ray& ray, double tmin, double tmax,
+                             Intersection& hit) const
+{
+  return m_accelerator->intersect(*this, ray, tmin, tmax, hit);
+}
+
+void PrimitiveSet::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  union_spans(ray, arena, out);
+}
+
+BBox PrimitiveSet::bounds() const
+{
+  return m_bounds;
+}
+
+int PrimitiveSet::shape_count() const
+{
+  return m_primitives.size();
+}
+
+BBox PrimitiveSet::shape_bounds(int i) const
+{
+  return m_primitives[i]->bounds();
+}
+
+bool PrimitiveSet::shape_intersect(int i, const Ray& ray, double tmin, double tmax,
+                                   Intersection& hit) const
+{
+  return m_primitives[i]->intersect(ray, tmin, tmax, hit);
+}
+
+void PrimitiveSet::shape_spans(int i, const Ray& ray, Arena& arena, SpanList& out) const
+{
+  m_primitives[i]->spans(ray, arena, out);
+}
+
+SphereSet::SphereSet(const std::vector<Point3D>& centres, const std::vector<double>& radii)
+  : m_spheres(centres.size()),
+    m_accelerator(0)
+{
+  for (size_t i = 0; i < centres.size(); i++) {
+    m_spheres[i].centre = centres[i];
+    m_spheres[i].radius = radii[i];
+    m_bounds.expand(shape_bounds(i));
+  }
+  m_accelerator = Accelerator::build(s_default_accelerator, *this);
+}
+
+SphereSet::~SphereSet()
+{
+  delete m_accelerator;
+}
+
+bool SphereSet::intersect(const Ray& ray, double tmin, double tmax,
+                          Intersection& hit) const
+{
+  return m_accelerator->intersect(*this, ray, tmin, tmax, hit);
+}
+
+void SphereSet::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  union_spans(ray, arena, out);
+}
+
+BBox SphereSet::bounds() const
+{
+  return m_bounds;
+}
+
+int SphereSet::shape_count() const
+{
+  return m_spheres.size();
+}
+
+BBox SphereSet::shape_bounds(int i) const
+{
+  const Ball& ball = m_spheres[i];
+  Vector3D r(ball.radius, ball.radius, ball.radius);
+  return BBox(ball.centre - r, ball.centre + r);
+}
+
+bool SphereSet::shape_intersect(int i, const Ray& ray, double tmin, double tmax,
+                                Intersection& hit) const
+{
+  return sphere_intersect(m_spheres[i].centre, m_spheres[i].radius, ray, tmin, tmax, hit);
+}
+
+void SphereSet::shape_spans(int i, const Ray& ray, Arena& arena, SpanList& out) const
+{
+  sphere_spans(m_spheres[i].centre, m_spheres[i].radius, ray, arena, out);
+}
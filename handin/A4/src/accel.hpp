@@ -0,0 +1,135 @@
+#ifndef CS488_ACCEL_HPP
+#define CS488_ACCEL_HPP
+
+#include <vector>
+#include <string>
+#include "primitive.hpp"
+
+// Ways of finding which of many shapes a ray hits
+enum AcceleratorType {
+  // Bounding volume hierarchy, split by the surface area heuristic
+  ACCEL_BVH,
+  // Uniform grid, each shape listed in every cell its box overlaps
+  ACCEL_GRID,
+  // Uniform grid whose crowded cells hold grids of their own
+  ACCEL_GRID2
+};
+
+// Parse "bvh", "grid" or "grid2". Returns false if the name isn't
+// recognised.
+bool parse_accelerator(const std::string& name, AcceleratorType& type);
+const char* accelerator_name(AcceleratorType type);
+
+// Shapes, numbered from 0, that an Accelerator can be built over
+class ShapeSet {
+public:
+  virtual ~ShapeSet();
+
+  virtual int shape_count() const = 0;
+  virtual BBox shape_bounds(int i) const = 0;
+  // As Primitive::intersect, for shape i
+  virtual bool shape_intersect(int i, const Ray& ray, double tmin, double tmax,
+                               Intersection& hit) const = 0;
+  // As Primitive::spans, for shape i
+  virtual void shape_spans(int i, const Ray& ray, Arena& arena, SpanList& out) const = 0;
+
+protected:
+  // The union of every shape's spans, for sets that are solids
+  void union_spans(const Ray& ray, Arena& arena, SpanList& out) const;
+};
+
+// An index over a ShapeSet. Accelerators only hold shape numbers, so
+// the same set can be indexed different ways and the results compared.
+class Accelerator {
+public:
+  virtual ~Accelerator();
+
+  static Accelerator* build(AcceleratorType type, const ShapeSet& shapes);
+
+  // Closest hit with t in (tmin, tmax) among the shapes it was built
+  // over; hit is left alone if there isn't one
+  virtual bool intersect(const ShapeSet& shapes, const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const = 0;
+
+  // Bytes taken by the index itself, not counting the shapes
+  virtual size_t memory_bytes() const = 0;
+};
+
+// Many primitives, all with the same material, traced as one through
+// an accelerator.
+class PrimitiveSet : public Primitive, public ShapeSet {
+public:
+  // The set owns the primitives from here on. The accelerator is the
+  // default type unless one is given.
+  explicit PrimitiveSet(const std::vector<Primitive*>& primitives);
+  PrimitiveSet(const std::vector<Primitive*>& primitives, AcceleratorType type);
+  virtual ~PrimitiveSet();
+
+  // The accelerator sets made from now on use by default
+  static void set_default_accelerator(AcceleratorType type);
+  static AcceleratorType default_accelerator();
+
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  // The union of the members' spans
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
+
+  virtual int shape_count() const;
+  virtual BBox shape_bounds(int i) const;
+  virtual bool shape_intersect(int i, const Ray& ray, double tmin, double tmax,
+                               Intersection& hit) const;
+  virtual void shape_spans(int i, const Ray& ray, Arena& arena, SpanList& out) const;
+
+  const Accelerator& accelerator() const { return *m_accelerator; }
+
+private:
+  PrimitiveSet(const PrimitiveSet&);
+  PrimitiveSet& operator=(const PrimitiveSet&);
+
+  void init(AcceleratorType type);
+
+  std::vector<Primitive*> m_primitives;
+  BBox m_bounds;
+  Accelerator* m_accelerator;
+};
+
+// Many spheres, all with the same material, kept as a flat array of
+// centres and radii rather than one primitive each. A million of them
+// take 32MB, plus the accelerator, which uses PrimitiveSet's default
+// type.
+class SphereSet : public Primitive, public ShapeSet {
+public:
+  // Sphere i has centre centres[i] and radius radii[i]
+  SphereSet(const std::vector<Point3D>& centres, const std::vector<double>& radii);
+  virtual ~SphereSet();
+
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  // The union of the spheres' spans
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
+
+  virtual int shape_count() const;
+  virtual BBox shape_bounds(int i) const;
+  virtual bool shape_intersect(int i, const Ray& ray, double tmin, double tmax,
+                               Intersection& hit) const;
+  virtual void shape_spans(int i, const Ray& ray, Arena& arena, SpanList& out) const;
+
+  const Accelerator& accelerator() const { return *m_accelerator; }
+
+private:
+  SphereSet(const SphereSet&);
+  SphereSet& operator=(const SphereSet&);
+
+  struct Ball {
+    Point3D centre;
+    double radius;
+  };
+
+  std::vector<Ball> m_spheres;
+  BBox m_bounds;
+  Accelerator* m_accelerator;
+};
+
+#endif
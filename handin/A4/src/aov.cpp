@@ -0,0 +1,226 @@
+#include "aov.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The pixels start at a multiple of this many bytes into the file
+static const size_t HEADER_ALIGNMENT = 64;
+
+static const char* byte_order()
+{
+  uint16_t one = 1;
+  return *reinterpret_cast<unsigned char*>(&one) == 1 ? "le" : "be";
+}
+
+bool write_aov(const std::string& filename, const std::vector<AovLayer>& layers)
+{
+  if (layers.empty()) {
+    std::cerr << "No layers to write to " << filename << std::endl;
+    return false;
+  }
+
+  int width = layers[0].image->width(), height = layers[0].image->height();
+  int channels = 0;
+  std::ostringstream names;
+  for (size_t i = 0; i < layers.size(); i++) {
+    const Image& image = *layers[i].image;
+    if (image.width() != width || image.height() != height) {
+      std::cerr << "Layer " << layers[i].name << " isn't " << width << "x" << height
+                << "; not writing " << filename << std::endl;
+      return false;
+    }
+    for (int c = 0; c < image.elements(); c++) {
+      names << (channels++ ? " " : "") << layers[i].name;
+      if (image.elements() > 1) {
+        names << "." << (c < (int)layers[i].components.size() ? layers[i].components[c] : '?');
+      }
+    }
+  }
+
+  std::ostringstream header;
+  header << "AOV1 " << byte_order() << "\n"
+         << width << " " << height << " " << channels << "\n"
+         << names.str() << "\n";
+  std::string text = header.str();
+  size_t header_size = (text.size() + 1 + HEADER_ALIGNMENT - 1)
+    / HEADER_ALIGNMENT * HEADER_ALIGNMENT;
+  text.append(header_size - text.size() - 1, ' ');
+  text += '\n';
+
+  // Lay the whole file out in memory, so it goes to disk in one write
+  size_t pixels = (size_t)width * height;
+  std::vector<char> buffer(header_size + pixels * channels * sizeof(float));
+  std::memcpy(&buffer[0], text.data(), header_size);
+
+  float* out = reinterpret_cast<float*>(&buffer[0] + header_size);
+  int first = 0;
+  for (size_t i = 0; i < layers.size(); i++) {
+    const Image& image = *layers[i].image;
+    int elements = image.elements();
+    const double* in = image.data();
+    for (size_t p = 0; p < pixels; p++) {
+      for (int c = 0; c < elements; c++) {
+        out[p * channels + first + c] = (float)in[p * elements + c];
+      }
+    }
+    first += elements;
+  }
+
+  int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Could not create " << filename << ": " << std::strerror(errno) << std::endl;
+    return false;
+  }
+
+  const char* p = &buffer[0];
+  size_t left = buffer.size();
+  while (left > 0) {
+    ssize_t written = ::write(fd, p, left);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "Could not write " << filename << ": " << std::strerror(errno) << std::endl;
+      ::close(fd);
+      return false;
+    }
+    p += written;
+    left -= written;
+  }
+
+  return ::close(fd) == 0;
+}
+
+AovFile::AovFile()
+  : m_map(0), m_size(0), m_width(0), m_height(0), m_channels(0), m_pixels(0)
+{
+}
+
+AovFile::~AovFile()
+{
+  close();
+}
+
+void AovFile::close()
+{
+  if (m_map) munmap(m_map, m_size);
+  m_map = 0;
+  m_size = 0;
+  m_width = m_height = m_channels = 0;
+  m_names.clear();
+  m_pixels = 0;
+}
+
+// The line starting at "pos" in the mapped text, not counting its
+// newline. Moves pos past the newline; returns false if there isn't
+// one.
+static bool next_line(const char* text, size_t size, size_t& pos, std::string& line)
+{
+  const char* start = text + pos;
+  const char* end = static_cast<const char*>(std::memchr(start, '\n', size - pos));
+  if (!end) return false;
+  line.assign(start, end);
+  pos = end - text + 1;
+  return true;
+}
+
+bool AovFile::open(const std::string& filename)
+{
+  close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Could not open " << filename << ": " << std::strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    std::cerr << "Could not read " << filename << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  m_size = st.st_size;
+  m_map = mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (m_map == MAP_FAILED) {
+    std::cerr << "Could not map " << filename << ": " << std::strerror(errno) << std::endl;
+    m_map = 0;
+    m_size = 0;
+    return false;
+  }
+
+  const char* text = static_cast<const char*>(m_map);
+  size_t pos = 0;
+  std::string magic, dimensions, names, padding;
+  if (!next_line(text, m_size, pos, magic)
+      || !next_line(text, m_size, pos, dimensions)
+      || !next_line(text, m_size, pos, names)
+      || !next_line(text, m_size, pos, padding)
+      || magic != std::string("AOV1 ") + byte_order()
+      || pos % HEADER_ALIGNMENT != 0) {
+    std::cerr << filename << " isn't an AOV file in this machine's byte order" << std::endl;
+    close();
+    return false;
+  }
+
+  std::istringstream size_in(dimensions);
+  int width, height, channels;
+  if (!(size_in >> width >> height >> channels) || width < 0 || height < 0 || channels < 1
+      || m_size - pos < (size_t)width * height * channels * sizeof(float)) {
+    std::cerr << filename << " has a bad size or is truncated" << std::endl;
+    close();
+    return false;
+  }
+
+  std::istringstream names_in(names);
+  std::string name;
+  while (names_in >> name) m_names.push_back(name);
+  if ((int)m_names.size() != channels) {
+    std::cerr << filename << " names " << m_names.size() << " of its "
+              << channels << " channels" << std::endl;
+    close();
+    return false;
+  }
+
+  m_width = width;
+  m_height = height;
+  m_channels = channels;
+  m_pixels = reinterpret_cast<const float*>(text + pos);
+  return true;
+}
+
+int AovFile::channel(const std::string& name) const
+{
+  for (int c = 0; c < m_channels; c++) {
+    if (m_names[c] == name) return c;
+  }
+  return -1;
+}
+
+bool AovFile::load(const std::string& layer, Image& img) const
+{
+  std::vector<int> found;
+  std::string prefix = layer + ".";
+  for (int c = 0; c < m_channels; c++) {
+    if (m_names[c] == layer || m_names[c].compare(0, prefix.size(), prefix) == 0) {
+      found.push_back(c);
+    }
+  }
+  if (found.empty()) return false;
+
+  img = Image(m_width, m_height, found.size());
+  for (int y = 0; y < m_height; y++) {
+    for (int x = 0; x < m_width; x++) {
+      for (size_t i = 0; i < found.size(); i++) {
+        img(x, y, i) = (*this)(x, y, found[i]);
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,84 @@
+#ifndef CS488_AOV_HPP
+#define CS488_AOV_HPP
+
+#include <string>
+#include <vector>
+#include "image.hpp"
+
+// AOV ("arbitrary output variable") files hold any number of named
+// float channels at full precision, for depth, normals, object ids
+// and unclamped colour that a PNG can't carry.
+//
+// The format is a text header followed by raw pixels:
+//
+//   AOV1 le                    magic, and byte order of the floats
+//   <width> <height> <channels>
+//   <name> <name> ...          one per channel, no spaces in names
+//   <spaces>\n                 padding, so the header is a multiple
+//                              of 64 bytes long
+//   width * height * channels 32-bit IEEE floats, pixel by pixel
+//   with the channels of a pixel together, top row first
+//
+// Because the pixels are 64-byte aligned in the file, a reader that
+// maps the file can use them in place.
+
+// An image to save under the given name. Its channels are called
+// "name.R", "name.G" and so on, using the letters of "components" in
+// turn, or just "name" if the image has a single channel.
+struct AovLayer {
+  AovLayer(const std::string& name_, const Image& image_,
+           const std::string& components_ = "RGBA")
+    : name(name_), image(&image_), components(components_)
+  {
+  }
+
+  std::string name;
+  const Image* image;
+  std::string components;
+};
+
+// Save the layers, which must all be the same size, to one file with a
+// single write. Returns false, with a message on stderr, on failure.
+bool write_aov(const std::string& filename, const std::vector<AovLayer>& layers);
+
+// An AOV file mapped into memory for reading.
+class AovFile {
+public:
+  AovFile();
+  ~AovFile();
+
+  // Map the file and check its header. Returns false, with a message
+  // on stderr, if it can't be read.
+  bool open(const std::string& filename);
+  void close();
+
+  int width() const { return m_width; }
+  int height() const { return m_height; }
+  int channels() const { return m_channels; }
+  const std::string& channel_name(int c) const { return m_names[c]; }
+
+  // Index of the named channel, or -1 if there isn't one
+  int channel(const std::string& name) const;
+
+  float operator()(int x, int y, int c) const
+  {
+    return m_pixels[((size_t)y * m_width + x) * m_channels + c];
+  }
+
+  // Copy the channels of a layer saved by write_aov into img. Returns
+  // false if there's no such layer.
+  bool load(const std::string& layer, Image& img) const;
+
+private:
+  AovFile(const AovFile&);
+  AovFile& operator=(const AovFile&);
+
+  void* m_map;
+  size_t m_size;
+
+  int m_width, m_height, m_channels;
+  std::vector<std::string> m_names;
+  const float* m_pixels;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "arena.hpp"
+#include <algorithm>
+
+Arena::Arena(size_t block_size)
+  : m_block_size(block_size),
+    m_current(0), m_offset(0),
+    m_allocations(0), m_heap_blocks(0), m_heap_bytes(0)
+{
+}
+
+Arena::~Arena()
+{
+  for (std::vector<Block>::iterator I = m_blocks.begin(); I != m_blocks.end(); ++I) {
+    delete [] I->data;
+  }
+}
+
+void* Arena::allocate(size_t bytes, size_t align)
+{
+  m_allocations++;
+
+  for (;;) {
+    if (m_current < m_blocks.size()) {
+      Block& block = m_blocks[m_current];
+      size_t start = (m_offset + align - 1) & ~(align - 1);
+      if (start + bytes <= block.size) {
+        m_offset = start + bytes;
+        return block.data + start;
+      }
+      // Doesn't fit: move on to the next block
+      if (m_current + 1 < m_blocks.size() || m_offset > 0) {
+        m_current++;
+        m_offset = 0;
+        continue;
+      }
+    }
+
+    // Out of blocks. Get a new one big enough for this request, and at
+    // least as big as all the others put together so that a growing
+    // arena needs only logarithmically many blocks. Put it where the
+    // allocator will reach it next.
+    size_t total = 0;
+    for (std::vector<Block>::iterator I = m_blocks.begin(); I != m_blocks.end(); ++I) {
+      total += I->size;
+    }
+
+    Block block;
+    block.size = std::max(std::max(m_block_size, bytes + align), total);
+    block.data = new char[block.size];
+    m_heap_blocks++;
+    m_heap_bytes += block.size;
+
+    if (m_current < m_blocks.size()) {
+      // The current block was empty but too small; retire it to the
+      // end so the new one is used first from now on
+      m_blocks.insert(m_blocks.begin() + m_current, block);
+    } else {
+      m_blocks.push_back(block);
+    }
+    m_offset = 0;
+  }
+}
+
+void Arena::reset()
+{
+  // If the last round needed more than one block, swap them all for a
+  // single block of their combined size, so that the next round of
+  // the same size fits without going back to the heap.
+  if (m_blocks.size() > 1) {
+    Block block;
+    block.size = 0;
+    for (std::vector<Block>::iterator I = m_blocks.begin(); I != m_blocks.end(); ++I) {
+      block.size += I->size;
+      delete [] I->data;
+    }
+    block.data = new char[block.size];
+    m_heap_blocks++;
+    m_heap_bytes += block.size;
+
+    m_blocks.clear();
+    m_blocks.push_back(block);
+  }
+
+  m_current = 0;
+  m_offset = 0;
+}
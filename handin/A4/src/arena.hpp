@@ -0,0 +1,85 @@
+#ifndef CS488_ARENA_HPP
+#define CS488_ARENA_HPP
+
+#include <cstddef>
+#include <vector>
+
+// A bump allocator for short-lived tracing data.
+//
+// Each render thread owns one Arena and resets it at the start of
+// every tile, so everything allocated while tracing a tile is released
+// at once without going through malloc. Memory is never handed back to
+// the heap before the Arena is destroyed; once the first few tiles
+// have grown it to its working size, tracing doesn't touch the heap at
+// all. heap_blocks() shows whether that holds.
+//
+// SceneNode keeps one that is never reset, as a pool for the scene.
+class Arena {
+public:
+  Arena(size_t block_size = 64 * 1024);
+  ~Arena();
+
+  // Allocate uninitialized memory, valid until the next reset().
+  void* allocate(size_t bytes, size_t align = 16);
+
+  template<typename T>
+  T* allocate_array(size_t count)
+  {
+    return static_cast<T*>(allocate(count * sizeof(T), __alignof__(T)));
+  }
+
+  // Release everything allocated since the last reset, keeping the
+  // memory for reuse.
+  void reset();
+
+  // A point in the allocation sequence. Rewinding to it releases
+  // everything allocated since it was taken, so scratch space used
+  // while tracing a single ray needn't pile up over a whole tile.
+  struct Mark {
+    size_t block;
+    size_t offset;
+  };
+
+  Mark mark() const
+  {
+    Mark m;
+    m.block = m_current;
+    m.offset = m_offset;
+    return m;
+  }
+
+  void rewind(const Mark& m)
+  {
+    m_current = m.block;
+    m_offset = m.offset;
+  }
+
+  // Number of allocate() calls since the Arena was created
+  long allocations() const { return m_allocations; }
+  // Number of blocks obtained from the heap since the Arena was created
+  long heap_blocks() const { return m_heap_blocks; }
+  // Total size of those blocks
+  size_t heap_bytes() const { return m_heap_bytes; }
+
+private:
+  Arena(const Arena&);
+  Arena& operator=(const Arena&);
+
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  size_t m_block_size;
+  std::vector<Block> m_blocks;
+
+  // The block being allocated from, and the first free byte in it
+  size_t m_current;
+  size_t m_offset;
+
+  long m_allocations;
+  long m_heap_blocks;
+  size_t m_heap_bytes;
+};
+
+#endif
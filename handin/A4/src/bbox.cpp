@@ -0,0 +1,68 @@
+#include "bbox.hpp"
+
+void BBox::expand(const Point3D& p)
+{
+  for (int i = 0; i < 3; i++) {
+    m_min[i] = std::min(m_min[i], p[i]);
+    m_max[i] = std::max(m_max[i], p[i]);
+  }
+}
+
+void BBox::expand(const BBox& other)
+{
+  for (int i = 0; i < 3; i++) {
+    m_min[i] = std::min(m_min[i], other.m_min[i]);
+    m_max[i] = std::max(m_max[i], other.m_max[i]);
+  }
+}
+
+BBox BBox::intersection(const BBox& other) const
+{
+  BBox box;
+  for (int i = 0; i < 3; i++) {
+    box.m_min[i] = std::max(m_min[i], other.m_min[i]);
+    box.m_max[i] = std::min(m_max[i], other.m_max[i]);
+  }
+  return box;
+}
+
+BBox BBox::interpolated(const BBox& to, double t) const
+{
+  if (empty() || to.empty()) return BBox();
+  return BBox(m_min + t * (to.m_min - m_min), m_max + t * (to.m_max - m_max));
+}
+
+BBox BBox::transformed(const Matrix4x4& M) const
+{
+  if (empty()) return BBox();
+
+  BBox box;
+  for (int corner = 0; corner < 8; corner++) {
+    Point3D p((corner & 1) ? m_max[0] : m_min[0],
+              (corner & 2) ? m_max[1] : m_min[1],
+              (corner & 4) ? m_max[2] : m_min[2]);
+    box.expand(M * p);
+  }
+  return box;
+}
+
+bool BBox::hit(const Ray& ray, double tmin, double tmax) const
+{
+  if (empty()) return false;
+
+  for (int i = 0; i < 3; i++) {
+    if (ray.dir[i] == 0.0) {
+      if (ray.origin[i] < m_min[i] || ray.origin[i] > m_max[i]) return false;
+      continue;
+    }
+    double inv = 1.0 / ray.dir[i];
+    double t0 = (m_min[i] - ray.origin[i]) * inv;
+    double t1 = (m_max[i] - ray.origin[i]) * inv;
+    if (t0 > t1) std::swap(t0, t1);
+
+    tmin = std::max(tmin, t0);
+    tmax = std::min(tmax, t1);
+    if (tmin > tmax) return false;
+  }
+  return true;
+}
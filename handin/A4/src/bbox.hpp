@@ -0,0 +1,50 @@
+#ifndef CS488_BBOX_HPP
+#define CS488_BBOX_HPP
+
+#include "algebra.hpp"
+#include "ray.hpp"
+
+// An axis-aligned bounding box. A default-constructed box is empty:
+// it contains nothing and no ray hits it.
+class BBox {
+public:
+  BBox()
+    : m_min(HUGE_VAL, HUGE_VAL, HUGE_VAL),
+      m_max(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL)
+  {
+  }
+  BBox(const Point3D& min, const Point3D& max)
+    : m_min(min), m_max(max)
+  {
+  }
+
+  const Point3D& min() const { return m_min; }
+  const Point3D& max() const { return m_max; }
+
+  bool empty() const
+  {
+    return m_min[0] > m_max[0] || m_min[1] > m_max[1] || m_min[2] > m_max[2];
+  }
+
+  // Grow to contain a point, or another box
+  void expand(const Point3D& p);
+  void expand(const BBox& other);
+
+  // The intersection of two boxes
+  BBox intersection(const BBox& other) const;
+
+  // The box a fraction t of the way from this one to another, each
+  // face moving in a straight line. Empty if either box is.
+  BBox interpolated(const BBox& to, double t) const;
+
+  // The box, in the frame M maps into, containing this box mapped by M
+  BBox transformed(const Matrix4x4& M) const;
+
+  // Does the ray pass through the box somewhere in (tmin, tmax)?
+  bool hit(const Ray& ray, double tmin, double tmax) const;
+
+private:
+  Point3D m_min, m_max;
+};
+
+#endif
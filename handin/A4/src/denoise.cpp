@@ -0,0 +1,173 @@
+#include "denoise.hpp"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <pthread.h>
+
+// B3 spline weights of the 5-tap a-trous kernel
+static const double KERNEL[5] = { 1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+
+// Albedo below this is treated as this when dividing it out, so black
+// surfaces don't blow their illumination up to infinity
+static const double MIN_ALBEDO = 0.01;
+
+DenoiseGuides::DenoiseGuides(int width, int height)
+  : albedo(width, height, 3), normal(width, height, 3), depth(width, height, 1),
+    object(width, height, 1)
+{
+  clear();
+}
+
+void DenoiseGuides::clear()
+{
+  int pixels = albedo.width() * albedo.height();
+  std::fill(albedo.data(), albedo.data() + 3 * pixels, 0.0);
+  std::fill(normal.data(), normal.data() + 3 * pixels, 0.0);
+  std::fill(depth.data(), depth.data() + pixels, 0.0);
+  std::fill(object.data(), object.data() + pixels, -1.0);
+}
+
+void DenoiseGuides::resolve(const int* counts)
+{
+  int pixels = albedo.width() * albedo.height();
+  for (int i = 0; i < pixels; i++) {
+    if (counts[i] == 0) continue;
+    double scale = 1.0 / counts[i];
+    for (int c = 0; c < 3; c++) albedo.data()[3 * i + c] *= scale;
+    depth.data()[i] *= scale;
+
+    // Averaging blurs normals along edges; keep them unit length
+    double* n = normal.data() + 3 * i;
+    double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (length > 0.0) {
+      for (int c = 0; c < 3; c++) n[c] /= length;
+    }
+  }
+}
+
+DenoiseOptions::DenoiseOptions()
+  : iterations(5),
+    sigma_colour(0.5),
+    sigma_normal(0.3),
+    sigma_depth(0.02)
+{
+}
+
+// One pass of the filter over rows [first_row, last_row), from "in" to
+// "out", both holding illumination (colour over albedo).
+struct FilterJob {
+  const Image* in;
+  Image* out;
+  const DenoiseGuides* guides;
+  const DenoiseOptions* options;
+  int step;
+  double sigma_colour;
+  int first_row, last_row;
+};
+
+static void* filter_rows(void* data)
+{
+  const FilterJob& job = *static_cast<FilterJob*>(data);
+  const Image& in = *job.in;
+  const Image& normal = job.guides->normal;
+  const Image& depth = job.guides->depth;
+  int width = in.width(), height = in.height();
+
+  double colour_scale = 1.0 / (job.sigma_colour * job.sigma_colour);
+  double normal_scale = 1.0 / (job.options->sigma_normal * job.options->sigma_normal);
+
+  for (int y = job.first_row; y < job.last_row; y++) {
+    for (int x = 0; x < width; x++) {
+      double c[3] = { in(x, y, 0), in(x, y, 1), in(x, y, 2) };
+      double n[3] = { normal(x, y, 0), normal(x, y, 1), normal(x, y, 2) };
+      double z = depth(x, y, 0);
+      // Depth differences that count as an edge grow with distance
+      // and with how far apart the taps are
+      double depth_scale = 1.0 / (job.options->sigma_depth * job.step * std::max(z, 1e-6));
+
+      double sum[3] = { 0.0, 0.0, 0.0 };
+      double total = 0.0;
+
+      for (int j = 0; j < 5; j++) {
+        int qy = y + (j - 2) * job.step;
+        if (qy < 0 || qy >= height) continue;
+
+        for (int i = 0; i < 5; i++) {
+          int qx = x + (i - 2) * job.step;
+          if (qx < 0 || qx >= width) continue;
+
+          double dc = 0.0, dn = 0.0;
+          for (int k = 0; k < 3; k++) {
+            double a = in(qx, qy, k) - c[k];
+            double b = normal(qx, qy, k) - n[k];
+            dc += a * a;
+            dn += b * b;
+          }
+          double dz = fabs(depth(qx, qy, 0) - z);
+
+          double w = KERNEL[i] * KERNEL[j]
+            * exp(-dc * colour_scale - dn * normal_scale - dz * depth_scale);
+          for (int k = 0; k < 3; k++) sum[k] += w * in(qx, qy, k);
+          total += w;
+        }
+      }
+
+      // The centre tap always has weight, so total > 0
+      for (int k = 0; k < 3; k++) (*job.out)(x, y, k) = sum[k] / total;
+    }
+  }
+  return 0;
+}
+
+void denoise(Image& img, const DenoiseGuides& guides, const DenoiseOptions& options,
+             int threads)
+{
+  int width = img.width(), height = img.height();
+  threads = std::max(1, std::min(threads, height));
+
+  Image illumination(width, height, 3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int k = 0; k < 3; k++) {
+        illumination(x, y, k) = img(x, y, k) / std::max(guides.albedo(x, y, k), MIN_ALBEDO);
+      }
+    }
+  }
+
+  Image scratch(width, height, 3);
+  Image* in = &illumination;
+  Image* out = &scratch;
+
+  std::vector<FilterJob> jobs(threads);
+  std::vector<pthread_t> ids(threads);
+  double sigma_colour = options.sigma_colour;
+
+  for (int pass = 0; pass < options.iterations; pass++) {
+    for (int i = 0; i < threads; i++) {
+      FilterJob& job = jobs[i];
+      job.in = in;
+      job.out = out;
+      job.guides = &guides;
+      job.options = &options;
+      job.step = 1 << pass;
+      job.sigma_colour = sigma_colour;
+      job.first_row = (long)height * i / threads;
+      job.last_row = (long)height * (i + 1) / threads;
+      pthread_create(&ids[i], 0, filter_rows, &job);
+    }
+    for (int i = 0; i < threads; i++) {
+      pthread_join(ids[i], 0);
+    }
+
+    std::swap(in, out);
+    sigma_colour *= 0.5;
+  }
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int k = 0; k < 3; k++) {
+        img(x, y, k) = (*in)(x, y, k) * std::max(guides.albedo(x, y, k), MIN_ALBEDO);
+      }
+    }
+  }
+}
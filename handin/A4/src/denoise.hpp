@@ -0,0 +1,51 @@
+#ifndef CS488_DENOISE_HPP
+#define CS488_DENOISE_HPP
+
+#include "image.hpp"
+
+// What the first surface seen through each pixel looks like, averaged
+// over the pixel's samples. These are cheap to gather and almost free
+// of noise, so they show the denoiser where the real edges are.
+struct DenoiseGuides {
+  DenoiseGuides(int width, int height);
+
+  // Reflectance: diffuse colour, plus mirror and transmitted light
+  Image albedo;
+  // Unit normal facing the eye, and distance from the eye. Pixels
+  // where nothing was hit have a zero normal and depth.
+  Image normal;
+  Image depth;
+  // Id of the node the pixel's first sample hit, or -1. Not averaged,
+  // and not used by the filter, but saved along with the rest.
+  Image object;
+
+  void clear();
+  // Turn sums over counts[y * width + x] samples into averages
+  void resolve(const int* counts);
+};
+
+struct DenoiseOptions {
+  DenoiseOptions();
+
+  // Filter passes. Pass i spreads its 5x5 kernel 2^i pixels apart, so
+  // five passes reach 2 (1 + 2 + 4 + 8 + 16) = 62 pixels either side,
+  // 125 across.
+  int iterations;
+
+  // How quickly a neighbour's weight falls off with differences in
+  // illumination, normal and relative depth. Smaller is more
+  // edge-preserving; the colour term tightens by half each pass.
+  double sigma_colour;
+  double sigma_normal;
+  double sigma_depth;
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering",
+// 2010). The colour is divided by the albedo first so that texture and
+// material edges survive, filtered, and multiplied back. Rows are
+// shared between "threads" threads.
+void denoise(Image& img, const DenoiseGuides& guides, const DenoiseOptions& options,
+             int threads);
+
+#endif
@@ -4,6 +4,7 @@
 #include <cstdio>
 #include <cmath>
 #include <png.h>
+#include <zlib.h>
 #include <sstream>
 
 Image::Image()
@@ -78,9 +79,14 @@ double& Image::operator()(int x, int y, int i)
 bool Image::savePng(const std::string& filename)
 {
   FILE* fout = std::fopen(filename.c_str(), "wb");
+  if (!fout) return false;
   png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   png_infop info_ptr = png_create_info_struct(png_ptr);
-  setjmp(png_ptr->jmpbuf);
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(fout);
+    return false;
+  }
 
   /* Setup PNG I/O */
   png_init_io(png_ptr, fout);
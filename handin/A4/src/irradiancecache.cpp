@@ -0,0 +1,168 @@
+#include "irradiancecache.hpp"
+#include <algorithm>
+
+// Depth below which the octree isn't split any further
+static const int MAX_DEPTH = 16;
+
+// Limits on record radii, as fractions of the size of the scene
+static const double MIN_RADIUS_FRACTION = 0.001;
+static const double MAX_RADIUS_FRACTION = 0.1;
+
+// How far in front of a point, as a fraction of its radius, a record
+// can be and still be used there
+static const double FRONT_TOLERANCE = 0.01;
+
+IrradianceEstimate::IrradianceEstimate(const Point3D& p, const Vector3D& n,
+                                       double accuracy)
+  : m_pos(p), m_normal(n), m_accuracy(accuracy), m_weight(0.0)
+{
+  m_sum[0] = m_sum[1] = m_sum[2] = 0.0;
+}
+
+void IrradianceEstimate::add(const IrradianceRecord& record)
+{
+  double ndotn = m_normal.dot(record.normal);
+  if (ndotn <= 0.0) return;
+
+  Vector3D offset = m_pos - record.pos;
+  double error = offset.length() / record.radius + sqrt(std::max(0.0, 1.0 - ndotn));
+  if (error >= m_accuracy) return;
+
+  // A record in front of the point (say, at the lip of a crevice the
+  // point is inside) saw less of the nearby geometry than the point
+  // does, so its irradiance would be too high.
+  Vector3D average = 0.5 * (m_normal + record.normal);
+  if (-offset.dot(average) > FRONT_TOLERANCE * record.radius) return;
+
+  double weight = 1.0 / std::max(error, 1e-6);
+  Vector3D rotation = record.normal.cross(m_normal);
+
+  double irradiance[3] = { record.irradiance.R(), record.irradiance.G(),
+                           record.irradiance.B() };
+  for (int i = 0; i < 3; i++) {
+    double value = irradiance[i]
+      + rotation.dot(record.rotation_gradient[i])
+      + offset.dot(record.translation_gradient[i]);
+    m_sum[i] += weight * value;
+  }
+  m_weight += weight;
+}
+
+Colour IrradianceEstimate::irradiance() const
+{
+  if (m_weight <= 0.0) return Colour(0.0);
+
+  // The gradients extrapolate linearly, which can overshoot below zero
+  return Colour(std::max(0.0, m_sum[0] / m_weight),
+                std::max(0.0, m_sum[1] / m_weight),
+                std::max(0.0, m_sum[2] / m_weight));
+}
+
+IrradianceCache::Node::Node()
+{
+  std::fill(children, children + 8, (Node*)0);
+}
+
+IrradianceCache::Node::~Node()
+{
+  for (int i = 0; i < 8; i++) delete children[i];
+}
+
+IrradianceCache::IrradianceCache(const BBox& bounds, double accuracy)
+  : m_accuracy(accuracy), m_nodes(1)
+{
+  Point3D lo(-1.0, -1.0, -1.0), hi(1.0, 1.0, 1.0);
+  if (!bounds.empty()) {
+    lo = bounds.min();
+    hi = bounds.max();
+  }
+
+  double diagonal = (hi - lo).length();
+  m_min_radius = MIN_RADIUS_FRACTION * diagonal;
+  m_max_radius = MAX_RADIUS_FRACTION * diagonal;
+
+  // Make the root a cube, a little bigger than the scene so points on
+  // its surface fall inside
+  double half = 0.0;
+  for (int i = 0; i < 3; i++) half = std::max(half, 0.5 * (hi[i] - lo[i]));
+  half *= 1.01;
+  Point3D centre = lo + 0.5 * (hi - lo);
+  m_min = centre - Vector3D(half, half, half);
+  m_max = centre + Vector3D(half, half, half);
+}
+
+IrradianceCache::~IrradianceCache()
+{
+  for (size_t i = 0; i < m_records.size(); i++) delete m_records[i];
+}
+
+void IrradianceCache::insert(const IrradianceRecord& record)
+{
+  IrradianceRecord* stored = new IrradianceRecord(record);
+  m_records.push_back(stored);
+
+  // The record is valid out to about accuracy * radius
+  double reach = m_accuracy * record.radius;
+  Vector3D extent(reach, reach, reach);
+  insert(&m_root, m_min, m_max, stored,
+         BBox(record.pos - extent, record.pos + extent), 0);
+}
+
+void IrradianceCache::insert(Node* node, const Point3D& min, const Point3D& max,
+                             const IrradianceRecord* record, const BBox& region,
+                             int depth)
+{
+  // Stop once the children would be smaller than the region
+  double size = max[0] - min[0];
+  double region_size = region.max()[0] - region.min()[0];
+  if (depth == MAX_DEPTH || 0.5 * size < region_size) {
+    node->records.push_back(record);
+    return;
+  }
+
+  Point3D mid = min + 0.5 * (max - min);
+  for (int i = 0; i < 8; i++) {
+    Point3D child_min, child_max;
+    for (int axis = 0; axis < 3; axis++) {
+      bool upper = (i >> axis) & 1;
+      child_min[axis] = upper ? mid[axis] : min[axis];
+      child_max[axis] = upper ? max[axis] : mid[axis];
+    }
+    if (region.min()[0] > child_max[0] || region.max()[0] < child_min[0]
+        || region.min()[1] > child_max[1] || region.max()[1] < child_min[1]
+        || region.min()[2] > child_max[2] || region.max()[2] < child_min[2]) {
+      continue;
+    }
+
+    if (!node->children[i]) {
+      node->children[i] = new Node();
+      m_nodes++;
+    }
+    insert(node->children[i], child_min, child_max, record, region, depth + 1);
+  }
+}
+
+void IrradianceCache::lookup(IrradianceEstimate& estimate) const
+{
+  const Point3D& p = estimate.position();
+  const Node* node = &m_root;
+  Point3D min = m_min, max = m_max;
+
+  while (node) {
+    for (size_t i = 0; i < node->records.size(); i++) {
+      estimate.add(*node->records[i]);
+    }
+
+    Point3D mid = min + 0.5 * (max - min);
+    int child = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      if (p[axis] > mid[axis]) {
+        child |= 1 << axis;
+        min[axis] = mid[axis];
+      } else {
+        max[axis] = mid[axis];
+      }
+    }
+    node = node->children[child];
+  }
+}
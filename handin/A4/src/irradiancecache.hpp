@@ -0,0 +1,118 @@
+#ifndef CS488_IRRADIANCECACHE_HPP
+#define CS488_IRRADIANCECACHE_HPP
+
+#include <vector>
+#include "algebra.hpp"
+#include "bbox.hpp"
+
+// Indirect irradiance computed at one point by sampling the hemisphere
+// above it, with the gradients needed to extrapolate it to nearby
+// points (Ward and Heckbert, "Irradiance Gradients", 1992).
+struct IrradianceRecord {
+  IrradianceRecord() : irradiance(0.0), radius(0.0) {}
+
+  Point3D pos;
+  Vector3D normal;
+  Colour irradiance;
+  // Harmonic mean distance to the surfaces the hemisphere rays hit,
+  // clamped to the cache's limits. Records are trusted out to a
+  // distance proportional to this.
+  double radius;
+  // Change in each colour channel's irradiance as the normal rotates,
+  // and as the point moves
+  Vector3D rotation_gradient[3];
+  Vector3D translation_gradient[3];
+};
+
+// Sums the contributions of the records valid at one point, using
+// Ward's weight 1 / (|p - p_i| / R_i + sqrt(1 - n . n_i)). A record
+// counts if its weight is above 1 / accuracy and it isn't in front of
+// the point.
+class IrradianceEstimate {
+public:
+  IrradianceEstimate(const Point3D& p, const Vector3D& n, double accuracy);
+
+  const Point3D& position() const { return m_pos; }
+
+  void add(const IrradianceRecord& record);
+
+  bool valid() const { return m_weight > 0.0; }
+  Colour irradiance() const;
+
+private:
+  Point3D m_pos;
+  Vector3D m_normal;
+  double m_accuracy;
+
+  double m_weight;
+  double m_sum[3];
+};
+
+// Counters for cache lookups, kept per thread
+struct IrradianceStats {
+  IrradianceStats() : lookups(0), interpolated(0), computed(0) {}
+
+  long lookups;
+  // Lookups answered from the cache, and those that needed a new
+  // hemisphere estimate
+  long interpolated;
+  long computed;
+};
+
+// An octree of irradiance records. Each record is stored in every node
+// its region of validity overlaps, at the depth where nodes are about
+// the size of that region, so a lookup only has to visit the nodes on
+// the path from the root to the point.
+//
+// insert() and lookup() don't lock. a4_render fills the cache in a
+// separate pass, merging each round of new records in between rounds,
+// so the render itself only ever reads it.
+class IrradianceCache {
+public:
+  // The cache covers "bounds". Accuracy is Ward's a: smaller values
+  // mean more records, closer together.
+  IrradianceCache(const BBox& bounds, double accuracy);
+  ~IrradianceCache();
+
+  double accuracy() const { return m_accuracy; }
+
+  // Limits on a record's radius, so records near corners don't get
+  // vanishingly small and records in the open don't cover everything
+  double min_radius() const { return m_min_radius; }
+  double max_radius() const { return m_max_radius; }
+
+  void insert(const IrradianceRecord& record);
+
+  // Add every stored record that's valid at the estimate's point
+  void lookup(IrradianceEstimate& estimate) const;
+
+  size_t size() const { return m_records.size(); }
+  size_t nodes() const { return m_nodes; }
+
+private:
+  IrradianceCache(const IrradianceCache&);
+  IrradianceCache& operator=(const IrradianceCache&);
+
+  struct Node {
+    Node();
+    ~Node();
+
+    Node* children[8];
+    std::vector<const IrradianceRecord*> records;
+  };
+
+  void insert(Node* node, const Point3D& min, const Point3D& max,
+              const IrradianceRecord* record, const BBox& region, int depth);
+
+  double m_accuracy;
+  double m_min_radius, m_max_radius;
+
+  // The root node covers the cube [m_min, m_max]
+  Point3D m_min, m_max;
+  Node m_root;
+  size_t m_nodes;
+
+  std::vector<IrradianceRecord*> m_records;
+};
+
+#endif
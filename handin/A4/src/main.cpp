@@ -1,16 +1,192 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
 #include "scene_lua.hpp"
+#include "a4.hpp"
+#include "mesh.hpp"
+#include "accel.hpp"
+
+static void usage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options] [scene.lua]\n"
+            << "  -order scanline|morton|hilbert   tile/pixel traversal order (default morton)\n"
+            << "  -tile N                          tile size in pixels (default 16)\n"
+            << "  -depth N                         maximum reflection/refraction bounces (default 5)\n"
+            << "  -threads N                       render threads (default: one per CPU)\n"
+            << "  -samples N                       jittered samples per pixel (default 1)\n"
+            << "  -seed N                          random seed for stochastic sampling (default 0)\n"
+            << "  -path                            path trace, taking up to -samples samples per pixel\n"
+            << "  -noise T                         stop path tracing a pixel once within T of its mean (e.g. 0.02)\n"
+            << "  -denoise                         filter the image, guided by albedo, normals and depth\n"
+            << "  -guides                          also save the albedo, normal and depth buffers\n"
+            << "  -aov                             save float colour, guides and object ids to a .aov file\n"
+            << "  -texture-memory MB               texture cache size (default 256)\n"
+            << "  -bvh binary|wide                 mesh hierarchy: binary, or 4-wide quantized (default wide)\n"
+            << "  -triangles indexed|packed        mesh triangles: vertex indices, or precomputed packets of 4 (default packed)\n"
+            << "  -accel bvh|grid|grid2            index for sets of primitives, and gather sibling spheres into sets (default bvh, no gathering)\n"
+            << "  -check-transforms                check node inverses against full inversion\n"
+            << "  -crop X Y W H                    only render the W x H region at (X, Y)\n"
+            << "  -composite                       paste a cropped render into the existing output image\n"
+            << "  -budget SECONDS                  render the best image possible in the given time\n"
+            << "  -photons N                       shoot N caustic photons before rendering (default 0)\n"
+            << "  -gather K                        photons per caustic estimate (default 50)\n"
+            << "  -gather-radius R                 largest caustic gather radius (default: from scene size)\n"
+            << "  -irradiance A                    cache indirect diffuse light with accuracy A (default off)\n"
+            << "  -irradiance-samples N            hemisphere rays per irradiance record (default 256)"
+            << std::endl;
+}
 
 int main(int argc, char** argv)
 {
   std::string filename = "scene.lua";
-  if (argc >= 2) {
-    filename = argv[1];
+  bool check_transforms = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "-order") == 0 && i + 1 < argc) {
+      if (!parse_traversal_order(argv[++i], a4_options.order)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-tile") == 0 && i + 1 < argc) {
+      a4_options.tile_size = std::atoi(argv[++i]);
+      if (a4_options.tile_size < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-depth") == 0 && i + 1 < argc) {
+      a4_options.max_depth = std::atoi(argv[++i]);
+      if (a4_options.max_depth < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+      a4_options.threads = std::atoi(argv[++i]);
+      if (a4_options.threads < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-samples") == 0 && i + 1 < argc) {
+      a4_options.samples = std::atoi(argv[++i]);
+      if (a4_options.samples < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      a4_options.seed = std::strtoul(argv[++i], 0, 10);
+    } else if (std::strcmp(argv[i], "-path") == 0) {
+      a4_options.path_trace = true;
+    } else if (std::strcmp(argv[i], "-noise") == 0 && i + 1 < argc) {
+      a4_options.noise_threshold = std::atof(argv[++i]);
+      if (a4_options.noise_threshold <= 0.0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-denoise") == 0) {
+      a4_options.denoise = true;
+    } else if (std::strcmp(argv[i], "-guides") == 0) {
+      a4_options.write_guides = true;
+    } else if (std::strcmp(argv[i], "-aov") == 0) {
+      a4_options.write_aov = true;
+    } else if (std::strcmp(argv[i], "-texture-memory") == 0 && i + 1 < argc) {
+      double megabytes = std::atof(argv[++i]);
+      if (megabytes <= 0.0) {
+        usage(argv[0]);
+        return 1;
+      }
+      a4_options.texture_memory = (size_t)(megabytes * (1 << 20));
+    } else if (std::strcmp(argv[i], "-bvh") == 0 && i + 1 < argc) {
+      const char* layout = argv[++i];
+      if (std::strcmp(layout, "binary") == 0) {
+        Mesh::set_tree_layout(Mesh::TREE_BINARY);
+      } else if (std::strcmp(layout, "wide") == 0) {
+        Mesh::set_tree_layout(Mesh::TREE_WIDE);
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-triangles") == 0 && i + 1 < argc) {
+      const char* layout = argv[++i];
+      if (std::strcmp(layout, "indexed") == 0) {
+        Mesh::set_triangle_layout(Mesh::TRIANGLES_INDEXED);
+      } else if (std::strcmp(layout, "packed") == 0) {
+        Mesh::set_triangle_layout(Mesh::TRIANGLES_PACKED);
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-accel") == 0 && i + 1 < argc) {
+      AcceleratorType type;
+      if (!parse_accelerator(argv[++i], type)) {
+        usage(argv[0]);
+        return 1;
+      }
+      PrimitiveSet::set_default_accelerator(type);
+      a4_options.gather_spheres = true;
+    } else if (std::strcmp(argv[i], "-check-transforms") == 0) {
+      SceneNode::set_check_inverses(true);
+      check_transforms = true;
+    } else if (std::strcmp(argv[i], "-crop") == 0 && i + 4 < argc) {
+      a4_options.crop_x = std::atoi(argv[++i]);
+      a4_options.crop_y = std::atoi(argv[++i]);
+      a4_options.crop_width = std::atoi(argv[++i]);
+      a4_options.crop_height = std::atoi(argv[++i]);
+      if (a4_options.crop_width < 1 || a4_options.crop_height < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-composite") == 0) {
+      a4_options.composite = true;
+    } else if (std::strcmp(argv[i], "-budget") == 0 && i + 1 < argc) {
+      a4_options.budget = std::atof(argv[++i]);
+      if (a4_options.budget <= 0.0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-photons") == 0 && i + 1 < argc) {
+      a4_options.photons = std::atol(argv[++i]);
+      if (a4_options.photons < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-gather") == 0 && i + 1 < argc) {
+      a4_options.photon_gather = std::atoi(argv[++i]);
+      if (a4_options.photon_gather < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-gather-radius") == 0 && i + 1 < argc) {
+      a4_options.photon_radius = std::atof(argv[++i]);
+      if (a4_options.photon_radius <= 0.0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-irradiance") == 0 && i + 1 < argc) {
+      a4_options.irradiance_accuracy = std::atof(argv[++i]);
+      if (a4_options.irradiance_accuracy <= 0.0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-irradiance-samples") == 0 && i + 1 < argc) {
+      a4_options.irradiance_samples = std::atoi(argv[++i]);
+      if (a4_options.irradiance_samples < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      filename = argv[i];
+    }
   }
 
   if (!run_lua(filename)) {
     std::cerr << "Could not open " << filename << std::endl;
     return 1;
   }
-}
 
+  if (check_transforms) {
+    std::cerr << "Transforms: " << SceneNode::inverse_mismatches()
+              << " inverses differed from full inversion" << std::endl;
+  }
+}
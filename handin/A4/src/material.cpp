@@ -4,8 +4,13 @@ Material::~Material()
 {
 }
 
-PhongMaterial::PhongMaterial(const Colour& kd, const Colour& ks, double shininess)
-  : m_kd(kd), m_ks(ks), m_shininess(shininess)
+PhongMaterial::PhongMaterial(const Colour& kd, const Colour& ks, double shininess,
+                             double reflectivity,
+                             double transparency, double ior)
+  : m_kd(kd), m_ks(ks), m_shininess(shininess),
+    m_reflectivity(reflectivity),
+    m_transparency(transparency), m_ior(ior),
+    m_texture(0)
 {
 }
 
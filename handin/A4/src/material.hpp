@@ -3,6 +3,8 @@
 
 #include "algebra.hpp"
 
+class Texture;
+
 class Material {
 public:
   virtual ~Material();
@@ -16,16 +18,42 @@ protected:
 
 class PhongMaterial : public Material {
 public:
-  PhongMaterial(const Colour& kd, const Colour& ks, double shininess);
+  PhongMaterial(const Colour& kd, const Colour& ks, double shininess,
+                double reflectivity = 0.0,
+                double transparency = 0.0, double ior = 1.0);
   virtual ~PhongMaterial();
 
   virtual void apply_gl() const;
 
+  const Colour& diffuse() const { return m_kd; }
+  const Colour& specular() const { return m_ks; }
+  double shininess() const { return m_shininess; }
+
+  // Fraction of ks reflected as a mirror
+  double reflectivity() const { return m_reflectivity; }
+  // Fraction of light transmitted through the surface, and the index
+  // of refraction used to bend it
+  double transparency() const { return m_transparency; }
+  double ior() const { return m_ior; }
+
+  // Texture the diffuse colour is multiplied by, if any
+  const Texture* texture() const { return m_texture; }
+  void set_texture(const Texture* texture) { m_texture = texture; }
+
+  // Change the diffuse colour, as for a textured copy of a material
+  void set_diffuse(const Colour& kd) { m_kd = kd; }
+
 private:
   Colour m_kd;
   Colour m_ks;
 
   double m_shininess;
+
+  double m_reflectivity;
+  double m_transparency;
+  double m_ior;
+
+  const Texture* m_texture;
 };
 
 
@@ -1,30 +1,1113 @@
 #include "mesh.hpp"
 #include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Most triangles a leaf of the hierarchy holds
+static const int MAX_LEAF_TRIANGLES = 4;
+// Triangles in a TrianglePacket
+static const int PACKET_TRIANGLES = 4;
+// Bytes triangle packets are aligned to: a cache line
+static const size_t PACKET_ALIGNMENT = 64;
+// Candidate split planes tried along each node's widest axis
+static const int SAH_BINS = 12;
+// Deepest the hierarchy goes, which bounds the traversal stack
+static const int MAX_DEPTH = 64;
+// Entries a wide tree's traversal stack can need: up to four children
+// are pushed for each node popped, and collapsing never adds depth
+static const int WIDE_STACK = 3 * MAX_DEPTH + 1;
+// Inverse ray directions are clamped to this, so that axis-parallel
+// rays don't produce infinities (and then NaNs) in the box tests
+static const float MAX_INV_DIR = 1e30f;
+// A wide node's quantization step is at least this fraction of the
+// size of its coordinates, which leaves room for the rounding of
+// float box tests
+static const int MIN_STEP_BITS = 16;
+
+static Mesh::TreeLayout s_tree_layout = Mesh::TREE_WIDE;
+static Mesh::TriangleLayout s_triangle_layout = Mesh::TRIANGLES_PACKED;
+
+void Mesh::set_tree_layout(TreeLayout layout)
+{
+  s_tree_layout = layout;
+}
+
+Mesh::TreeLayout Mesh::tree_layout()
+{
+  return s_tree_layout;
+}
+
+void Mesh::set_triangle_layout(TriangleLayout layout)
+{
+  s_triangle_layout = layout;
+}
+
+Mesh::TriangleLayout Mesh::triangle_layout()
+{
+  return s_triangle_layout;
+}
+
+Mesh::Mesh()
+  : m_vert_data(0), m_triangle_data(0), m_node_data(0),
+    m_vert_count(0), m_triangle_count(0), m_node_count(0),
+    m_packets(0), m_packet_count(0),
+    m_map(0), m_map_size(0)
+{
+}
 
 Mesh::Mesh(const std::vector<Point3D>& verts,
            const std::vector< std::vector<int> >& faces)
-  : m_verts(verts),
-    m_faces(faces)
+  : m_vert_data(0), m_triangle_data(0), m_node_data(0),
+    m_vert_count(0), m_triangle_count(0), m_node_count(0),
+    m_verts(verts),
+    m_packets(0), m_packet_count(0),
+    m_map(0), m_map_size(0)
+{
+  build(faces);
+}
+
+Mesh::~Mesh()
+{
+  if (m_map) munmap(m_map, m_map_size);
+  std::free(m_packets);
+}
+
+static double surface_area(const BBox& box)
+{
+  if (box.empty()) return 0.0;
+  Vector3D d = box.max() - box.min();
+  return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+void Mesh::build(const std::vector< std::vector<int> >& faces)
+{
+  for (std::vector<Face>::const_iterator F = faces.begin(); F != faces.end(); ++F) {
+    for (size_t i = 1; i + 1 < F->size(); i++) {
+      Triangle tri;
+      tri.v[0] = (*F)[0];
+      tri.v[1] = (*F)[i];
+      tri.v[2] = (*F)[i + 1];
+      m_triangles.push_back(tri);
+    }
+  }
+  m_vert_data = m_verts.empty() ? 0 : &m_verts[0];
+  m_vert_count = m_verts.size();
+  if (m_triangles.empty()) return;
+
+  std::vector<int> order(m_triangles.size());
+  std::vector<Point3D> centroids(m_triangles.size());
+  for (size_t i = 0; i < m_triangles.size(); i++) {
+    const Triangle& tri = m_triangles[i];
+    order[i] = i;
+    for (int k = 0; k < 3; k++) {
+      centroids[i][k] = (m_verts[tri.v[0]][k] + m_verts[tri.v[1]][k] + m_verts[tri.v[2]][k]) / 3.0;
+    }
+  }
+
+  m_nodes.reserve(2 * m_triangles.size() / MAX_LEAF_TRIANGLES + 1);
+  build_node(order, centroids, 0, order.size(), 0);
+
+  // Store the triangles in the order the leaves refer to them
+  std::vector<Triangle> sorted(m_triangles.size());
+  for (size_t i = 0; i < order.size(); i++) sorted[i] = m_triangles[order[i]];
+  m_triangles.swap(sorted);
+
+  m_triangle_data = &m_triangles[0];
+  m_triangle_count = m_triangles.size();
+  m_node_data = &m_nodes[0];
+  m_node_count = m_nodes.size();
+  m_bounds = m_nodes[0].box;
+
+  if (s_triangle_layout == TRIANGLES_PACKED) build_packets();
+  if (s_tree_layout == TREE_WIDE) build_wide();
+}
+
+// Fill in a packet for each PACKET_TRIANGLES triangles of each leaf,
+// and point the leaves at their packets
+void Mesh::build_packets()
+{
+  size_t count = 0;
+  for (size_t i = 0; i < m_nodes.size(); i++) {
+    int n = m_nodes[i].count;
+    count += (n + PACKET_TRIANGLES - 1) / PACKET_TRIANGLES;
+  }
+
+  void* memory;
+  if (posix_memalign(&memory, PACKET_ALIGNMENT, count * sizeof(TrianglePacket)) != 0) {
+    std::cerr << "Out of memory for " << count << " triangle packets; using indexed triangles"
+              << std::endl;
+    return;
+  }
+  m_packets = static_cast<TrianglePacket*>(memory);
+  std::memset(m_packets, 0, count * sizeof(TrianglePacket));
+  m_packet_count = count;
+
+  size_t packet = 0;
+  for (size_t i = 0; i < m_nodes.size(); i++) {
+    Node& node = m_nodes[i];
+    if (node.count == 0) continue;
+    for (int j = 0; j < node.count; j++) {
+      const Triangle& tri = m_triangles[node.offset + j];
+      TrianglePacket& p = m_packets[packet + j / PACKET_TRIANGLES];
+      int lane = j % PACKET_TRIANGLES;
+      const Point3D& p0 = m_verts[tri.v[0]];
+      Vector3D e1 = m_verts[tri.v[1]] - p0;
+      Vector3D e2 = m_verts[tri.v[2]] - p0;
+      for (int a = 0; a < 3; a++) {
+        p.p0[a][lane] = p0[a];
+        p.e1[a][lane] = e1[a];
+        p.e2[a][lane] = e2[a];
+      }
+    }
+    node.offset = packet;
+    packet += (node.count + PACKET_TRIANGLES - 1) / PACKET_TRIANGLES;
+  }
+}
+
+size_t Mesh::tree_bytes() const
+{
+  return m_node_count * sizeof(Node) + m_wide.size() * sizeof(WideNode);
+}
+
+size_t Mesh::triangle_bytes() const
+{
+  return m_triangle_count * sizeof(Triangle) + m_packet_count * sizeof(TrianglePacket);
+}
+
+// The float nearest x that's no greater than it
+static float float_below(double x)
+{
+  float f = (float)x;
+  return f > x ? nextafterf(f, -HUGE_VALF) : f;
+}
+
+// 2^exponent as a float, for exponents in a signed char
+static float step_size(int exponent)
 {
+  return ldexpf(1.0f, exponent);
+}
+
+void Mesh::build_wide()
+{
+  m_centre = m_bounds.min() + 0.5 * (m_bounds.max() - m_bounds.min());
+  m_wide.reserve(m_node_count / 3 + 1);
+  collapse(0);
+
+  // The binary tree isn't needed any more
+  std::vector<Node>().swap(m_nodes);
+  m_node_data = 0;
+  m_node_count = 0;
+}
+
+// Make a wide node from the binary subtree at "node", returning its
+// index. The node's children are found by repeatedly opening up the
+// biggest interior node among them, until there are four.
+int Mesh::collapse(int node)
+{
+  int members[4];
+  int n = 0;
+  if (m_nodes[node].count > 0) {
+    members[n++] = node;
+  } else {
+    members[n++] = node + 1;
+    members[n++] = m_nodes[node].offset;
+  }
+  while (n < 4) {
+    int biggest = -1;
+    double area = -1.0;
+    for (int i = 0; i < n; i++) {
+      const Node& m = m_nodes[members[i]];
+      if (m.count == 0 && surface_area(m.box) > area) {
+        area = surface_area(m.box);
+        biggest = i;
+      }
+    }
+    if (biggest < 0) break;
+    int opened = members[biggest];
+    members[biggest] = opened + 1;
+    members[n++] = m_nodes[opened].offset;
+  }
+
+  int index = m_wide.size();
+  m_wide.push_back(WideNode());
+  WideNode wide;
+  std::memset(&wide, 0, sizeof(wide));
+
+  // Pick each axis's origin and step so that 255 steps cover the box
+  const BBox& box = m_nodes[node].box;
+  double size = 0.0;
+  for (int a = 0; a < 3; a++) {
+    size = std::max(size, std::max(fabs(box.min()[a] - m_centre[a]),
+                                   fabs(box.max()[a] - m_centre[a])));
+  }
+  for (int a = 0; a < 3; a++) {
+    double min = box.min()[a] - m_centre[a], max = box.max()[a] - m_centre[a];
+    wide.origin[a] = float_below(min);
+    int exponent = std::max(ilogb(std::max(size, 1e-30)) - MIN_STEP_BITS, -126);
+    while (exponent < 127 && wide.origin[a] + 255.0f * step_size(exponent) < max) exponent++;
+    wide.exponent[a] = exponent;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    if (i >= n) {
+      // An empty box: the first step is past the last on every axis
+      wide.child[i] = -1;
+      for (int a = 0; a < 3; a++) {
+        wide.lo[a][i] = 255;
+        wide.hi[a][i] = 0;
+      }
+      continue;
+    }
+
+    // Round each box outward a step further than it needs, to cover
+    // rounding in the box tests, and check the float arithmetic the
+    // tests will do really does contain it
+    const BBox& child = m_nodes[members[i]].box;
+    for (int a = 0; a < 3; a++) {
+      double min = child.min()[a] - m_centre[a], max = child.max()[a] - m_centre[a];
+      float origin = wide.origin[a], step = step_size(wide.exponent[a]);
+      int lo = std::max(0, (int)floor((min - origin) / step) - 1);
+      int hi = std::min(255, (int)ceil((max - origin) / step) + 1);
+      while (lo > 0 && origin + lo * step > min) lo--;
+      while (hi < 255 && origin + hi * step < max) hi++;
+      wide.lo[a][i] = lo;
+      wide.hi[a][i] = hi;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    const Node& m = m_nodes[members[i]];
+    if (m.count > 0) {
+      wide.child[i] = m.offset;
+      wide.count[i] = m.count;
+    } else {
+      wide.child[i] = collapse(members[i]);
+      wide.count[i] = 0;
+    }
+  }
+
+  m_wide[index] = wide;
+  return index;
+}
+
+// Which of SAH_BINS bins along an axis a centroid falls in
+struct BinOf {
+  BinOf(const std::vector<Point3D>& centroids, int axis, double min, double scale)
+    : centroids(centroids), axis(axis), min(min), scale(scale)
+  {
+  }
+
+  int operator()(int tri) const
+  {
+    int bin = (int)((centroids[tri][axis] - min) * scale);
+    return std::max(0, std::min(bin, SAH_BINS - 1));
+  }
+
+  const std::vector<Point3D>& centroids;
+  int axis;
+  double min, scale;
+};
+
+struct BelowBin {
+  BelowBin(const BinOf& bin_of, int split) : bin_of(bin_of), split(split) {}
+  bool operator()(int tri) const { return bin_of(tri) < split; }
+
+  const BinOf& bin_of;
+  int split;
+};
+
+struct CentroidLess {
+  CentroidLess(const std::vector<Point3D>& centroids, int axis)
+    : centroids(centroids), axis(axis)
+  {
+  }
+  bool operator()(int a, int b) const { return centroids[a][axis] < centroids[b][axis]; }
+
+  const std::vector<Point3D>& centroids;
+  int axis;
+};
+
+// Build the subtree over order[first, last), returning its index.
+// Splits go along the axis where the centroids spread widest, at
+// whichever bin boundary the surface area heuristic says is cheapest.
+int Mesh::build_node(std::vector<int>& order, const std::vector<Point3D>& centroids,
+                     int first, int last, int depth)
+{
+  BBox box, centre_box;
+  for (int i = first; i < last; i++) {
+    const Triangle& tri = m_triangles[order[i]];
+    for (int k = 0; k < 3; k++) box.expand(m_verts[tri.v[k]]);
+    centre_box.expand(centroids[order[i]]);
+  }
+
+  int index = m_nodes.size();
+  m_nodes.push_back(Node());
+  m_nodes[index].box = box;
+
+  Vector3D spread = centre_box.max() - centre_box.min();
+  int axis = 0;
+  if (spread[1] > spread[axis]) axis = 1;
+  if (spread[2] > spread[axis]) axis = 2;
+
+  int count = last - first;
+  if (count <= MAX_LEAF_TRIANGLES) {
+    m_nodes[index].offset = first;
+    m_nodes[index].count = count;
+    m_nodes[index].axis = 0;
+    return index;
+  }
+
+  // Levels of halving it would take to get down to leaves. Once the
+  // tree is about to run out of depth for them, or the centroids don't
+  // spread at all, halve instead of splitting by the heuristic, so no
+  // leaf ever holds more than MAX_LEAF_TRIANGLES (wide nodes count
+  // their leaves' triangles in a byte).
+  int halvings = 0;
+  for (int n = count; n > MAX_LEAF_TRIANGLES; n = (n + 1) / 2) halvings++;
+
+  int middle = -1;
+  if (spread[axis] > 0.0 && depth + halvings < MAX_DEPTH - 1) {
+    BinOf bin_of(centroids, axis, centre_box.min()[axis], SAH_BINS / spread[axis]);
+    BBox bins[SAH_BINS];
+    int counts[SAH_BINS] = { 0 };
+    for (int i = first; i < last; i++) {
+      const Triangle& tri = m_triangles[order[i]];
+      int bin = bin_of(order[i]);
+      counts[bin]++;
+      for (int k = 0; k < 3; k++) bins[bin].expand(m_verts[tri.v[k]]);
+    }
+
+    // Cost of splitting below bin s, for each s, from sweeps both ways
+    double below_cost[SAH_BINS];
+    BBox below;
+    int below_count = 0;
+    for (int s = 1; s < SAH_BINS; s++) {
+      below.expand(bins[s - 1]);
+      below_count += counts[s - 1];
+      below_cost[s] = surface_area(below) * below_count;
+    }
+    int split = 0;
+    double best = HUGE_VAL;
+    BBox above;
+    int above_count = 0;
+    for (int s = SAH_BINS - 1; s >= 1; s--) {
+      above.expand(bins[s]);
+      above_count += counts[s];
+      double cost = below_cost[s] + surface_area(above) * above_count;
+      if (above_count > 0 && above_count < count && cost < best) {
+        best = cost;
+        split = s;
+      }
+    }
+    if (split > 0) {
+      middle = std::partition(order.begin() + first, order.begin() + last,
+                              BelowBin(bin_of, split)) - order.begin();
+    }
+  }
+
+  if (middle < 0) {
+    // Every centroid landed in one bin, or there's no depth to spare;
+    // fall back to halving
+    middle = (first + last) / 2;
+    std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last,
+                     CentroidLess(centroids, axis));
+  }
+
+  build_node(order, centroids, first, middle, depth + 1);
+  int second = build_node(order, centroids, middle, last, depth + 1);
+  m_nodes[index].offset = second;
+  m_nodes[index].count = 0;
+  m_nodes[index].axis = axis;
+  return index;
+}
+
+// Intersect the line along a ray with triangle (p0, p1, p2) using the
+// Moller-Trumbore algorithm, returning the line parameter of the hit.
+bool Mesh::triangle_hit(const Triangle& tri, const Ray& ray, double& t) const
+{
+  const Point3D& p0 = m_vert_data[tri.v[0]];
+  Vector3D e1 = m_vert_data[tri.v[1]] - p0;
+  Vector3D e2 = m_vert_data[tri.v[2]] - p0;
+
+  Vector3D pvec = ray.dir.cross(e2);
+  double det = e1.dot(pvec);
+  if (det == 0.0) return false;
+  double inv_det = 1.0 / det;
+
+  Vector3D tvec = ray.origin - p0;
+  double u = tvec.dot(pvec) * inv_det;
+  if (u < 0.0 || u > 1.0) return false;
+
+  Vector3D qvec = tvec.cross(e1);
+  double v = ray.dir.dot(qvec) * inv_det;
+  if (v < 0.0 || u + v > 1.0) return false;
+
+  t = e2.dot(qvec) * inv_det;
+  return true;
+}
+
+Vector3D Mesh::triangle_normal(const Triangle& tri) const
+{
+  const Point3D& p0 = m_vert_data[tri.v[0]];
+  return (m_vert_data[tri.v[1]] - p0).cross(m_vert_data[tri.v[2]] - p0);
+}
+
+// The packet tests below do exactly the arithmetic triangle_hit does,
+// in the same order, so they find exactly the same hits.
+
+#ifdef __SSE2__
+
+// a.b for vectors given by coordinate, two at a time
+static inline __m128d dot2(__m128d ax, __m128d ay, __m128d az,
+                           __m128d bx, __m128d by, __m128d bz)
+{
+  return _mm_add_pd(_mm_add_pd(_mm_mul_pd(ax, bx), _mm_mul_pd(ay, by)), _mm_mul_pd(az, bz));
+}
+
+// One coordinate of a cross product: a1*b2 - a2*b1
+static inline __m128d cross2(__m128d a1, __m128d b2, __m128d a2, __m128d b1)
+{
+  return _mm_sub_pd(_mm_mul_pd(a1, b2), _mm_mul_pd(a2, b1));
+}
+
+int Mesh::packet_hits(const TrianglePacket& packet, const Ray& ray, double t[4])
+{
+  __m128d dx = _mm_set1_pd(ray.dir[0]), dy = _mm_set1_pd(ray.dir[1]), dz = _mm_set1_pd(ray.dir[2]);
+  __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+  int mask = 0;
+
+  // Two triangles per SSE2 register, so two passes cover the packet
+  for (int i = 0; i < PACKET_TRIANGLES; i += 2) {
+    __m128d e1x = _mm_load_pd(&packet.e1[0][i]);
+    __m128d e1y = _mm_load_pd(&packet.e1[1][i]);
+    __m128d e1z = _mm_load_pd(&packet.e1[2][i]);
+    __m128d e2x = _mm_load_pd(&packet.e2[0][i]);
+    __m128d e2y = _mm_load_pd(&packet.e2[1][i]);
+    __m128d e2z = _mm_load_pd(&packet.e2[2][i]);
+
+    __m128d px = cross2(dy, e2z, dz, e2y);
+    __m128d py = cross2(dz, e2x, dx, e2z);
+    __m128d pz = cross2(dx, e2y, dy, e2x);
+    __m128d det = dot2(e1x, e1y, e1z, px, py, pz);
+    __m128d inv_det = _mm_div_pd(one, det);
+
+    __m128d tx = _mm_sub_pd(_mm_set1_pd(ray.origin[0]), _mm_load_pd(&packet.p0[0][i]));
+    __m128d ty = _mm_sub_pd(_mm_set1_pd(ray.origin[1]), _mm_load_pd(&packet.p0[1][i]));
+    __m128d tz = _mm_sub_pd(_mm_set1_pd(ray.origin[2]), _mm_load_pd(&packet.p0[2][i]));
+    __m128d u = _mm_mul_pd(dot2(tx, ty, tz, px, py, pz), inv_det);
+
+    __m128d qx = cross2(ty, e1z, tz, e1y);
+    __m128d qy = cross2(tz, e1x, tx, e1z);
+    __m128d qz = cross2(tx, e1y, ty, e1x);
+    __m128d v = _mm_mul_pd(dot2(dx, dy, dz, qx, qy, qz), inv_det);
+
+    __m128d miss = _mm_or_pd(_mm_cmpeq_pd(det, zero),
+                             _mm_or_pd(_mm_cmplt_pd(u, zero), _mm_cmpgt_pd(u, one)));
+    miss = _mm_or_pd(miss, _mm_or_pd(_mm_cmplt_pd(v, zero),
+                                     _mm_cmpgt_pd(_mm_add_pd(u, v), one)));
+    mask |= (~_mm_movemask_pd(miss) & 3) << i;
+    _mm_storeu_pd(t + i, _mm_mul_pd(dot2(e2x, e2y, e2z, qx, qy, qz), inv_det));
+  }
+  return mask;
+}
+
+#else
+
+int Mesh::packet_hits(const TrianglePacket& packet, const Ray& ray, double t[4])
+{
+  int mask = 0;
+  for (int i = 0; i < PACKET_TRIANGLES; i++) {
+    Vector3D e1(packet.e1[0][i], packet.e1[1][i], packet.e1[2][i]);
+    Vector3D e2(packet.e2[0][i], packet.e2[1][i], packet.e2[2][i]);
+
+    Vector3D pvec = ray.dir.cross(e2);
+    double det = e1.dot(pvec);
+    if (det == 0.0) continue;
+    double inv_det = 1.0 / det;
+
+    Vector3D tvec = ray.origin - Point3D(packet.p0[0][i], packet.p0[1][i], packet.p0[2][i]);
+    double u = tvec.dot(pvec) * inv_det;
+    if (u < 0.0 || u > 1.0) continue;
+
+    Vector3D qvec = tvec.cross(e1);
+    double v = ray.dir.dot(qvec) * inv_det;
+    if (v < 0.0 || u + v > 1.0) continue;
+
+    t[i] = e2.dot(qvec) * inv_det;
+    mask |= 1 << i;
+  }
+  return mask;
+}
+
+#endif
+
+Vector3D Mesh::packet_normal(const TrianglePacket& packet, int i)
+{
+  Vector3D e1(packet.e1[0][i], packet.e1[1][i], packet.e1[2][i]);
+  Vector3D e2(packet.e2[0][i], packet.e2[1][i], packet.e2[2][i]);
+  return e1.cross(e2);
+}
+
+void Mesh::leaf_hits(const Ray& ray, int offset, int count, double tmin, double& tmax,
+                     int& closest) const
+{
+  if (!m_packets) {
+    for (int i = offset; i < offset + count; i++) {
+      double t;
+      if (!triangle_hit(m_triangle_data[i], ray, t) || t <= tmin || t >= tmax) continue;
+      tmax = t;
+      closest = i;
+    }
+    return;
+  }
+
+  // Packed triangles are numbered PACKET_TRIANGLES per packet
+  for (int p = offset; count > 0; p++, count -= PACKET_TRIANGLES) {
+    double t[4];
+    int mask = packet_hits(m_packets[p], ray, t);
+    for (int i = 0; i < std::min(count, PACKET_TRIANGLES); i++) {
+      if (!(mask & (1 << i)) || t[i] <= tmin || t[i] >= tmax) continue;
+      tmax = t[i];
+      closest = p * PACKET_TRIANGLES + i;
+    }
+  }
+}
+
+Vector3D Mesh::hit_normal(int closest) const
+{
+  if (!m_packets) return triangle_normal(m_triangle_data[closest]);
+  return packet_normal(m_packets[closest / PACKET_TRIANGLES], closest % PACKET_TRIANGLES);
+}
+
+static bool hit_before(const Intersection& a, const Intersection& b)
+{
+  return a.t < b.t;
+}
+
+bool Mesh::intersect(const Ray& ray, double tmin, double tmax,
+                     Intersection& hit) const
+{
+  if (!m_wide.empty()) return intersect_wide(ray, tmin, tmax, hit);
+  if (m_node_count == 0) return false;
+
+  int closest = -1;
+  int stack[MAX_DEPTH];
+  int top = 0;
+  int node = 0;
+
+  for (;;) {
+    const Node& n = m_node_data[node];
+    if (n.box.hit(ray, tmin, tmax)) {
+      if (n.count == 0) {
+        // Visit the child on the near side of the split first, so the
+        // far one is more often culled by what it finds
+        int near = node + 1, far = n.offset;
+        if (ray.dir[n.axis] < 0.0) std::swap(near, far);
+        stack[top++] = far;
+        node = near;
+        continue;
+      }
+
+      leaf_hits(ray, n.offset, n.count, tmin, tmax, closest);
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+
+  if (closest < 0) return false;
+  hit.t = tmax;
+  hit.normal = hit_normal(closest);
+  return true;
+}
+
+Mesh::WideRay Mesh::wide_ray(const Ray& ray) const
+{
+  WideRay wide;
+  for (int a = 0; a < 3; a++) {
+    wide.origin[a] = ray.origin[a] - m_centre[a];
+    double inv = ray.dir[a] == 0.0 ? MAX_INV_DIR : 1.0 / ray.dir[a];
+    wide.inv_dir[a] = std::max(-MAX_INV_DIR, std::min((float)inv, MAX_INV_DIR));
+    wide.negative[a] = ray.dir[a] < 0.0;
+  }
+  return wide;
+}
+
+#ifdef __SSE2__
+
+// Four steps counts as floats, scaled and offset
+static inline __m128 dequantize(const unsigned char steps[4], __m128 origin, __m128 step)
+{
+  int packed;
+  std::memcpy(&packed, steps, 4);
+  __m128i zero = _mm_setzero_si128();
+  __m128i bytes = _mm_cvtsi32_si128(packed);
+  __m128i ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+  return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(ints), step));
+}
+
+int Mesh::wide_hits(const WideNode& node, const WideRay& ray,
+                    float tmin, float tmax, float tnear[4])
+{
+  __m128 near = _mm_set1_ps(tmin);
+  __m128 far = _mm_set1_ps(tmax);
+  for (int a = 0; a < 3; a++) {
+    // Planes the ray meets first and last along this axis
+    const unsigned char* first = ray.negative[a] ? node.hi[a] : node.lo[a];
+    const unsigned char* last = ray.negative[a] ? node.lo[a] : node.hi[a];
+    __m128 origin = _mm_set1_ps(node.origin[a] - ray.origin[a]);
+    __m128 step = _mm_set1_ps(step_size(node.exponent[a]));
+    __m128 inv = _mm_set1_ps(ray.inv_dir[a]);
+    near = _mm_max_ps(near, _mm_mul_ps(dequantize(first, origin, step), inv));
+    far = _mm_min_ps(far, _mm_mul_ps(dequantize(last, origin, step), inv));
+  }
+  _mm_storeu_ps(tnear, near);
+  return _mm_movemask_ps(_mm_cmple_ps(near, far));
+}
+
+#else
+
+int Mesh::wide_hits(const WideNode& node, const WideRay& ray,
+                    float tmin, float tmax, float tnear[4])
+{
+  int mask = 0;
+  for (int i = 0; i < 4; i++) {
+    float near = tmin, far = tmax;
+    for (int a = 0; a < 3; a++) {
+      const unsigned char* first = ray.negative[a] ? node.hi[a] : node.lo[a];
+      const unsigned char* last = ray.negative[a] ? node.lo[a] : node.hi[a];
+      float origin = node.origin[a] - ray.origin[a];
+      float step = step_size(node.exponent[a]);
+      near = std::max(near, (origin + first[i] * step) * ray.inv_dir[a]);
+      far = std::min(far, (origin + last[i] * step) * ray.inv_dir[a]);
+    }
+    tnear[i] = near;
+    if (near <= far) mask |= 1 << i;
+  }
+  return mask;
+}
+
+#endif
+
+// An entry on a wide traversal stack: a wide node, or a leaf's
+// triangles, and where the ray enters its box
+struct WideEntry {
+  int child;
+  int count;
+  float t;
+};
+
+bool Mesh::intersect_wide(const Ray& ray, double tmin, double tmax,
+                          Intersection& hit) const
+{
+  WideRay wide = wide_ray(ray);
+  float ftmin = float_below(tmin);
+
+  int closest = -1;
+  WideEntry stack[WIDE_STACK];
+  int top = 0;
+  stack[top].child = 0;
+  stack[top].count = 0;
+  stack[top].t = ftmin;
+  top++;
+
+  while (top > 0) {
+    WideEntry entry = stack[--top];
+    // Skip boxes that start beyond the closest hit found since they
+    // were pushed
+    if (entry.t > tmax) continue;
+
+    if (entry.count > 0) {
+      leaf_hits(ray, entry.child, entry.count, tmin, tmax, closest);
+      continue;
+    }
+
+    const WideNode& node = m_wide[entry.child];
+    float tnear[4];
+    int mask = wide_hits(node, wide, ftmin, (float)tmax, tnear);
+
+    // Push the children hit, farthest first, so the nearest is
+    // visited next
+    WideEntry children[4];
+    int n = 0;
+    for (int i = 0; i < 4; i++) {
+      if (!(mask & (1 << i)) || node.child[i] < 0) continue;
+      int j = n++;
+      for (; j > 0 && children[j - 1].t < tnear[i]; j--) children[j] = children[j - 1];
+      children[j].child = node.child[i];
+      children[j].count = node.count[i];
+      children[j].t = tnear[i];
+    }
+    for (int i = 0; i < n; i++) stack[top++] = children[i];
+  }
+
+  if (closest < 0) return false;
+  hit.t = tmax;
+  hit.normal = hit_normal(closest);
+  return true;
+}
+
+// Append a crossing to hits, growing it in the arena
+static void add_crossing(double t, const Vector3D& normal, Arena& arena,
+                         Intersection*& hits, int& hit_count, int& capacity)
+{
+  if (hit_count == capacity) {
+    capacity = std::max(8, 2 * capacity);
+    Intersection* grown = arena.allocate_array<Intersection>(capacity);
+    std::copy(hits, hits + hit_count, grown);
+    hits = grown;
+  }
+  hits[hit_count].t = t;
+  hits[hit_count].normal = normal;
+  hits[hit_count].material = 0;
+  hit_count++;
+}
+
+void Mesh::crossings(const Ray& ray, int offset, int count, Arena& arena,
+                     Intersection*& hits, int& hit_count, int& capacity) const
+{
+  if (!m_packets) {
+    for (int i = offset; i < offset + count; i++) {
+      double t;
+      if (!triangle_hit(m_triangle_data[i], ray, t)) continue;
+      add_crossing(t, triangle_normal(m_triangle_data[i]), arena, hits, hit_count, capacity);
+    }
+    return;
+  }
+
+  for (int p = offset; count > 0; p++, count -= PACKET_TRIANGLES) {
+    double t[4];
+    int mask = packet_hits(m_packets[p], ray, t);
+    for (int i = 0; i < std::min(count, PACKET_TRIANGLES); i++) {
+      if (!(mask & (1 << i))) continue;
+      add_crossing(t[i], packet_normal(m_packets[p], i), arena, hits, hit_count, capacity);
+    }
+  }
+}
+
+void Mesh::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  // Collect every crossing of the surface along the line, growing the
+  // array in the arena as needed
+  Intersection* hits = 0;
+  int count = 0, capacity = 0;
+
+  if (!m_wide.empty()) {
+    WideRay wide = wide_ray(ray);
+    int stack[WIDE_STACK];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+      const WideNode& node = m_wide[stack[--top]];
+      float tnear[4];
+      int mask = wide_hits(node, wide, -HUGE_VALF, HUGE_VALF, tnear);
+      for (int i = 0; i < 4; i++) {
+        if (!(mask & (1 << i)) || node.child[i] < 0) continue;
+        if (node.count[i] == 0) {
+          stack[top++] = node.child[i];
+        } else {
+          crossings(ray, node.child[i], node.count[i], arena, hits, count, capacity);
+        }
+      }
+    }
+  } else if (m_node_count > 0) {
+    int stack[MAX_DEPTH];
+    int top = 0;
+    int node = 0;
+
+    for (;;) {
+      const Node& n = m_node_data[node];
+      if (n.box.hit(ray, -HUGE_VAL, HUGE_VAL)) {
+        if (n.count == 0) {
+          stack[top++] = n.offset;
+          node++;
+          continue;
+        }
+        crossings(ray, n.offset, n.count, arena, hits, count, capacity);
+      }
+      if (top == 0) break;
+      node = stack[--top];
+    }
+  }
+
+  out.count = 0;
+  if (count < 2) return;
+
+  std::sort(hits, hits + count, hit_before);
+
+  // Assuming the mesh is closed, the line is inside between each
+  // crossing that enters (against the normal) and the next that leaves
+  out.spans = arena.allocate_array<Span>(count / 2);
+  bool inside = false;
+  for (int i = 0; i < count; i++) {
+    bool entering = ray.dir.dot(hits[i].normal) < 0.0;
+    if (entering && !inside) {
+      out.spans[out.count].enter = hits[i];
+      inside = true;
+    } else if (!entering && inside) {
+      out.spans[out.count].exit = hits[i];
+      out.count++;
+      inside = false;
+      if (out.count == count / 2) break;
+    }
+  }
+}
+
+BBox Mesh::bounds() const
+{
+  return m_bounds;
+}
+
+// A face corner in an OBJ file: "v", "v/vt", "v//vn" or "v/vt/vn",
+// where v counts from 1, or back from the latest vertex if negative.
+static bool obj_index(const std::string& corner, int vertex_count, int& index)
+{
+  std::istringstream in(corner);
+  int v;
+  if (!(in >> v) || v == 0) return false;
+  index = v > 0 ? v - 1 : vertex_count + v;
+  return index >= 0 && index < vertex_count;
+}
+
+Mesh* Mesh::read_obj(const std::string& filename)
+{
+  std::ifstream in(filename.c_str());
+  if (!in) {
+    std::cerr << "Could not open mesh " << filename << std::endl;
+    return 0;
+  }
+
+  std::vector<Point3D> verts;
+  std::vector<Face> faces;
+  std::string line;
+  int line_number = 0;
+
+  while (std::getline(in, line)) {
+    line_number++;
+    std::istringstream fields(line);
+    std::string command;
+    if (!(fields >> command)) continue;
+
+    if (command == "v") {
+      Point3D p;
+      if (!(fields >> p[0] >> p[1] >> p[2])) {
+        std::cerr << filename << ":" << line_number << ": bad vertex" << std::endl;
+        return 0;
+      }
+      verts.push_back(p);
+    } else if (command == "f") {
+      Face face;
+      std::string corner;
+      while (fields >> corner) {
+        int index;
+        if (!obj_index(corner, verts.size(), index)) {
+          std::cerr << filename << ":" << line_number << ": bad vertex index "
+                    << corner << std::endl;
+          return 0;
+        }
+        face.push_back(index);
+      }
+      if (face.size() >= 3) faces.push_back(face);
+    }
+  }
+
+  if (faces.empty()) {
+    std::cerr << filename << " has no faces" << std::endl;
+    return 0;
+  }
+  return new Mesh(verts, faces);
+}
+
+// Sections of a mapped mesh file start at multiples of this many bytes
+static const size_t SECTION_ALIGNMENT = 64;
+
+static size_t aligned(size_t offset)
+{
+  return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+static const char* byte_order()
+{
+  uint16_t one = 1;
+  return *reinterpret_cast<unsigned char*>(&one) == 1 ? "le" : "be";
+}
+
+// The first line of a mesh file, which records everything about this
+// build that the layout of the rest depends on
+static std::string mesh_magic(size_t point_size, size_t triangle_size, size_t node_size)
+{
+  std::ostringstream magic;
+  magic << "MESH1 " << byte_order() << " " << point_size << " " << triangle_size
+        << " " << node_size;
+  return magic.str();
+}
+
+static void pad(std::ostream& out, size_t& offset)
+{
+  size_t end = aligned(offset);
+  for (; offset < end; offset++) out.put(0);
+}
+
+bool Mesh::write(const std::string& filename) const
+{
+  if (!m_wide.empty() || m_packets) {
+    std::cerr << "Can't write " << filename
+              << ": only meshes with binary trees and indexed triangles can be saved"
+              << std::endl;
+    return false;
+  }
+
+  std::vector<int> renumbered(m_vert_count, -1);
+  std::vector<Point3D> verts;
+  verts.reserve(m_vert_count);
+  std::vector<Triangle> triangles(m_triangle_count);
+  for (size_t i = 0; i < m_triangle_count; i++) {
+    for (int k = 0; k < 3; k++) {
+      int& v = renumbered[m_triangle_data[i].v[k]];
+      if (v < 0) {
+        v = verts.size();
+        verts.push_back(m_vert_data[m_triangle_data[i].v[k]]);
+      }
+      triangles[i].v[k] = v;
+    }
+  }
+
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  if (!out) {
+    std::cerr << "Could not create " << filename << std::endl;
+    return false;
+  }
+
+  std::ostringstream header;
+  header << mesh_magic(sizeof(Point3D), sizeof(Triangle), sizeof(Node)) << "\n"
+         << verts.size() << " " << m_triangle_count << " " << m_node_count << "\n";
+  std::string text = header.str();
+  size_t offset = text.size();
+  out.write(text.data(), text.size());
+
+  // Nodes first: the top of the tree is read by every ray
+  pad(out, offset);
+  out.write(reinterpret_cast<const char*>(m_node_data), m_node_count * sizeof(Node));
+  offset += m_node_count * sizeof(Node);
+  pad(out, offset);
+  if (!triangles.empty()) {
+    out.write(reinterpret_cast<const char*>(&triangles[0]), triangles.size() * sizeof(Triangle));
+  }
+  offset += triangles.size() * sizeof(Triangle);
+  pad(out, offset);
+  if (!verts.empty()) {
+    out.write(reinterpret_cast<const char*>(&verts[0]), verts.size() * sizeof(Point3D));
+  }
+
+  out.close();
+  if (!out) {
+    std::cerr << "Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+Mesh* Mesh::map(const std::string& filename)
+{
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Could not open mesh " << filename << ": " << std::strerror(errno) << std::endl;
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    std::cerr << "Could not read mesh " << filename << std::endl;
+    ::close(fd);
+    return 0;
+  }
+
+  size_t size = st.st_size;
+  void* map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "Could not map " << filename << ": " << std::strerror(errno) << std::endl;
+    return 0;
+  }
+
+  Mesh* mesh = new Mesh();
+  mesh->m_map = map;
+  mesh->m_map_size = size;
+
+  // The header is two short lines of text
+  const char* text = static_cast<const char*>(map);
+  std::string header(text, std::min(size, 2 * SECTION_ALIGNMENT));
+  std::istringstream in(header);
+  std::string magic;
+  size_t verts = 0, triangles = 0, nodes = 0;
+  if (!std::getline(in, magic)
+      || magic != mesh_magic(sizeof(Point3D), sizeof(Triangle), sizeof(Node))) {
+    std::cerr << filename << " isn't a mesh file written by this build on this machine"
+              << std::endl;
+    delete mesh;
+    return 0;
+  }
+  if (!(in >> verts >> triangles >> nodes) || (triangles == 0) != (nodes == 0)) {
+    std::cerr << filename << " has a bad header" << std::endl;
+    delete mesh;
+    return 0;
+  }
+
+  size_t node_offset = aligned((size_t)in.tellg() + 1);
+  size_t triangle_offset = aligned(node_offset + nodes * sizeof(Node));
+  size_t vert_offset = aligned(triangle_offset + triangles * sizeof(Triangle));
+  if (size < vert_offset + verts * sizeof(Point3D)) {
+    std::cerr << filename << " is truncated" << std::endl;
+    delete mesh;
+    return 0;
+  }
+
+  mesh->m_node_data = reinterpret_cast<const Node*>(text + node_offset);
+  mesh->m_triangle_data = reinterpret_cast<const Triangle*>(text + triangle_offset);
+  mesh->m_vert_data = reinterpret_cast<const Point3D*>(text + vert_offset);
+  mesh->m_node_count = nodes;
+  mesh->m_triangle_count = triangles;
+  mesh->m_vert_count = verts;
+  if (nodes > 0) mesh->m_bounds = mesh->m_node_data[0].box;
+  return mesh;
+}
+
+Mesh* Mesh::load(const std::string& filename)
+{
+  const std::string suffix = ".mesh";
+  if (filename.size() >= suffix.size()
+      && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0) {
+    return map(filename);
+  }
+  return read_obj(filename);
 }
 
 std::ostream& operator<<(std::ostream& out, const Mesh& mesh)
 {
   std::cerr << "mesh({";
-  for (std::vector<Point3D>::const_iterator I = mesh.m_verts.begin(); I != mesh.m_verts.end(); ++I) {
-    if (I != mesh.m_verts.begin()) std::cerr << ",\n      ";
-    std::cerr << *I;
+  for (size_t i = 0; i < mesh.m_vert_count; i++) {
+    if (i > 0) std::cerr << ",\n      ";
+    std::cerr << mesh.m_vert_data[i];
   }
   std::cerr << "},\n\n     {";
   
-  for (std::vector<Mesh::Face>::const_iterator I = mesh.m_faces.begin(); I != mesh.m_faces.end(); ++I) {
-    if (I != mesh.m_faces.begin()) std::cerr << ",\n      ";
-    std::cerr << "[";
-    for (Mesh::Face::const_iterator J = I->begin(); J != I->end(); ++J) {
-      if (J != I->begin()) std::cerr << ", ";
-      std::cerr << *J;
-    }
-    std::cerr << "]";
+  for (size_t i = 0; i < mesh.m_triangle_count; i++) {
+    const int* v = mesh.m_triangle_data[i].v;
+    if (i > 0) std::cerr << ",\n      ";
+    std::cerr << "[" << v[0] << ", " << v[1] << ", " << v[2] << "]";
   }
   std::cerr << "});" << std::endl;
   return out;
@@ -2,21 +2,197 @@
 #define CS488_MESH_HPP
 
 #include <vector>
+#include <string>
 #include <iosfwd>
 #include "primitive.hpp"
 #include "algebra.hpp"
 
-// A polygonal mesh.
+// A polygonal mesh. Each face is split into a fan of triangles around
+// its first vertex, and the triangles are kept in a bounding volume
+// hierarchy, so a ray only tests the few triangles near it.
+//
+// A mesh can also be written out in its built form and mapped back in
+// later (see write() and map()). Then nothing is read up front: the
+// hierarchy, triangles and vertices are used where they lie in the
+// file, and the OS pages in the parts rays actually visit, and drops
+// them again under memory pressure. Meshes far bigger than memory
+// render, just more slowly.
 class Mesh : public Primitive {
 public:
   Mesh(const std::vector<Point3D>& verts,
        const std::vector< std::vector<int> >& faces);
+  virtual ~Mesh();
 
   typedef std::vector<int> Face;
-  
+
+  // The hierarchy meshes built from now on are traced with: the binary
+  // tree they're built as, or that tree collapsed into a four-wide one
+  // with quantized bounds, whose nodes are tested four children at a
+  // time. Mapped meshes always use the binary tree in their file.
+  enum TreeLayout {
+    TREE_BINARY,
+    TREE_WIDE
+  };
+  static void set_tree_layout(TreeLayout layout);
+  static TreeLayout tree_layout();
+
+  // How meshes built from now on keep their triangles for tracing: as
+  // vertex indices, or with each leaf's triangles precomputed into
+  // packets of four (a corner and two edges each, by coordinate), which
+  // are tested four at a time. Packets take about 100 more bytes per
+  // triangle. Mapped meshes always use the indexed triangles in their
+  // file.
+  enum TriangleLayout {
+    TRIANGLES_INDEXED,
+    TRIANGLES_PACKED
+  };
+  static void set_triangle_layout(TriangleLayout layout);
+  static TriangleLayout triangle_layout();
+
+  // Read the vertices and faces of a Wavefront OBJ file, ignoring
+  // everything else in it. Returns 0, after saying why, if the file
+  // can't be read.
+  static Mesh* read_obj(const std::string& filename);
+
+  // Map a file made by write(). Returns 0, after saying why, if it
+  // can't be used (including if it was written on a machine with a
+  // different byte order or struct layout).
+  static Mesh* map(const std::string& filename);
+
+  // Map filename if it ends in ".mesh", otherwise read it as OBJ
+  static Mesh* load(const std::string& filename);
+
+  // Save the mesh for map(); it must have been built with a binary
+  // tree and indexed triangles. The triangles are already in hierarchy
+  // order; vertices are renumbered in the order the triangles first
+  // use them, so each part of the tree lies in a few nearby pages.
+  bool write(const std::string& filename) const;
+
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
+
+  size_t vertex_count() const { return m_vert_count; }
+  size_t triangle_count() const { return m_triangle_count; }
+  size_t node_count() const { return m_node_count + m_wide.size(); }
+  // Bytes taken by the hierarchy's nodes
+  size_t tree_bytes() const;
+  // Bytes taken by the triangles, as indices and packets
+  size_t triangle_bytes() const;
+
 private:
+  Mesh();
+  Mesh(const Mesh&);
+  Mesh& operator=(const Mesh&);
+
+  struct Triangle {
+    int v[3];
+  };
+
+  // A node of the hierarchy. An interior node's first child comes
+  // right after it and its second is at "offset"; they were split
+  // along "axis". A leaf holds triangles [offset, offset + count), or
+  // if the mesh has packets, the first of the packets they're in.
+  struct Node {
+    BBox box;
+    int offset;
+    int count;
+    int axis;
+  };
+
+  // A node of the four-wide tree. Each child's box is stored as 8-bit
+  // steps from the node's origin, the steps being a power of two in
+  // size on each axis, so the node fits in a 64-byte cache line where
+  // a binary node with double bounds needs 64 bytes per child. child[i]
+  // is a wide node if count[i] is 0, otherwise a leaf of count[i]
+  // triangles, numbered as in Node; unused slots are -1 and have empty
+  // boxes. Coordinates are relative to m_centre, to keep them small
+  // for floats.
+  struct WideNode {
+    float origin[3];
+    int child[4];
+    signed char exponent[3];
+    unsigned char count[4];
+    unsigned char lo[3][4];
+    unsigned char hi[3][4];
+    unsigned char padding[5];
+  };
+
+  // Up to four of a leaf's triangles, laid out for Moller-Trumbore
+  // tests of all four at once: each triangle is its first corner p0
+  // and the edges e1 and e2 from there to the other two, and each is
+  // stored by coordinate, the four triangles' values side by side.
+  // Unused slots have zero edges, which no ray hits.
+  struct TrianglePacket {
+    double p0[3][4];
+    double e1[3][4];
+    double e2[3][4];
+  };
+
+  // A ray set up for testing wide nodes
+  struct WideRay {
+    float origin[3];
+    float inv_dir[3];
+    bool negative[3];
+  };
+
+  void build(const std::vector< std::vector<int> >& faces);
+  int build_node(std::vector<int>& order, const std::vector<Point3D>& centroids,
+                 int first, int last, int depth);
+  void build_packets();
+  void build_wide();
+  int collapse(int node);
+
+  WideRay wide_ray(const Ray& ray) const;
+  // Test the ray against all four children of a wide node, returning
+  // a mask of those it passes through in [tmin, tmax] and where it
+  // enters each
+  static int wide_hits(const WideNode& node, const WideRay& ray,
+                       float tmin, float tmax, float tnear[4]);
+  bool intersect_wide(const Ray& ray, double tmin, double tmax,
+                      Intersection& hit) const;
+
+  // Test the ray against the count triangles of the leaf at offset,
+  // narrowing tmax to the closest hit in (tmin, tmax) and setting
+  // closest to that triangle's number (see hit_normal)
+  void leaf_hits(const Ray& ray, int offset, int count, double tmin, double& tmax,
+                 int& closest) const;
+  // The normal of a triangle numbered by leaf_hits
+  Vector3D hit_normal(int closest) const;
+
+  // Append the crossings of the line along the ray with the count
+  // triangles of the leaf at offset to hits, growing it in the arena
+  void crossings(const Ray& ray, int offset, int count, Arena& arena,
+                 Intersection*& hits, int& hit_count, int& capacity) const;
+
+  // Intersect the line along a ray with a triangle, returning the line
+  // parameter of the hit
+  bool triangle_hit(const Triangle& tri, const Ray& ray, double& t) const;
+  Vector3D triangle_normal(const Triangle& tri) const;
+  // Intersect the line along a ray with each triangle of a packet,
+  // returning a mask of those it crosses and where it crosses them
+  static int packet_hits(const TrianglePacket& packet, const Ray& ray, double t[4]);
+  static Vector3D packet_normal(const TrianglePacket& packet, int i);
+
+  // What's traced: either the vectors below, or parts of a mapped file
+  const Point3D* m_vert_data;
+  const Triangle* m_triangle_data;
+  const Node* m_node_data;
+  size_t m_vert_count, m_triangle_count, m_node_count;
+
   std::vector<Point3D> m_verts;
-  std::vector<Face> m_faces;
+  std::vector<Triangle> m_triangles;
+  std::vector<Node> m_nodes;
+  std::vector<WideNode> m_wide;
+  // Aligned to a cache line, so it can't live in a vector
+  TrianglePacket* m_packets;
+  size_t m_packet_count;
+  Point3D m_centre;
+  BBox m_bounds;
+
+  void* m_map;
+  size_t m_map_size;
 
   friend std::ostream& operator<<(std::ostream& out, const Mesh& mesh);
 };
@@ -0,0 +1,485 @@
+#include "photonmap.hpp"
+#include "material.hpp"
+#include "rng.hpp"
+#include <algorithm>
+#include <sys/time.h>
+#include <pthread.h>
+
+// Offset used to keep photons from re-hitting the surface they leave
+static const double EPSILON = 1e-4;
+
+// Mixed into the render seed so photon paths don't share random
+// numbers with the eye rays
+static const unsigned int PHOTON_SEED = 0x50484f54;
+
+// Don't hand ranges smaller than this to a new thread when balancing
+static const long MIN_PARALLEL_RANGE = 4096;
+
+static double wall_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double max_channel(const Colour& c)
+{
+  return std::max(c.R(), std::max(c.G(), c.B()));
+}
+
+static Vector3D normalized(Vector3D v)
+{
+  v.normalize();
+  return v;
+}
+
+// A direction chosen uniformly from the unit sphere
+static Vector3D random_direction(SampleRng& rng)
+{
+  double z = 1.0 - 2.0 * rng.next();
+  double phi = 2.0 * M_PI * rng.next();
+  double r = sqrt(std::max(0.0, 1.0 - z * z));
+  return Vector3D(r * cos(phi), r * sin(phi), z);
+}
+
+// The cone of directions from a light that reaches a bounding sphere
+struct Cone {
+  Vector3D axis;
+  double cos_max;
+  double solid_angle;
+};
+
+// Directions in which a light's photons are worth shooting: the union
+// of the cones it sees its targets in, or the whole sphere if there
+// are no cones (the light is inside a target).
+struct Emitter {
+  std::vector<Cone> cones;
+  double solid_angle;
+};
+
+// Pick a direction to shoot a photon in, and the factor its flux must
+// be scaled by compared to shooting it over the whole sphere.
+//
+// A cone is picked in proportion to its solid angle, and a direction
+// uniformly within it. Where cones overlap, a direction can be reached
+// through any of them, so its weight is divided by how many there are.
+static Vector3D emit_direction(const Emitter& emitter, SampleRng& rng, double& weight)
+{
+  if (emitter.cones.empty()) {
+    weight = 1.0;
+    return random_direction(rng);
+  }
+
+  double u = rng.next() * emitter.solid_angle;
+  size_t i = 0;
+  while (i + 1 < emitter.cones.size() && u >= emitter.cones[i].solid_angle) {
+    u -= emitter.cones[i].solid_angle;
+    i++;
+  }
+  const Cone& cone = emitter.cones[i];
+
+  double cos_theta = 1.0 - rng.next() * (1.0 - cone.cos_max);
+  double sin_theta = sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+  double phi = 2.0 * M_PI * rng.next();
+
+  Vector3D a = fabs(cone.axis[0]) < 0.9 ? Vector3D(1.0, 0.0, 0.0) : Vector3D(0.0, 1.0, 0.0);
+  Vector3D b1 = normalized(cone.axis.cross(a));
+  Vector3D b2 = cone.axis.cross(b1);
+  Vector3D dir = cos_theta * cone.axis
+    + (sin_theta * cos(phi)) * b1 + (sin_theta * sin(phi)) * b2;
+
+  int covering = 0;
+  for (size_t j = 0; j < emitter.cones.size(); j++) {
+    if (dir.dot(emitter.cones[j].axis) >= emitter.cones[j].cos_max) covering++;
+  }
+  weight = emitter.solid_angle / (4.0 * M_PI * std::max(1, covering));
+  return dir;
+}
+
+// One thread's share of the photons to shoot. Global photon indices
+// [first[i], first[i + 1]) come from lights[i], aimed by emitters[i],
+// each carrying flux[i] before aiming.
+struct TraceJob {
+  SceneNode* root;
+  const std::vector<const Light*>* lights;
+  const std::vector<Emitter>* emitters;
+  const std::vector<long>* first;
+  const std::vector<Colour>* flux;
+  int max_depth;
+  unsigned int seed;
+
+  long begin, end;
+  std::vector<Photon> photons;
+};
+
+// Follow one photon through the scene. Mirror and refractive surfaces
+// pass it on; the first diffuse surface absorbs it, and stores it if it
+// got there by way of at least one specular bounce. Which of these
+// happens is chosen at random in proportion to the material's
+// transparency and reflectivity, so the photon's power stays roughly
+// constant instead of fading over many weak bounces.
+static void trace_photon(TraceJob& job, long index, Arena& arena)
+{
+  size_t light = std::upper_bound(job.first->begin(), job.first->end(), index)
+    - job.first->begin() - 1;
+  const Light& source = *(*job.lights)[light];
+
+  SampleRng rng(job.seed ^ PHOTON_SEED, index, 0, 0);
+  double weight;
+  // Each photon leaves at a time of its own, so the map holds light
+  // from moving mirrors averaged over the shutter
+  SampleRng time_rng(job.seed ^ PHOTON_SEED, index, 0, 1);
+  Ray ray(source.position, emit_direction((*job.emitters)[light], rng, weight),
+          time_rng.next());
+  Colour power = weight * (*job.flux)[light];
+  double travelled = 0.0;
+  bool specular = false;
+
+  for (int bounce = 0; bounce <= job.max_depth; bounce++) {
+    arena.reset();
+    Intersection hit;
+    if (!job.root->intersect(ray, EPSILON, HUGE_VAL, hit, arena)) return;
+    travelled += hit.t;
+
+    const PhongMaterial* material = dynamic_cast<const PhongMaterial*>(hit.material);
+    double transparency = material ? material->transparency() : 0.0;
+    double reflect = material ? (1.0 - transparency) * material->reflectivity()
+                                * max_channel(material->specular()) : 0.0;
+
+    Point3D p = ray.at(hit.t);
+    Vector3D d = ray.dir;
+    Vector3D n = normalized(hit.normal);
+    bool entering = d.dot(n) < 0.0;
+    if (!entering) n = -n;
+    Vector3D mirror = d - 2.0 * d.dot(n) * n;
+
+    double u = rng.next();
+    if (u < transparency) {
+      double eta = entering ? 1.0 / material->ior() : material->ior();
+      double cos_i = -d.dot(n);
+      double k = 1.0 - eta * eta * (1.0 - cos_i * cos_i);
+      if (k < 0.0) {
+        ray = Ray(p, mirror, ray.time);
+      } else {
+        ray = Ray(p, normalized(eta * d + (eta * cos_i - sqrt(k)) * n), ray.time);
+      }
+      specular = true;
+    } else if (u < transparency + reflect) {
+      power = power * ((1.0 / max_channel(material->specular())) * material->specular());
+      ray = Ray(p, mirror, ray.time);
+      specular = true;
+    } else {
+      if (!specular) return;
+
+      // Photon density falls off with the square of the distance from
+      // the light, but a4_render's lights fall off according to their
+      // own falloff coefficients. Swap one for the other so caustics
+      // come out as bright as the direct light next to them.
+      double falloff = source.falloff[0] + source.falloff[1] * travelled
+        + source.falloff[2] * travelled * travelled;
+      Colour stored = (travelled * travelled / falloff) * power;
+
+      Photon photon;
+      for (int i = 0; i < 3; i++) {
+        photon.pos[i] = p[i];
+        photon.dir[i] = d[i];
+      }
+      photon.power[0] = stored.R();
+      photon.power[1] = stored.G();
+      photon.power[2] = stored.B();
+      photon.axis = 0;
+      job.photons.push_back(photon);
+      return;
+    }
+  }
+}
+
+static void* trace_thread(void* data)
+{
+  TraceJob& job = *static_cast<TraceJob*>(data);
+  Arena arena;
+  for (long i = job.begin; i < job.end; i++) {
+    trace_photon(job, i, arena);
+  }
+  return 0;
+}
+
+PhotonMap::PhotonMap()
+  : m_emitted(0), m_trace_seconds(0.0), m_balance_seconds(0.0)
+{
+}
+
+void PhotonMap::trace(SceneNode* root, const std::list<Light*>& lights, long count,
+                      int max_depth, unsigned int seed, int threads)
+{
+  double start = wall_time();
+  m_photons.clear();
+  m_emitted = 0;
+
+  // Only photons that hit something mirrored or transparent can end up
+  // in a caustic, so aim them at the bounding spheres of those objects
+  // (Jensen's projection maps). Without any, there are no caustics.
+  std::vector<BBox> targets;
+  root->specular_bounds(Matrix4x4(), targets);
+  if (targets.empty()) {
+    m_trace_seconds = wall_time() - start;
+    return;
+  }
+
+  // Share the photons out in proportion to each light's power. A point
+  // light of intensity I sends out a total flux of 4 pi I.
+  std::vector<const Light*> sources;
+  std::vector<Emitter> emitters;
+  double total = 0.0;
+  for (std::list<Light*>::const_iterator I = lights.begin(); I != lights.end(); ++I) {
+    if (max_channel((*I)->colour) <= 0.0) continue;
+    sources.push_back(*I);
+    total += max_channel((*I)->colour);
+
+    Emitter emitter;
+    emitter.solid_angle = 0.0;
+    for (size_t i = 0; i < targets.size(); i++) {
+      Point3D centre = targets[i].min() + 0.5 * (targets[i].max() - targets[i].min());
+      double radius = 0.5 * (targets[i].max() - targets[i].min()).length();
+      Vector3D to_centre = centre - (*I)->position;
+      double dist = to_centre.length();
+      if (dist <= radius) {
+        emitter.cones.clear();
+        emitter.solid_angle = 4.0 * M_PI;
+        break;
+      }
+
+      Cone cone;
+      cone.axis = (1.0 / dist) * to_centre;
+      cone.cos_max = sqrt(1.0 - (radius / dist) * (radius / dist));
+      cone.solid_angle = 2.0 * M_PI * (1.0 - cone.cos_max);
+      emitter.cones.push_back(cone);
+      emitter.solid_angle += cone.solid_angle;
+    }
+    emitters.push_back(emitter);
+  }
+
+  std::vector<long> first(1, 0);
+  std::vector<Colour> flux;
+  for (size_t i = 0; i < sources.size(); i++) {
+    long n = std::max(1L, (long)(count * max_channel(sources[i]->colour) / total));
+    first.push_back(first.back() + n);
+    flux.push_back((4.0 * M_PI / n) * sources[i]->colour);
+  }
+  m_emitted = first.back();
+
+  threads = std::max(1, threads);
+  std::vector<TraceJob> jobs(threads);
+  std::vector<pthread_t> ids(threads);
+  for (int i = 0; i < threads; i++) {
+    TraceJob& job = jobs[i];
+    job.root = root;
+    job.lights = &sources;
+    job.emitters = &emitters;
+    job.first = &first;
+    job.flux = &flux;
+    job.max_depth = max_depth;
+    job.seed = seed;
+    job.begin = m_emitted * i / threads;
+    job.end = m_emitted * (i + 1) / threads;
+    pthread_create(&ids[i], 0, trace_thread, &job);
+  }
+
+  // Concatenate in thread order, so the map doesn't depend on timing
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], 0);
+    m_photons.insert(m_photons.end(), jobs[i].photons.begin(), jobs[i].photons.end());
+  }
+
+  m_trace_seconds = wall_time() - start;
+}
+
+// Orders photons along one axis, for picking medians.
+struct PhotonLess {
+  PhotonLess(int axis_) : axis(axis_) {}
+  bool operator()(const Photon& a, const Photon& b) const
+  {
+    return a.pos[axis] < b.pos[axis];
+  }
+  int axis;
+};
+
+struct BalanceJob {
+  Photon* photons;
+  long lo, hi;
+  int spawn_depth;
+};
+
+static void* balance_thread(void* data);
+
+// Build the subtree for photons [lo, hi): split at the median along the
+// axis the range is widest in, then build the two halves. The first
+// spawn_depth levels hand one half to a new thread.
+static void balance_range(Photon* photons, long lo, long hi, int spawn_depth)
+{
+  if (hi - lo < 2) return;
+
+  float min[3] = { HUGE_VALF, HUGE_VALF, HUGE_VALF };
+  float max[3] = { -HUGE_VALF, -HUGE_VALF, -HUGE_VALF };
+  for (long i = lo; i < hi; i++) {
+    for (int j = 0; j < 3; j++) {
+      min[j] = std::min(min[j], photons[i].pos[j]);
+      max[j] = std::max(max[j], photons[i].pos[j]);
+    }
+  }
+  int axis = 0;
+  for (int j = 1; j < 3; j++) {
+    if (max[j] - min[j] > max[axis] - min[axis]) axis = j;
+  }
+
+  long mid = lo + (hi - lo) / 2;
+  std::nth_element(photons + lo, photons + mid, photons + hi, PhotonLess(axis));
+  photons[mid].axis = axis;
+
+  if (spawn_depth > 0 && mid - lo >= MIN_PARALLEL_RANGE) {
+    BalanceJob left;
+    left.photons = photons;
+    left.lo = lo;
+    left.hi = mid;
+    left.spawn_depth = spawn_depth - 1;
+
+    pthread_t id;
+    pthread_create(&id, 0, balance_thread, &left);
+    balance_range(photons, mid + 1, hi, spawn_depth - 1);
+    pthread_join(id, 0);
+  } else {
+    balance_range(photons, lo, mid, 0);
+    balance_range(photons, mid + 1, hi, 0);
+  }
+}
+
+static void* balance_thread(void* data)
+{
+  BalanceJob& job = *static_cast<BalanceJob*>(data);
+  balance_range(job.photons, job.lo, job.hi, job.spawn_depth);
+  return 0;
+}
+
+void PhotonMap::balance(int threads)
+{
+  double start = wall_time();
+
+  int spawn_depth = 0;
+  while ((1 << spawn_depth) < threads) spawn_depth++;
+  if (!m_photons.empty()) {
+    balance_range(&m_photons[0], 0, m_photons.size(), spawn_depth);
+  }
+
+  m_balance_seconds = wall_time() - start;
+}
+
+// A photon found by a gather, and its squared distance from the query
+struct Candidate {
+  float dist2;
+  const Photon* photon;
+
+  bool operator<(const Candidate& other) const
+  {
+    return dist2 < other.dist2;
+  }
+};
+
+// State of a k-nearest search. Until k photons are found, candidates
+// are simply appended; after that they form a max-heap on distance and
+// max_dist2 shrinks to the k-th nearest so far.
+struct NearestPhotons {
+  float pos[3];
+  int k;
+  int count;
+  float max_dist2;
+  Candidate* found;
+  long nodes;
+};
+
+static void consider(NearestPhotons& np, const Photon& photon)
+{
+  float dx = np.pos[0] - photon.pos[0];
+  float dy = np.pos[1] - photon.pos[1];
+  float dz = np.pos[2] - photon.pos[2];
+  float dist2 = dx * dx + dy * dy + dz * dz;
+  if (dist2 >= np.max_dist2) return;
+
+  if (np.count < np.k) {
+    np.found[np.count].dist2 = dist2;
+    np.found[np.count].photon = &photon;
+    if (++np.count == np.k) {
+      std::make_heap(np.found, np.found + np.k);
+      np.max_dist2 = np.found[0].dist2;
+    }
+    return;
+  }
+
+  std::pop_heap(np.found, np.found + np.k);
+  np.found[np.k - 1].dist2 = dist2;
+  np.found[np.k - 1].photon = &photon;
+  std::push_heap(np.found, np.found + np.k);
+  np.max_dist2 = np.found[0].dist2;
+}
+
+// Search the subtree for photons [lo, hi), nearer side first. The far
+// side is only visited if the splitting plane is closer than the
+// furthest photon we'd keep.
+static void locate(const Photon* photons, long lo, long hi, NearestPhotons& np)
+{
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    const Photon& photon = photons[mid];
+    np.nodes++;
+
+    float delta = np.pos[photon.axis] - photon.pos[photon.axis];
+    if (delta < 0.0f) {
+      locate(photons, lo, mid, np);
+      consider(np, photon);
+      lo = mid + 1;
+    } else {
+      locate(photons, mid + 1, hi, np);
+      consider(np, photon);
+      hi = mid;
+    }
+    if (delta * delta >= np.max_dist2) return;
+  }
+}
+
+Colour PhotonMap::irradiance(const Point3D& p, const Vector3D& n, int k,
+                             double max_radius, Arena& arena,
+                             GatherStats& stats) const
+{
+  if (m_photons.empty() || k < 1) return Colour(0.0);
+  double start = wall_time();
+
+  Arena::Mark mark = arena.mark();
+
+  NearestPhotons np;
+  for (int i = 0; i < 3; i++) np.pos[i] = p[i];
+  np.k = k;
+  np.count = 0;
+  np.max_dist2 = max_radius * max_radius;
+  np.found = arena.allocate_array<Candidate>(k);
+  np.nodes = 0;
+
+  locate(&m_photons[0], 0, m_photons.size(), np);
+
+  // Sum the photons that arrived at the front of the surface, over the
+  // disc that holds them: all of max_radius unless k were found
+  double r[3] = { 0.0, 0.0, 0.0 };
+  for (int i = 0; i < np.count; i++) {
+    const Photon& photon = *np.found[i].photon;
+    if (photon.dir[0] * n[0] + photon.dir[1] * n[1] + photon.dir[2] * n[2] >= 0.0) continue;
+    for (int j = 0; j < 3; j++) r[j] += photon.power[j];
+  }
+  double area = M_PI * np.max_dist2;
+
+  arena.rewind(mark);
+
+  stats.gathers++;
+  stats.nodes += np.nodes;
+  stats.photons += np.count;
+  stats.seconds += wall_time() - start;
+
+  return Colour(r[0] / area, r[1] / area, r[2] / area);
+}
@@ -0,0 +1,79 @@
+#ifndef CS488_PHOTONMAP_HPP
+#define CS488_PHOTONMAP_HPP
+
+#include <vector>
+#include <list>
+#include "algebra.hpp"
+#include "scene.hpp"
+#include "light.hpp"
+#include "arena.hpp"
+
+// A photon stored on a diffuse surface. Single precision keeps it to
+// 40 bytes, so a gather touches as few cache lines as possible.
+struct Photon {
+  float pos[3];
+  // Flux carried, scaled so that photon density gives irradiance on
+  // the same scale as a4_render's direct lighting
+  float power[3];
+  // Direction of travel, to reject photons that landed on the other
+  // side of a thin surface
+  float dir[3];
+  // Splitting axis of the kd-tree node this photon is
+  unsigned char axis;
+};
+
+// Per-thread counters for photon gathers.
+struct GatherStats {
+  GatherStats() : gathers(0), nodes(0), photons(0), seconds(0.0) {}
+
+  long gathers;
+  // kd-tree nodes visited, and photons used in estimates
+  long nodes;
+  long photons;
+  double seconds;
+};
+
+// A caustic photon map (Jensen, "Global Illumination using Photon
+// Maps", 1996). Photons are shot from the point lights and stored
+// where they land on a diffuse surface after at least one specular
+// (mirror or refractive) bounce, so the map holds exactly the light
+// that a4_render's direct lighting and mirror rays can't find.
+//
+// The photons live in one array laid out as an implicit kd-tree: the
+// photon at the median of a range splits it, and its two halves are
+// the subtrees. There are no child pointers, every subtree is a
+// contiguous block, and the tree is balanced by construction.
+class PhotonMap {
+public:
+  PhotonMap();
+
+  // Shoot "count" photons, shared between the lights in proportion to
+  // their power, and keep the caustic ones. Photon paths are cut off
+  // after max_depth specular bounces.
+  void trace(SceneNode* root, const std::list<Light*>& lights, long count,
+             int max_depth, unsigned int seed, int threads);
+
+  // Arrange the photons into the kd-tree, building independent
+  // subtrees on up to "threads" threads.
+  void balance(int threads);
+
+  // Irradiance at p on a surface with normal n, estimated from the k
+  // photons nearest p that lie within max_radius. Scratch space for
+  // the search comes from arena.
+  Colour irradiance(const Point3D& p, const Vector3D& n, int k, double max_radius,
+                    Arena& arena, GatherStats& stats) const;
+
+  size_t size() const { return m_photons.size(); }
+  long emitted() const { return m_emitted; }
+  double trace_seconds() const { return m_trace_seconds; }
+  double balance_seconds() const { return m_balance_seconds; }
+
+private:
+  std::vector<Photon> m_photons;
+
+  long m_emitted;
+  double m_trace_seconds;
+  double m_balance_seconds;
+};
+
+#endif
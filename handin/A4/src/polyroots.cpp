@@ -69,6 +69,7 @@
 /* Imports */
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
 
 /* Forward declarations */
 double sink_lookup(double), cosk_lookup(double);
@@ -302,7 +303,7 @@ static double PolishRoot(
 	size_t degree, double A, double B, double C, double D, double root )
 {
 	size_t i, j;
-	double x, y, dydx, dx, lastx = HUGE, lasty = HUGE;
+	double x, y, dydx, dx, lastx = HUGE_VAL, lasty = HUGE_VAL;
 	double cs[4] = { A, B, C, D };
 
 	x = root;
@@ -341,6 +342,210 @@ static double PolishRoot(
 	return x;
 }
 
+/*
+**  Single-precision versions of the solvers above, for float ray
+**  packets.  They follow the same closed forms, rearranged where float
+**  would lose too many digits.  There are no early returns: every case
+**  is computed and the answer picked with selects, and a root-valid
+**  mask says which roots count.  Every root then gets the same fixed
+**  number of float Newton steps, so a compiler can run several
+**  polynomials side by side.
+*/
+
+/* Newton steps given to every root by the float solvers.  polybench
+** finds the same roots with more steps, and misses a few more with
+** three. */
+#define POLISH_STEPSF 4
+
+/*  Newton-Raphson on a monic polynomial root, in float, for
+**  POLISH_STEPSF steps.  A step is kept only if it reduces |p(x)|,
+**  which stops it throwing a root away near a double root where the
+**  derivative vanishes, and leaves a converged root where it is. */
+static float PolishRootf(
+	size_t degree, float A, float B, float C, float D, float root )
+{
+	float cs[4] = { A, B, C, D };
+	float x, y, dydx, x1, y1, dydx1;
+	size_t i, j;
+	int keep;
+
+	x = root;
+	y = 1.0f;
+	dydx = 0.0f;
+	for( j = 0; j < degree; ++j ) {
+		dydx = dydx*x + y;
+		y = y*x + cs[ j ];
+	}
+
+	for( i = 0; i < POLISH_STEPSF; ++i ) {
+		x1 = x - ((dydx != 0.0f) ? y/dydx : 0.0f);
+
+		y1 = 1.0f;
+		dydx1 = 0.0f;
+		for( j = 0; j < degree; ++j ) {
+			dydx1 = dydx1*x1 + y1;
+			y1 = y1*x1 + cs[ j ];
+		}
+
+		keep = fabsf(y1) < fabsf(y);
+		x = keep ? x1 : x;
+		y = keep ? y1 : y;
+		dydx = keep ? dydx1 : dydx;
+	}
+
+	return x;
+}
+
+size_t quadraticRootsf( float A, float B, float C, float roots[2] )
+{
+	float D, q;
+
+	if( A == 0.0f ) {
+		roots[0] = -C/B;
+		return (B != 0.0f) ? 1 : 0;
+	}
+
+	D = B*B - 4.0f*A*C;
+	q = -0.5f * ( B + ((B < 0.0f) ? -1.0f : 1.0f) * sqrtf(fmaxf(D, 0.0f)) );
+	roots[0] = q / A;
+	roots[1] = (q != 0.0f) ? C / q : roots[0];
+	return (D < 0.0f) ? 0 : 2;
+}
+
+/* Coefficients :   x^3  + p x^2 + q x  + r */
+size_t cubicRootsf( float p, float q, float r, float roots[3] )
+{
+	float u, v, w, s, t, p_over_3, a, fa, sw, single, largest;
+	int one;
+
+	u = q - p*p/3.0f;
+	v = r - p*q/3.0f + 2.0f*p*p*p/27.0f;
+	w = (4.0f*u*u*u)/27.0f + v*v;
+	p_over_3 = p / 3.0f;
+	one = w > 0.0f;
+
+	/* One real root.  As in the double version, the sign is picked to
+	** avoid cancellation in w -/+ v; a is kept off zero so the
+	** three-root case, which computes this too, can't divide by it. */
+	sw = sqrtf(fmaxf(w, 0.0f));
+	a = (v < 0.0f) ? (sw - v) : -(sw + v);
+	fa = fmaxf(fabsf(a), FLT_MIN);
+	single = copysignf(cbrtf(fa/2.0f), a)
+		- (u*copysignf(cbrtf(2.0f/fa), a)) / 3.0f - p_over_3;
+
+	/* The largest of three real roots.  Rounding can push t just
+	** outside [-1, 1]. */
+	s = sqrtf(fmaxf(-u / 3.0f, 0.0f));
+	t = (s != 0.0f) ? -v / (2.0f * s*s*s) : 0.0f;
+	t = fminf(fmaxf(t, -1.0f), 1.0f);
+	largest = 2.0f * s * cosf(acosf(t)/3.0f) - p_over_3;
+
+	/* The closed form loses the two smaller roots when they're close,
+	** so they're the roots of what's left when the first is divided
+	** out instead, whose constant term is -r over it.  They're only
+	** real roots of the cubic if there are three. */
+	roots[0] = PolishRootf( 3, p, q, r, 0.0f, one ? single : largest );
+	quadraticRootsf( 1.0f, p + roots[0],
+		(roots[0] != 0.0f) ? -r/roots[0] : q, roots+1 );
+	roots[1] = PolishRootf( 3, p, q, r, 0.0f, roots[1] );
+	roots[2] = PolishRootf( 3, p, q, r, 0.0f, roots[2] );
+
+	return one ? 1 : 3;
+}
+
+/* Coefficients :  x^4 + a x^3  + b x^2 + c x  + d */
+size_t quarticRootsf(
+	float a, float b, float c, float d, float roots[4] )
+{
+	float h, h1, h2, H, g, g1, g2, G, n, m, en, em, y, k, sk, e;
+	float shift, p, q, r;
+	float cubic[3], found[4];
+	int i, nr, use_m, big;
+	size_t pairs[2];
+
+	/* Solve for z = x + a/4 instead, which has no cubic term:
+	** z^4 + p z^2 + q z + r.  In float the resolvent of the full quartic
+	** loses most of its digits to cancellation when the roots are
+	** clustered away from zero; this one's constant term is just q^2. */
+	shift = a/4.0f;
+	p = b - 6.0f*shift*shift;
+	q = c - shift*(2.0f*b - 8.0f*shift*shift);
+	r = d - shift*(c - shift*(b - 3.0f*shift*shift));
+
+	/* The smallest root of the resolvent cubic.  Its roots multiply to
+	** -q^2, so it isn't positive, and then n and m aren't negative:
+	** the quartic always splits into two real quadratics through it.
+	** (quarticRoots takes the largest root, and gives up when n or m
+	** is negative, which rounding decides when they're near zero.)  A
+	** positive lone root means rounding has hidden the other two. */
+	cubic[0] = -2.0f*p;
+	cubic[1] = p*p - 4.0f*r;
+	cubic[2] = q*q;
+	nr = cubicRootsf( cubic[0], cubic[1], cubic[2], found );
+	y = (nr == 3 || found[0] > 0.0f) ? fminf(found[1], found[2]) : found[0];
+	y = fminf(y, 0.0f);
+
+	g1 = 0.0f;
+	h1 = (p-y)/2.0f;
+	n = -4.0f*y;
+	m = (p-y)*(p-y) - 4.0f*r;
+	en = p*p + 2.0f*fabsf(p*y) + y*y + 4.0f*fabsf(r);
+	em = 4.0f*fabsf(y);
+
+	/* Factor through whichever of m and n is larger next to the terms
+	** it's made from, en for m and em for n, and so has lost less to
+	** rounding */
+	use_m = m*em > n*en;
+	k = use_m ? m : n;
+	sk = sqrtf(fmaxf(k, FLT_MIN));
+	e = -q / sk;
+	g2 = use_m ? e : sk/2.0f;
+	h2 = use_m ? sk/2.0f : e;
+
+	if( SIGN(g1) == SIGN(g2) ) {
+		G = g1 + g2;
+		g = (G == 0.0f) ? g1-g2 : y/G;
+	} else {
+		g = g1 - g2;
+		G = (g == 0.0f) ? g1+g2 : y/g;
+	}
+	if( SIGN(h1) == SIGN(h2) ) {
+		H = h1 + h2;
+		h = (H == 0.0f) ? h1-h2 : r/H;
+	} else {
+		h = h1 - h2;
+		H = (h == 0.0f) ? h1+h2 : r/h;
+	}
+
+	/* Back to x = z - shift.  Shifting a factor's constant term can
+	** cancel, and does for roots near x = 0, so only the larger one is
+	** shifted and the other comes from their product d. */
+	G += 2.0f*shift;
+	H += shift*(G - shift);
+	g += 2.0f*shift;
+	h += shift*(g - shift);
+	big = fabsf(H) >= fabsf(h);
+	h = (big && H != 0.0f) ? d/H : h;
+	H = (!big && h != 0.0f) ? d/h : H;
+
+	/* Both quadratic factors, each into its own pair of slots */
+	pairs[0] = quadraticRootsf( 1.0f, G, H, found );
+	pairs[1] = quadraticRootsf( 1.0f, g, h, found+2 );
+
+	for( i = 0; i < 4; ++i ) {
+		found[i] = PolishRootf( 4, a, b, c, d, found[i] );
+	}
+
+	nr = 0;
+	for( i = 0; i < 4; ++i ) {
+		if( pairs[i/2] != 0 ) {
+			roots[nr++] = found[i];
+		}
+	}
+
+	return nr;
+}
+
 #ifdef TABLE_LOOKUP
 static double cosk_lookup(double t)
 {
@@ -807,7 +1012,6 @@ static double sink_lookup(double t)
 #endif
 
 
-#if 0
 /*
  * Alternate version -- simpler but less robust and less efficient.
  * from Gems I.
@@ -843,10 +1047,6 @@ static double sink_lookup(double t)
 #ifndef M_PI
 #define M_PI          3.14159265358979323846
 #endif
-extern double  sqrt( double x );
-extern double  cbrt( double x );
-extern double cos( double x ); 
-extern double acos( double x );
 
 /* epsilon surrounding for near zero values */
 
@@ -1056,8 +1256,6 @@ int SolveQuartic( double c[5], double s[4] )
     return num;
 }
 
-#endif
-
 /*
  * Copyright (c) 1990, Graphics and AI Laboratory, University of Washington
  * Copying, use and development for non-commercial purposes permitted.
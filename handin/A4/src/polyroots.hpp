@@ -17,6 +17,16 @@ size_t quadraticRoots(double A, double B, double C, double roots[2]);
 size_t cubicRoots(double A, double B, double C, double roots[3]);
 size_t quarticRoots(double A, double B, double C, double D, double roots[4]);
 
+/* Single precision, for float ray packets */
+size_t quadraticRootsf(float A, float B, float C, float roots[2]);
+size_t cubicRootsf(float A, float B, float C, float roots[3]);
+size_t quarticRootsf(float A, float B, float C, float D, float roots[4]);
+
+/* Graphics Gems versions: c[0] + c[1]*x + ... + c[n]*x^n = 0 */
+int SolveQuadric(double c[3], double s[2]);
+int SolveCubic(double c[4], double s[3]);
+int SolveQuartic(double c[5], double s[4]);
+
 #endif /* CS488_POLYROOTS_HPP */
 
 /*
@@ -1,21 +1,432 @@
 #include "primitive.hpp"
+#include "polyroots.hpp"
+#include <new>
+
+// Intersect a ray with the sphere of the given centre and radius.
+bool sphere_intersect(const Point3D& centre, double radius,
+                      const Ray& ray, double tmin, double tmax,
+                      Intersection& hit)
+{
+  Vector3D oc = ray.origin - centre;
+
+  double roots[2];
+  size_t count = quadraticRoots(ray.dir.dot(ray.dir),
+                                2.0 * ray.dir.dot(oc),
+                                oc.dot(oc) - radius * radius,
+                                roots);
+
+  bool found = false;
+  for (size_t i = 0; i < count; i++) {
+    if (roots[i] > tmin && roots[i] < tmax) {
+      tmax = roots[i];
+      found = true;
+    }
+  }
+  if (!found) return false;
+
+  hit.t = tmax;
+  hit.normal = ray.at(tmax) - centre;
+  return true;
+}
+
+// Find the span of the line along the ray inside a sphere.
+void sphere_spans(const Point3D& centre, double radius,
+                  const Ray& ray, Arena& arena, SpanList& out)
+{
+  Vector3D oc = ray.origin - centre;
+
+  double roots[2];
+  size_t count = quadraticRoots(ray.dir.dot(ray.dir),
+                                2.0 * ray.dir.dot(oc),
+                                oc.dot(oc) - radius * radius,
+                                roots);
+  if (count < 2 || roots[0] == roots[1]) {
+    out.count = 0;
+    return;
+  }
+  if (roots[0] > roots[1]) std::swap(roots[0], roots[1]);
+
+  out.spans = new (arena.allocate_array<Span>(1)) Span();
+  out.count = 1;
+  out.spans->enter.t = roots[0];
+  out.spans->enter.normal = ray.at(roots[0]) - centre;
+  out.spans->exit.t = roots[1];
+  out.spans->exit.normal = ray.at(roots[1]) - centre;
+}
+
+// Find the entry and exit parameters of the line along the ray through
+// the axis-aligned box [lo, hi], and the axes of the faces crossed.
+static bool box_slabs(const Point3D& lo, const Point3D& hi, const Ray& ray,
+                      double& tnear, int& near_axis, double& tfar, int& far_axis)
+{
+  tnear = -HUGE_VAL;
+  tfar = HUGE_VAL;
+  near_axis = far_axis = 0;
+
+  for (int i = 0; i < 3; i++) {
+    if (ray.dir[i] == 0.0) {
+      if (ray.origin[i] < lo[i] || ray.origin[i] > hi[i]) return false;
+      continue;
+    }
+    double t0 = (lo[i] - ray.origin[i]) / ray.dir[i];
+    double t1 = (hi[i] - ray.origin[i]) / ray.dir[i];
+    if (t0 > t1) std::swap(t0, t1);
+
+    if (t0 > tnear) {
+      tnear = t0;
+      near_axis = i;
+    }
+    if (t1 < tfar) {
+      tfar = t1;
+      far_axis = i;
+    }
+  }
+  return tnear < tfar;
+}
+
+// Intersect a ray with the axis-aligned box [lo, hi] using slabs.
+static bool box_intersect(const Point3D& lo, const Point3D& hi,
+                          const Ray& ray, double tmin, double tmax,
+                          Intersection& hit)
+{
+  double tnear, tfar;
+  int near_axis, far_axis;
+  if (!box_slabs(lo, hi, ray, tnear, near_axis, tfar, far_axis)) return false;
+
+  // Take the entry point if it's in range, otherwise the exit point
+  // (i.e. the ray starts inside the box).
+  double t;
+  int axis;
+  double sign;
+  if (tnear > tmin && tnear < tmax) {
+    t = tnear;
+    axis = near_axis;
+    sign = (ray.dir[axis] > 0.0) ? -1.0 : 1.0;
+  } else if (tfar > tmin && tfar < tmax) {
+    t = tfar;
+    axis = far_axis;
+    sign = (ray.dir[axis] > 0.0) ? 1.0 : -1.0;
+  } else {
+    return false;
+  }
+
+  Vector3D normal(0.0, 0.0, 0.0);
+  normal[axis] = sign;
+
+  hit.t = t;
+  hit.normal = normal;
+  return true;
+}
+
+// Find the span of the line along the ray inside the box [lo, hi].
+static void box_spans(const Point3D& lo, const Point3D& hi,
+                      const Ray& ray, Arena& arena, SpanList& out)
+{
+  double tnear, tfar;
+  int near_axis, far_axis;
+  if (!box_slabs(lo, hi, ray, tnear, near_axis, tfar, far_axis)) {
+    out.count = 0;
+    return;
+  }
+
+  out.spans = new (arena.allocate_array<Span>(1)) Span();
+  out.count = 1;
+  out.spans->enter.t = tnear;
+  out.spans->enter.normal[near_axis] = (ray.dir[near_axis] > 0.0) ? -1.0 : 1.0;
+  out.spans->exit.t = tfar;
+  out.spans->exit.normal[far_axis] = (ray.dir[far_axis] > 0.0) ? 1.0 : -1.0;
+}
+
+// Find where the line along the ray crosses a torus around the y axis
+// with major radius R and minor radius r. The line is clipped to the
+// torus's bounding box first, and only the part in (tmin, tmax) is
+// kept, so most rays never reach the quartic. The quartic itself is
+// set up from the clipped entry point with a unit direction, which
+// keeps its coefficients small and its roots well conditioned.
+//
+// Painter's quarticRoots polishes every root with Newton steps;
+// SolveQuartic from Graphics Gems is about 1.6x faster on torus
+// quartics but leaves residuals around 1e-2, which shows up as acne.
+// Define TORUS_GEMS_SOLVER to trade accuracy for speed.
+//
+// Returns the number of roots, as ray parameters in increasing order.
+static size_t torus_roots(double R, double r, const Ray& ray,
+                          double tmin, double tmax, double roots[4])
+{
+  Point3D hi(R + r, r, R + r);
+  Point3D lo(-hi[0], -hi[1], -hi[2]);
+
+  double tnear, tfar;
+  int near_axis, far_axis;
+  if (!box_slabs(lo, hi, ray, tnear, near_axis, tfar, far_axis)) return 0;
+  if (tnear < tmin) tnear = tmin;
+  if (tfar > tmax) tfar = tmax;
+  if (tnear >= tfar) return 0;
+
+  double len = ray.dir.length();
+  Vector3D d = (1.0 / len) * ray.dir;
+  Vector3D o = ray.at(tnear) - Point3D(0.0, 0.0, 0.0);
+
+  // (|p|^2 + R^2 - r^2)^2 = 4 R^2 (x^2 + z^2), with p = o + s d
+  double b = 2.0 * o.dot(d);
+  double c = o.dot(o) + R * R - r * r;
+  double k = 4.0 * R * R;
+  double coeffs[5];
+  coeffs[4] = 1.0;
+  coeffs[3] = 2.0 * b;
+  coeffs[2] = b * b + 2.0 * c - k * (d[0] * d[0] + d[2] * d[2]);
+  coeffs[1] = 2.0 * b * c - 2.0 * k * (o[0] * d[0] + o[2] * d[2]);
+  coeffs[0] = c * c - k * (o[0] * o[0] + o[2] * o[2]);
+
+  double s[4];
+#if defined(TORUS_GEMS_SOLVER)
+  size_t count = SolveQuartic(coeffs, s);
+#else
+  size_t count = quarticRoots(coeffs[3], coeffs[2], coeffs[1], coeffs[0], s);
+#endif
+
+  // Keep the roots inside the clipped interval, in order
+  double send = (tfar - tnear) * len;
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (s[i] < 0.0 || s[i] > send) continue;
+    double t = tnear + s[i] / len;
+    size_t j = n++;
+    for (; j > 0 && roots[j - 1] > t; j--) roots[j] = roots[j - 1];
+    roots[j] = t;
+  }
+  return n;
+}
+
+// Normal of the torus at a point on its surface (the gradient of the
+// implicit function, unnormalised).
+static Vector3D torus_normal(double R, double r, const Point3D& p)
+{
+  double s = p[0] * p[0] + p[1] * p[1] + p[2] * p[2] + R * R - r * r;
+  double ring = s - 2.0 * R * R;
+  return Vector3D(p[0] * ring, p[1] * s, p[2] * ring);
+}
+
+// Is p inside the solid torus? That's where the implicit function
+// (|p|^2 + R^2 - r^2)^2 - 4 R^2 (x^2 + z^2) is negative.
+static bool torus_inside(double R, double r, const Point3D& p)
+{
+  double s = p[0] * p[0] + p[1] * p[1] + p[2] * p[2] + R * R - r * r;
+  return s * s < 4.0 * R * R * (p[0] * p[0] + p[2] * p[2]);
+}
+
+// Longitude and latitude of a point about the centre of a sphere
+static void sphere_coords(const Point3D& centre, const Point3D& p, double& u, double& v)
+{
+  Vector3D d = p - centre;
+  double length = d.length();
+  u = 0.5 + atan2(d[2], d[0]) / (2.0 * M_PI);
+  v = length > 0.0 ? acos(std::max(-1.0, std::min(1.0, d[1] / length))) / M_PI : 0.5;
+}
 
 Primitive::~Primitive()
 {
 }
 
+void Primitive::texture_coords(const Point3D& p, double& u, double& v) const
+{
+  BBox box = bounds();
+  double q[3];
+  int face = 0;
+  double farthest = -1.0;
+  for (int i = 0; i < 3; i++) {
+    double extent = box.max()[i] - box.min()[i];
+    q[i] = extent > 0.0 ? (p[i] - box.min()[i]) / extent : 0.5;
+    if (fabs(q[i] - 0.5) > farthest) {
+      farthest = fabs(q[i] - 0.5);
+      face = i;
+    }
+  }
+  u = q[(face + 1) % 3];
+  v = q[(face + 2) % 3];
+}
+
+double Primitive::texture_density() const
+{
+  Vector3D extent = bounds().max() - bounds().min();
+  double largest = std::max(extent[0], std::max(extent[1], extent[2]));
+  return largest > 0.0 ? 1.0 / largest : 1.0;
+}
+
 Sphere::~Sphere()
 {
 }
 
+bool Sphere::intersect(const Ray& ray, double tmin, double tmax,
+                       Intersection& hit) const
+{
+  return sphere_intersect(Point3D(0.0, 0.0, 0.0), 1.0, ray, tmin, tmax, hit);
+}
+
+void Sphere::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  sphere_spans(Point3D(0.0, 0.0, 0.0), 1.0, ray, arena, out);
+}
+
+BBox Sphere::bounds() const
+{
+  return BBox(Point3D(-1.0, -1.0, -1.0), Point3D(1.0, 1.0, 1.0));
+}
+
+void Sphere::texture_coords(const Point3D& p, double& u, double& v) const
+{
+  sphere_coords(Point3D(0.0, 0.0, 0.0), p, u, v);
+}
+
+double Sphere::texture_density() const
+{
+  return 1.0 / M_PI;
+}
+
 Cube::~Cube()
 {
 }
 
+bool Cube::intersect(const Ray& ray, double tmin, double tmax,
+                     Intersection& hit) const
+{
+  return box_intersect(Point3D(0.0, 0.0, 0.0), Point3D(1.0, 1.0, 1.0),
+                       ray, tmin, tmax, hit);
+}
+
+void Cube::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  box_spans(Point3D(0.0, 0.0, 0.0), Point3D(1.0, 1.0, 1.0), ray, arena, out);
+}
+
+BBox Cube::bounds() const
+{
+  return BBox(Point3D(0.0, 0.0, 0.0), Point3D(1.0, 1.0, 1.0));
+}
+
 NonhierSphere::~NonhierSphere()
 {
 }
 
+bool NonhierSphere::intersect(const Ray& ray, double tmin, double tmax,
+                              Intersection& hit) const
+{
+  return sphere_intersect(m_pos, m_radius, ray, tmin, tmax, hit);
+}
+
+void NonhierSphere::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  sphere_spans(m_pos, m_radius, ray, arena, out);
+}
+
+BBox NonhierSphere::bounds() const
+{
+  Vector3D r(m_radius, m_radius, m_radius);
+  return BBox(m_pos - r, m_pos + r);
+}
+
+void NonhierSphere::texture_coords(const Point3D& p, double& u, double& v) const
+{
+  sphere_coords(m_pos, p, u, v);
+}
+
+double NonhierSphere::texture_density() const
+{
+  return 1.0 / (M_PI * m_radius);
+}
+
 NonhierBox::~NonhierBox()
 {
 }
+
+bool NonhierBox::intersect(const Ray& ray, double tmin, double tmax,
+                           Intersection& hit) const
+{
+  return box_intersect(m_pos,
+                       m_pos + Vector3D(m_size, m_size, m_size),
+                       ray, tmin, tmax, hit);
+}
+
+void NonhierBox::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  box_spans(m_pos, m_pos + Vector3D(m_size, m_size, m_size), ray, arena, out);
+}
+
+BBox NonhierBox::bounds() const
+{
+  return BBox(m_pos, m_pos + Vector3D(m_size, m_size, m_size));
+}
+
+Torus::~Torus()
+{
+}
+
+bool Torus::intersect(const Ray& ray, double tmin, double tmax,
+                      Intersection& hit) const
+{
+  double roots[4];
+  size_t count = torus_roots(m_major, m_minor, ray, tmin, tmax, roots);
+  for (size_t i = 0; i < count; i++) {
+    if (roots[i] > tmin && roots[i] < tmax) {
+      hit.t = roots[i];
+      hit.normal = torus_normal(m_major, m_minor, ray.at(roots[i]));
+      return true;
+    }
+  }
+  return false;
+}
+
+void Torus::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  double roots[4];
+  size_t count = torus_roots(m_major, m_minor, ray, -HUGE_VAL, HUGE_VAL, roots);
+
+  // Roots don't simply pair up into entry and exit: a grazing hit may
+  // be reported once, twice or not at all. So whether the line is
+  // inside between two roots is decided by testing the midpoint, and
+  // runs of inside intervals are merged into one span. There are at
+  // most two spans, as a line crosses the surface at most four times.
+  out.count = 0;
+  if (count < 2) return;
+  out.spans = arena.allocate_array<Span>(2);
+  bool inside = false;
+  for (size_t i = 0; i + 1 < count; i++) {
+    if (roots[i + 1] <= roots[i]) continue;
+    bool in = torus_inside(m_major, m_minor, ray.at(0.5 * (roots[i] + roots[i + 1])));
+    if (in && !inside) {
+      Span* span = new (&out.spans[out.count]) Span();
+      span->enter.t = roots[i];
+      span->enter.normal = torus_normal(m_major, m_minor, ray.at(roots[i]));
+      inside = true;
+    } else if (!in && inside) {
+      Span& span = out.spans[out.count++];
+      span.exit.t = roots[i];
+      span.exit.normal = torus_normal(m_major, m_minor, ray.at(roots[i]));
+      inside = false;
+    }
+    if (out.count == 2) break;
+  }
+  if (inside) {
+    Span& span = out.spans[out.count++];
+    span.exit.t = roots[count - 1];
+    span.exit.normal = torus_normal(m_major, m_minor, ray.at(roots[count - 1]));
+  }
+}
+
+BBox Torus::bounds() const
+{
+  double w = m_major + m_minor;
+  return BBox(Point3D(-w, -m_minor, -w), Point3D(w, m_minor, w));
+}
+
+// u goes around the ring, v around the tube
+void Torus::texture_coords(const Point3D& p, double& u, double& v) const
+{
+  u = 0.5 + atan2(p[2], p[0]) / (2.0 * M_PI);
+  v = 0.5 + atan2(p[1], sqrt(p[0] * p[0] + p[2] * p[2]) - m_major) / (2.0 * M_PI);
+}
+
+double Torus::texture_density() const
+{
+  return 1.0 / (2.0 * M_PI * m_minor);
+}
@@ -2,20 +2,63 @@
 #define CS488_PRIMITIVE_HPP
 
 #include "algebra.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "arena.hpp"
 
 class Primitive {
 public:
   virtual ~Primitive();
+
+  // Intersect the ray with this primitive. Returns true and fills in
+  // hit.t and hit.normal if there is an intersection with t in
+  // (tmin, tmax); otherwise hit is left alone.
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const = 0;
+
+  // Find every span of the (whole, infinite) line along the ray that
+  // lies inside the primitive, allocating the list from arena. Only
+  // t and normal are filled in.
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const = 0;
+
+  // Bounding box in the primitive's own frame
+  virtual BBox bounds() const = 0;
+
+  // Texture coordinates of a point on the surface, in the primitive's
+  // frame, and roughly how fast they change per unit of distance
+  // across the surface. By default, the bounding box is mapped onto
+  // each of its faces, and points take the face they're nearest.
+  virtual void texture_coords(const Point3D& p, double& u, double& v) const;
+  virtual double texture_density() const;
 };
 
+// Intersections with the sphere of the given centre and radius, as
+// Primitive::intersect and Primitive::spans. Shared by the sphere
+// primitives and SphereSet.
+bool sphere_intersect(const Point3D& centre, double radius,
+                      const Ray& ray, double tmin, double tmax,
+                      Intersection& hit);
+void sphere_spans(const Point3D& centre, double radius,
+                  const Ray& ray, Arena& arena, SpanList& out);
+
 class Sphere : public Primitive {
 public:
   virtual ~Sphere();
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
+  virtual void texture_coords(const Point3D& p, double& u, double& v) const;
+  virtual double texture_density() const;
 };
 
 class Cube : public Primitive {
 public:
   virtual ~Cube();
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
 };
 
 class NonhierSphere : public Primitive {
@@ -25,6 +68,12 @@ public:
   {
   }
   virtual ~NonhierSphere();
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
+  virtual void texture_coords(const Point3D& p, double& u, double& v) const;
+  virtual double texture_density() const;
 
 private:
   Point3D m_pos;
@@ -39,10 +88,35 @@ public:
   }
   
   virtual ~NonhierBox();
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
 
 private:
   Point3D m_pos;
   double m_size;
 };
 
+// A torus around the y axis, centred at the origin, with the given
+// major (ring) and minor (tube) radii.
+class Torus : public Primitive {
+public:
+  Torus(double major, double minor)
+    : m_major(major), m_minor(minor)
+  {
+  }
+  virtual ~Torus();
+  virtual bool intersect(const Ray& ray, double tmin, double tmax,
+                         Intersection& hit) const;
+  virtual void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox bounds() const;
+  virtual void texture_coords(const Point3D& p, double& u, double& v) const;
+  virtual double texture_density() const;
+
+private:
+  double m_major;
+  double m_minor;
+};
+
 #endif
@@ -0,0 +1,83 @@
+#ifndef CS488_RAY_HPP
+#define CS488_RAY_HPP
+
+#include "algebra.hpp"
+
+class Material;
+class Primitive;
+
+// A ray, p(t) = origin + t * dir. The direction isn't necessarily
+// normalized: rays are transformed into each node's coordinate frame
+// without renormalizing, so that t means the same thing at every
+// level of the hierarchy.
+//
+// The time is when, as a fraction of the way from the shutter opening
+// to its closing, the ray samples the scene. It picks where moving
+// nodes are, and rays spawned from a hit carry it on.
+struct Ray {
+  Ray()
+    : time(0.0)
+  {
+  }
+  Ray(const Point3D& o, const Vector3D& d, double t = 0.0)
+    : origin(o), dir(d), time(t)
+  {
+  }
+
+  Point3D at(double t) const
+  {
+    return origin + t * dir;
+  }
+
+  Point3D origin;
+  Vector3D dir;
+  double time;
+};
+
+// Information about the closest surface hit along a ray.
+struct Intersection {
+  Intersection()
+    : t(0.0), material(0), object(-1), primitive(0)
+  {
+  }
+
+  // Ray parameter of the hit
+  double t;
+  // Surface normal, not normalized, in the frame of the tested ray
+  Vector3D normal;
+  // Material of the surface that was hit
+  const Material* material;
+  // Id of the geometry node it belongs to
+  int object;
+
+  // The primitive hit, and where the hit is in the primitive's frame.
+  // Texture coordinates are worked out from these, only for the hits
+  // that need them.
+  const Primitive* primitive;
+  Point3D local;
+  // A unit vector along the surface in the primitive's frame, carried
+  // up like the normal; its length in the ray's frame is how much the
+  // surface is stretched there, for sizing texture footprints.
+  Vector3D tangent;
+};
+
+// A stretch of a ray, from where it enters a solid to where it leaves
+// it. Used to combine solids with CSG. The normals at both ends point
+// out of the solid.
+struct Span {
+  Intersection enter, exit;
+};
+
+// The spans of a ray inside a solid, sorted by t and not overlapping.
+// The array lives in the tracing thread's Arena.
+struct SpanList {
+  SpanList()
+    : spans(0), count(0)
+  {
+  }
+
+  Span* spans;
+  int count;
+};
+
+#endif
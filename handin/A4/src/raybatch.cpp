@@ -0,0 +1,101 @@
+#include "raybatch.hpp"
+#include <algorithm>
+#include <new>
+
+// Spread the low 10 bits of v out so there are two zero bits between
+// each, ready to be interleaved into a 30-bit Morton code.
+static unsigned int morton_spread(unsigned int v)
+{
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// Cells per axis in the grid laid over the ray origins
+static const unsigned int ORIGIN_CELLS = 256;
+
+// Rays a batch makes room for when it first grows
+static const size_t INITIAL_CAPACITY = 256;
+
+RayBatch::RayBatch(Arena& arena)
+  : m_arena(&arena),
+    m_rays(0), m_size(0), m_capacity(0),
+    m_order(0),
+    m_min(HUGE_VAL, HUGE_VAL, HUGE_VAL),
+    m_max(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL)
+{
+}
+
+void RayBatch::push(const Ray& ray, const Colour& weight, int x, int y, int sample)
+{
+  if (m_size == m_capacity) {
+    // Grow by doubling. The old array is simply abandoned; it goes back
+    // when the arena is reset.
+    size_t capacity = std::max(INITIAL_CAPACITY, 2 * m_capacity);
+    SecondaryRay* rays = m_arena->allocate_array<SecondaryRay>(capacity);
+    for (size_t i = 0; i < m_size; i++) {
+      new (rays + i) SecondaryRay(m_rays[i]);
+    }
+    m_rays = rays;
+    m_capacity = capacity;
+  }
+  new (m_rays + m_size++) SecondaryRay(ray, weight, x, y, sample);
+
+  for (int i = 0; i < 3; i++) {
+    m_min[i] = std::min(m_min[i], ray.origin[i]);
+    m_max[i] = std::max(m_max[i], ray.origin[i]);
+  }
+}
+
+void RayBatch::sort()
+{
+  double scale[3];
+  for (int i = 0; i < 3; i++) {
+    double extent = m_max[i] - m_min[i];
+    scale[i] = (extent > 0.0) ? (ORIGIN_CELLS - 1) / extent : 0.0;
+  }
+
+  m_order = m_arena->allocate_array<uint64_t>(m_size);
+  for (size_t i = 0; i < m_size; i++) {
+    const Ray& ray = m_rays[i].ray;
+
+    unsigned int octant = (ray.dir[0] < 0.0 ? 1 : 0)
+                        | (ray.dir[1] < 0.0 ? 2 : 0)
+                        | (ray.dir[2] < 0.0 ? 4 : 0);
+
+    unsigned int cell = 0;
+    for (int j = 0; j < 3; j++) {
+      unsigned int c = (unsigned int)((ray.origin[j] - m_min[j]) * scale[j]);
+      cell |= morton_spread(c) << j;
+    }
+
+    // 3 bits of octant above 24 bits of origin cell
+    uint64_t key = (octant << 24) | cell;
+    m_order[i] = (key << 32) | i;
+  }
+
+  std::sort(m_order, m_order + m_size);
+}
+
+void RayBatch::clear()
+{
+  m_rays = 0;
+  m_size = m_capacity = 0;
+  m_order = 0;
+  m_min = Point3D(HUGE_VAL, HUGE_VAL, HUGE_VAL);
+  m_max = Point3D(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+}
+
+void RayBatch::swap(RayBatch& other)
+{
+  std::swap(m_arena, other.m_arena);
+  std::swap(m_rays, other.m_rays);
+  std::swap(m_size, other.m_size);
+  std::swap(m_capacity, other.m_capacity);
+  std::swap(m_order, other.m_order);
+  std::swap(m_min, other.m_min);
+  std::swap(m_max, other.m_max);
+}
@@ -0,0 +1,69 @@
+#ifndef CS488_RAYBATCH_HPP
+#define CS488_RAYBATCH_HPP
+
+#include <stdint.h>
+#include "algebra.hpp"
+#include "ray.hpp"
+#include "arena.hpp"
+
+// A reflection or refraction ray waiting to be traced, along with the
+// pixel and sample it contributes to and how much of its radiance gets
+// there.
+struct SecondaryRay {
+  SecondaryRay(const Ray& r, const Colour& w, int px, int py, int s)
+    : ray(r), weight(w), x(px), y(py), sample(s)
+  {
+  }
+
+  Ray ray;
+  Colour weight;
+  int x, y;
+  int sample;
+};
+
+// The secondary rays spawned by one bounce. Rather than following each
+// reflection or refraction as soon as it is spawned, the tracer
+// collects a whole bounce's worth here and then traces them in an
+// order where rays heading the same way from nearby origins come one
+// after another, so they walk through the same parts of the scene.
+//
+// Storage comes from the tracing thread's Arena, so a batch must be
+// cleared whenever the arena is reset.
+class RayBatch {
+public:
+  RayBatch(Arena& arena);
+
+  void push(const Ray& ray, const Colour& weight, int x, int y, int sample);
+
+  // Work out the tracing order. Rays are grouped by the octant of
+  // their direction, then ordered along a Morton curve through a grid
+  // laid over their origins.
+  void sort();
+
+  bool empty() const { return m_size == 0; }
+  size_t size() const { return m_size; }
+
+  // The i'th ray in tracing order (only valid after sort()).
+  const SecondaryRay& operator[](size_t i) const
+  {
+    return m_rays[(uint32_t)m_order[i]];
+  }
+
+  void clear();
+  void swap(RayBatch& other);
+
+private:
+  Arena* m_arena;
+
+  SecondaryRay* m_rays;
+  size_t m_size, m_capacity;
+
+  // Sort key in the high 32 bits, index into m_rays in the low 32
+  // bits, in tracing order
+  uint64_t* m_order;
+
+  // Bounds of the ray origins, for placing the origin grid
+  Point3D m_min, m_max;
+};
+
+#endif
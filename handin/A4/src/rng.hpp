@@ -0,0 +1,78 @@
+#ifndef CS488_RNG_HPP
+#define CS488_RNG_HPP
+
+#include <stdint.h>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011).
+//
+// A SampleRng's output is a pure function of the render seed, the
+// pixel, the sample number and the bounce it was created for, plus
+// how many numbers have been drawn from it so far. Nothing is shared
+// between generators, so threads never contend on RNG state, and a
+// pixel gets exactly the same random numbers however the image is
+// divided up between threads.
+class SampleRng {
+public:
+  SampleRng(uint32_t seed, uint32_t pixel, uint32_t sample, uint32_t bounce)
+    : m_seed(seed), m_pixel(pixel), m_sample(sample), m_bounce(bounce),
+      m_block(0), m_used(4)
+  {
+  }
+
+  // Uniformly distributed 32-bit integer
+  uint32_t next_uint()
+  {
+    if (m_used == 4) {
+      generate();
+      m_used = 0;
+    }
+    return m_out[m_used++];
+  }
+
+  // Uniformly distributed in [0, 1)
+  double next()
+  {
+    return next_uint() * (1.0 / 4294967296.0);
+  }
+
+private:
+  static uint32_t mulhilo(uint32_t a, uint32_t b, uint32_t& hi)
+  {
+    uint64_t product = (uint64_t)a * b;
+    hi = (uint32_t)(product >> 32);
+    return (uint32_t)product;
+  }
+
+  // Encrypt the counter (block, pixel, sample, bounce) under the seed.
+  void generate()
+  {
+    uint32_t c0 = m_block++, c1 = m_pixel, c2 = m_sample, c3 = m_bounce;
+    uint32_t k0 = m_seed, k1 = 0xa4a4a4a4;
+
+    for (int round = 0; round < 10; round++) {
+      uint32_t hi0, hi1;
+      uint32_t lo0 = mulhilo(0xD2511F53, c0, hi0);
+      uint32_t lo1 = mulhilo(0xCD9E8D57, c2, hi1);
+      c0 = hi1 ^ c1 ^ k0;
+      c1 = lo1;
+      c2 = hi0 ^ c3 ^ k1;
+      c3 = lo0;
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+
+    m_out[0] = c0;
+    m_out[1] = c1;
+    m_out[2] = c2;
+    m_out[3] = c3;
+  }
+
+  uint32_t m_seed, m_pixel, m_sample, m_bounce;
+  uint32_t m_block;
+
+  // Output of the last block, and how much of it has been handed out
+  uint32_t m_out[4];
+  int m_used;
+};
+
+#endif
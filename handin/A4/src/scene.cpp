@@ -1,8 +1,397 @@
 #include "scene.hpp"
 #include <iostream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <new>
+#include "accel.hpp"
+
+// Combining span lists. Each takes two sorted, non-overlapping lists
+// and produces another in the arena.
+
+static Intersection flipped(const Intersection& hit)
+{
+  Intersection result = hit;
+  result.normal = -hit.normal;
+  return result;
+}
+
+static void span_union(const SpanList& a, const SpanList& b,
+                       Arena& arena, SpanList& out)
+{
+  if (a.count == 0) {
+    out = b;
+    return;
+  }
+  if (b.count == 0) {
+    out = a;
+    return;
+  }
+
+  out.spans = arena.allocate_array<Span>(a.count + b.count);
+  out.count = 0;
+
+  int i = 0, j = 0;
+  while (i < a.count || j < b.count) {
+    const Span& s = (j == b.count || (i < a.count && a.spans[i].enter.t < b.spans[j].enter.t))
+      ? a.spans[i++] : b.spans[j++];
+
+    if (out.count > 0 && s.enter.t <= out.spans[out.count - 1].exit.t) {
+      // Overlaps the last span: extend it
+      if (s.exit.t > out.spans[out.count - 1].exit.t) {
+        out.spans[out.count - 1].exit = s.exit;
+      }
+    } else {
+      out.spans[out.count++] = s;
+    }
+  }
+}
+
+static void span_intersection(const SpanList& a, const SpanList& b,
+                              Arena& arena, SpanList& out)
+{
+  out.count = 0;
+  if (a.count == 0 || b.count == 0) return;
+
+  out.spans = arena.allocate_array<Span>(a.count + b.count);
+
+  int i = 0, j = 0;
+  while (i < a.count && j < b.count) {
+    const Span& sa = a.spans[i];
+    const Span& sb = b.spans[j];
+
+    const Intersection& enter = (sa.enter.t > sb.enter.t) ? sa.enter : sb.enter;
+    const Intersection& exit = (sa.exit.t < sb.exit.t) ? sa.exit : sb.exit;
+    if (enter.t < exit.t) {
+      out.spans[out.count].enter = enter;
+      out.spans[out.count].exit = exit;
+      out.count++;
+    }
+
+    if (sa.exit.t < sb.exit.t) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+}
+
+static void span_difference(const SpanList& a, const SpanList& b,
+                            Arena& arena, SpanList& out)
+{
+  if (a.count == 0 || b.count == 0) {
+    out = a;
+    return;
+  }
+
+  out.spans = arena.allocate_array<Span>(a.count + b.count);
+  out.count = 0;
+
+  int j = 0;
+  for (int i = 0; i < a.count; i++) {
+    Intersection enter = a.spans[i].enter;
+    const Intersection& exit = a.spans[i].exit;
+
+    // Spans of b that end before this one starts can't affect it, or
+    // any later span of a
+    while (j < b.count && b.spans[j].exit.t <= enter.t) j++;
+
+    bool covered = false;
+    for (int k = j; k < b.count && b.spans[k].enter.t < exit.t; k++) {
+      // Where b cuts into a, the surface of b becomes the surface of
+      // the result, facing the other way
+      if (b.spans[k].enter.t > enter.t) {
+        out.spans[out.count].enter = enter;
+        out.spans[out.count].exit = flipped(b.spans[k].enter);
+        out.count++;
+      }
+      if (b.spans[k].exit.t >= exit.t) {
+        covered = true;
+        break;
+      }
+      enter = flipped(b.spans[k].exit);
+    }
+
+    if (!covered) {
+      out.spans[out.count].enter = enter;
+      out.spans[out.count].exit = exit;
+      out.count++;
+    }
+  }
+}
+
+// Interpolating transforms between the ends of the shutter.
+// Interpolating the matrices themselves would squash a rotating node
+// half way through a half turn, so each end is split into translation
+// * rotation * stretch (the polar decomposition), and the parts are
+// interpolated separately.
+
+// Cofactors of a 3x3 matrix, which are the transpose of its inverse
+// times its determinant. Returns the determinant.
+static double cofactors(const double a[3][3], double c[3][3])
+{
+  c[0][0] = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+  c[0][1] = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+  c[0][2] = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+  c[1][0] = a[0][2] * a[2][1] - a[0][1] * a[2][2];
+  c[1][1] = a[0][0] * a[2][2] - a[0][2] * a[2][0];
+  c[1][2] = a[0][1] * a[2][0] - a[0][0] * a[2][1];
+  c[2][0] = a[0][1] * a[1][2] - a[0][2] * a[1][1];
+  c[2][1] = a[0][2] * a[1][0] - a[0][0] * a[1][2];
+  c[2][2] = a[0][0] * a[1][1] - a[0][1] * a[1][0];
+  return a[0][0] * c[0][0] + a[0][1] * c[0][1] + a[0][2] * c[0][2];
+}
+
+// The unit quaternion (w, x, y, z) of a rotation matrix
+static void rotation_quaternion(const double r[3][3], double q[4])
+{
+  double trace = r[0][0] + r[1][1] + r[2][2];
+  if (trace > 0.0) {
+    double s = 0.5 / sqrt(trace + 1.0);
+    q[0] = 0.25 / s;
+    q[1] = (r[2][1] - r[1][2]) * s;
+    q[2] = (r[0][2] - r[2][0]) * s;
+    q[3] = (r[1][0] - r[0][1]) * s;
+  } else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+    double s = 2.0 * sqrt(1.0 + r[0][0] - r[1][1] - r[2][2]);
+    q[0] = (r[2][1] - r[1][2]) / s;
+    q[1] = 0.25 * s;
+    q[2] = (r[0][1] + r[1][0]) / s;
+    q[3] = (r[0][2] + r[2][0]) / s;
+  } else if (r[1][1] > r[2][2]) {
+    double s = 2.0 * sqrt(1.0 + r[1][1] - r[0][0] - r[2][2]);
+    q[0] = (r[0][2] - r[2][0]) / s;
+    q[1] = (r[0][1] + r[1][0]) / s;
+    q[2] = 0.25 * s;
+    q[3] = (r[1][2] + r[2][1]) / s;
+  } else {
+    double s = 2.0 * sqrt(1.0 + r[2][2] - r[0][0] - r[1][1]);
+    q[0] = (r[1][0] - r[0][1]) / s;
+    q[1] = (r[0][2] + r[2][0]) / s;
+    q[2] = (r[1][2] + r[2][1]) / s;
+    q[3] = 0.25 * s;
+  }
+}
+
+// The rotation matrix of a unit quaternion
+static void quaternion_rotation(const double q[4], double r[3][3])
+{
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  r[0][0] = 1.0 - 2.0 * (y * y + z * z);
+  r[0][1] = 2.0 * (x * y - w * z);
+  r[0][2] = 2.0 * (x * z + w * y);
+  r[1][0] = 2.0 * (x * y + w * z);
+  r[1][1] = 1.0 - 2.0 * (x * x + z * z);
+  r[1][2] = 2.0 * (y * z - w * x);
+  r[2][0] = 2.0 * (x * z - w * y);
+  r[2][1] = 2.0 * (y * z + w * x);
+  r[2][2] = 1.0 - 2.0 * (x * x + y * y);
+}
+
+// One end of the shutter's transform, split into parts
+struct Keyframe {
+  Vector3D translation;
+  double rotation[4];
+  double stretch[3][3];
+};
+
+// Split an affine transform into translation * rotation * stretch.
+// The rotation is the orthogonal matrix nearest the linear part, found
+// by averaging it with its inverse transpose until it settles.
+static void decompose(const Matrix4x4& m, Keyframe& key)
+{
+  double a[3][3], q[3][3];
+  for (int i = 0; i < 3; i++) {
+    key.translation[i] = m[i][3];
+    for (int j = 0; j < 3; j++) a[i][j] = q[i][j] = m[i][j];
+  }
+
+  for (int iteration = 0; iteration < 64; iteration++) {
+    double c[3][3];
+    double det = cofactors(q, c);
+    if (det == 0.0) {
+      // Flattened: there's no rotation to find
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) q[i][j] = i == j ? 1.0 : 0.0;
+      }
+      break;
+    }
+
+    double change = 0.0;
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        double next = 0.5 * (q[i][j] + c[i][j] / det);
+        change = std::max(change, fabs(next - q[i][j]));
+        q[i][j] = next;
+      }
+    }
+    if (change < 1e-12) break;
+  }
+
+  // A mirroring transform gives a rotation with a reflection in it;
+  // leave the reflection in the stretch instead
+  double c[3][3];
+  if (cofactors(q, c) < 0.0) {
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) q[i][j] = -q[i][j];
+    }
+  }
+
+  rotation_quaternion(q, key.rotation);
+
+  // a = q s, so s = q^T a
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      key.stretch[i][j] = q[0][i] * a[0][j] + q[1][i] * a[1][j] + q[2][i] * a[2][j];
+    }
+  }
+}
+
+struct SceneNode::Motion {
+  // The transform at shutter close, and its inverse
+  Matrix4x4 close, close_inverse;
+
+  // Both ends split up, and the angle between their rotations. Set by
+  // prepare, once the transforms are final.
+  Keyframe ends[2];
+  double angle, sin_angle;
+
+  void prepare(const Matrix4x4& open);
+  void at(double time, Matrix4x4& trans, Matrix4x4& inverse) const;
+};
+
+void SceneNode::Motion::prepare(const Matrix4x4& open)
+{
+  decompose(open, ends[0]);
+  decompose(close, ends[1]);
+
+  // q and -q are the same rotation; pick the one that's nearer, so
+  // the node turns the short way round
+  double* q0 = ends[0].rotation;
+  double* q1 = ends[1].rotation;
+  double dot = q0[0] * q1[0] + q0[1] * q1[1] + q0[2] * q1[2] + q0[3] * q1[3];
+  if (dot < 0.0) {
+    for (int i = 0; i < 4; i++) q1[i] = -q1[i];
+    dot = -dot;
+  }
+  angle = acos(std::min(dot, 1.0));
+  sin_angle = sin(angle);
+}
+
+void SceneNode::Motion::at(double time, Matrix4x4& trans, Matrix4x4& inverse) const
+{
+  const Keyframe& a = ends[0];
+  const Keyframe& b = ends[1];
+
+  // Slerp, or plain interpolation when the rotations are so close that
+  // slerp would divide by almost nothing
+  double wa = 1.0 - time, wb = time;
+  if (sin_angle > 1e-6) {
+    wa = sin((1.0 - time) * angle) / sin_angle;
+    wb = sin(time * angle) / sin_angle;
+  }
+  double q[4], length = 0.0;
+  for (int i = 0; i < 4; i++) {
+    q[i] = wa * a.rotation[i] + wb * b.rotation[i];
+    length += q[i] * q[i];
+  }
+  length = 1.0 / sqrt(length);
+  for (int i = 0; i < 4; i++) q[i] *= length;
+
+  double r[3][3], s[3][3], c[3][3];
+  quaternion_rotation(q, r);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      s[i][j] = a.stretch[i][j] + time * (b.stretch[i][j] - a.stretch[i][j]);
+    }
+  }
+  Vector3D t = a.translation + time * (b.translation - a.translation);
+
+  // trans = t r s; inverse = s^-1 r^T t^-1, with s^-1 = c^T / det
+  double det = cofactors(s, c);
+  double scale = det != 0.0 ? 1.0 / det : 0.0;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      trans[i][j] = r[i][0] * s[0][j] + r[i][1] * s[1][j] + r[i][2] * s[2][j];
+      inverse[i][j] = scale * (c[0][i] * r[j][0] + c[1][i] * r[j][1] + c[2][i] * r[j][2]);
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    trans[i][3] = t[i];
+    inverse[i][3] = -(inverse[i][0] * t[0] + inverse[i][1] * t[1] + inverse[i][2] * t[2]);
+    trans[3][i] = inverse[3][i] = 0.0;
+  }
+  trans[3][3] = inverse[3][3] = 1.0;
+}
+
+// Times at which a moving node's bounds are sampled to fit the
+// interpolated box around it
+static const int MOTION_SAMPLES = 16;
+
+// Id for the next node created. Scenes are built on one thread.
+static int next_node_id = 0;
+
+// Where nodes and everything they own are allocated from
+static Arena& node_pool()
+{
+  static Arena pool(1024 * 1024);
+  return pool;
+}
+
+template<typename T>
+static T* pool_new()
+{
+  return new (node_pool().allocate(sizeof(T), __alignof__(T))) T();
+}
+
+// Node names, each stored once
+static const std::string* intern(const std::string& name)
+{
+  static std::set<std::string> names;
+  return &*names.insert(name).first;
+}
+
+static bool is_identity(const Matrix4x4& m)
+{
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      if (m[i][j] != (i == j ? 1.0 : 0.0)) return false;
+    }
+  }
+  return true;
+}
+
+static const Matrix4x4 IDENTITY;
+
+void* SceneNode::operator new(size_t size)
+{
+  return node_pool().allocate(size);
+}
+
+void SceneNode::operator delete(void* /*p*/)
+{
+  // The memory goes back with the rest of the pool
+}
+
+int SceneNode::count()
+{
+  return next_node_id;
+}
+
+size_t SceneNode::storage_bytes()
+{
+  return node_pool().heap_bytes();
+}
 
 SceneNode::SceneNode(const std::string& name)
-  : m_name(name)
+  : m_name(intern(name)),
+    m_transform(0),
+    m_motion(0),
+    m_children(0),
+    m_child_count(0),
+    m_child_capacity(0),
+    m_id(next_node_id++),
+    m_end_bounds(0)
 {
 }
 
@@ -10,22 +399,255 @@ SceneNode::~SceneNode()
 {
 }
 
+const Matrix4x4& SceneNode::get_transform() const
+{
+  return m_transform ? m_transform->trans : IDENTITY;
+}
+
+const Matrix4x4& SceneNode::get_inverse() const
+{
+  return m_transform ? m_transform->inverse : IDENTITY;
+}
+
+void SceneNode::set_transform(const Matrix4x4& m)
+{
+  set_transform(m, m.invert());
+}
+
+void SceneNode::set_transform(const Matrix4x4& m, const Matrix4x4& i)
+{
+  if (is_identity(m)) {
+    m_transform = 0;
+  } else {
+    if (!m_transform) m_transform = pool_new<Transform>();
+    m_transform->trans = m;
+    m_transform->inverse = i;
+  }
+  m_motion = 0;
+}
+
+void SceneNode::add_child(SceneNode* child)
+{
+  if (m_child_count == m_child_capacity) {
+    // Outgrown arrays are left in the pool; with doubling, they take
+    // less room between them than the final one
+    int capacity = std::max(1, 2 * m_child_capacity);
+    SceneNode** children = node_pool().allocate_array<SceneNode*>(capacity);
+    std::copy(m_children, m_children + m_child_count, children);
+    m_children = children;
+    m_child_capacity = capacity;
+  }
+  m_children[m_child_count++] = child;
+}
+
+void SceneNode::remove_child(SceneNode* child)
+{
+  m_child_count = std::remove(m_children, m_children + m_child_count, child) - m_children;
+}
+
+// Fewest sibling spheres gather_spheres puts in a set of their own
+static const int MIN_GATHERED_SPHERES = 8;
+
+int SceneNode::gather_spheres()
+{
+  int gathered = 0;
+  // Groups in the order their materials first appear, so the sets, and
+  // their ids, come out the same on every run
+  std::vector<Material*> materials;
+  std::vector< std::vector<GeometryNode*> > groups;
+  std::map<Material*, int> group_of;
+  for (int i = 0; i < m_child_count; i++) {
+    SceneNode* child = m_children[i];
+    gathered += child->gather_spheres();
+
+    GeometryNode* geometry = dynamic_cast<GeometryNode*>(child);
+    if (!geometry || dynamic_cast<ProxyNode*>(child)) continue;
+    if (child->m_transform || child->m_motion || child->m_child_count > 0) continue;
+    if (!dynamic_cast<NonhierSphere*>(geometry->get_primitive())) continue;
+    // Hits on a set don't know which member they're on, so textures
+    // couldn't be looked up
+    const PhongMaterial* phong = dynamic_cast<const PhongMaterial*>(geometry->get_material());
+    if (phong && phong->texture()) continue;
+    Material* material = geometry->get_material();
+    std::map<Material*, int>::iterator G = group_of.find(material);
+    if (G == group_of.end()) {
+      G = group_of.insert(std::make_pair(material, (int)groups.size())).first;
+      materials.push_back(material);
+      groups.push_back(std::vector<GeometryNode*>());
+    }
+    groups[G->second].push_back(geometry);
+  }
+
+  std::set<SceneNode*> removed;
+  std::vector<GeometryNode*> sets;
+  for (size_t g = 0; g < groups.size(); g++) {
+    const std::vector<GeometryNode*>& members = groups[g];
+    if ((int)members.size() < MIN_GATHERED_SPHERES) continue;
+
+    // Copies, since the set owns its members and the nodes may share
+    // their primitives with nodes elsewhere
+    std::vector<Primitive*> spheres;
+    for (size_t i = 0; i < members.size(); i++) {
+      const NonhierSphere* sphere = static_cast<NonhierSphere*>(members[i]->get_primitive());
+      spheres.push_back(new NonhierSphere(*sphere));
+      removed.insert(members[i]);
+    }
+    GeometryNode* set = new GeometryNode(name(), new PrimitiveSet(spheres));
+    set->set_material(materials[g]);
+    sets.push_back(set);
+    gathered += members.size();
+  }
+  if (sets.empty()) return gathered;
+
+  // Drop the gathered children in one pass; there may be a great many
+  int kept = 0;
+  for (int i = 0; i < m_child_count; i++) {
+    if (!removed.count(m_children[i])) m_children[kept++] = m_children[i];
+  }
+  m_child_count = kept;
+  for (size_t i = 0; i < sets.size(); i++) add_child(sets[i]);
+  return gathered;
+}
+
+bool SceneNode::s_check_inverses = false;
+int SceneNode::s_inverse_mismatches = 0;
+
+void SceneNode::set_check_inverses(bool check)
+{
+  s_check_inverses = check;
+}
+
+// Compare an inverse kept up to date step by step with one computed
+// from scratch, and complain if they've drifted apart
+void SceneNode::check_inverse(const Matrix4x4& trans, const Matrix4x4& inverse) const
+{
+  Matrix4x4 full = trans.invert();
+  double error = 0.0, size = 1.0;
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      error = std::max(error, fabs(inverse[i][j] - full[i][j]));
+      size = std::max(size, fabs(full[i][j]));
+    }
+  }
+  if (error > 1e-9 * size) {
+    s_inverse_mismatches++;
+    std::cerr << "Node " << name() << ": inverse transform is off by " << error
+              << " from the full inverse" << std::endl;
+  }
+}
+
+void SceneNode::transform_by(const Matrix4x4& m, const Matrix4x4& inverse, bool motion)
+{
+  // (M T)^-1 = T^-1 M^-1, where T is the new elementary transform, so
+  // each step only needs T's inverse, not a full inversion
+  if (!motion) {
+    if (!m_transform) m_transform = pool_new<Transform>();
+    m_transform->trans = m_transform->trans * m;
+    m_transform->inverse = inverse * m_transform->inverse;
+    if (s_check_inverses) check_inverse(m_transform->trans, m_transform->inverse);
+  }
+
+  if (m_motion || motion) {
+    if (!m_motion) {
+      m_motion = pool_new<Motion>();
+      m_motion->close = get_transform();
+      m_motion->close_inverse = get_inverse();
+    }
+    m_motion->close = m_motion->close * m;
+    m_motion->close_inverse = inverse * m_motion->close_inverse;
+    if (s_check_inverses) check_inverse(m_motion->close, m_motion->close_inverse);
+  }
+}
+
+void SceneNode::transform_at(double time, Matrix4x4& trans, Matrix4x4& inverse) const
+{
+  if (time <= 0.0) {
+    trans = get_transform();
+    inverse = get_inverse();
+  } else if (time >= 1.0) {
+    trans = m_motion->close;
+    inverse = m_motion->close_inverse;
+  } else {
+    m_motion->at(time, trans, inverse);
+  }
+}
+
+// Counterclockwise rotation of "angle" degrees about the given axis
+static Matrix4x4 rotation(char axis, double angle)
+{
+  double rad = angle * M_PI / 180.0;
+  double c = cos(rad), s = sin(rad);
+
+  Matrix4x4 r;
+  switch (axis) {
+  case 'x':
+    r[1][1] = c; r[1][2] = -s;
+    r[2][1] = s; r[2][2] = c;
+    break;
+  case 'y':
+    r[0][0] = c; r[0][2] = s;
+    r[2][0] = -s; r[2][2] = c;
+    break;
+  case 'z':
+    r[0][0] = c; r[0][1] = -s;
+    r[1][0] = s; r[1][1] = c;
+    break;
+  }
+  return r;
+}
+
+static Matrix4x4 scaling(const Vector3D& amount)
+{
+  Matrix4x4 s;
+  s[0][0] = amount[0];
+  s[1][1] = amount[1];
+  s[2][2] = amount[2];
+  return s;
+}
+
+static Matrix4x4 translation(const Vector3D& amount)
+{
+  Matrix4x4 t;
+  t[0][3] = amount[0];
+  t[1][3] = amount[1];
+  t[2][3] = amount[2];
+  return t;
+}
+
+// The inverse of scaling by amount
+static Vector3D reciprocal(const Vector3D& amount)
+{
+  return Vector3D(1.0 / amount[0], 1.0 / amount[1], 1.0 / amount[2]);
+}
+
 void SceneNode::rotate(char axis, double angle)
 {
-  std::cerr << "Stub: Rotate " << m_name << " around " << axis << " by " << angle << std::endl;
-  // Fill me in
+  transform_by(rotation(axis, angle), rotation(axis, -angle), false);
 }
 
 void SceneNode::scale(const Vector3D& amount)
 {
-  std::cerr << "Stub: Scale " << m_name << " by " << amount << std::endl;
-  // Fill me in
+  transform_by(scaling(amount), scaling(reciprocal(amount)), false);
 }
 
 void SceneNode::translate(const Vector3D& amount)
 {
-  std::cerr << "Stub: Translate " << m_name << " by " << amount << std::endl;
-  // Fill me in
+  transform_by(translation(amount), translation(-amount), false);
+}
+
+void SceneNode::motion_rotate(char axis, double angle)
+{
+  transform_by(rotation(axis, angle), rotation(axis, -angle), true);
+}
+
+void SceneNode::motion_scale(const Vector3D& amount)
+{
+  transform_by(scaling(amount), scaling(reciprocal(amount)), true);
+}
+
+void SceneNode::motion_translate(const Vector3D& amount)
+{
+  transform_by(translation(amount), translation(-amount), true);
 }
 
 bool SceneNode::is_joint() const
@@ -33,6 +655,203 @@ bool SceneNode::is_joint() const
   return false;
 }
 
+void SceneNode::update_bounds()
+{
+  BBox open = update_self_bounds();
+  BBox close = open;
+
+  for (int i = 0; i < m_child_count; i++) {
+    m_children[i]->update_bounds();
+    open.expand(m_children[i]->end_bounds(0));
+    close.expand(m_children[i]->end_bounds(1));
+  }
+
+  BBox ends[2];
+  if (!m_motion) {
+    // Mapping by a fixed transform commutes with interpolating, and
+    // the union of interpolated boxes lies inside the interpolation
+    // of their unions, so these are exact ends for the whole subtree
+    ends[0] = open.transformed(get_transform());
+    ends[1] = close.transformed(get_transform());
+  } else if (!open.empty() && !close.empty()) {
+    // The box's corners don't move in straight lines, so fit ends to
+    // boxes sampled along the way. They're then padded by how far
+    // the sampled boxes stick out of the interpolation, plus how far
+    // any corner or face moves between samples, which covers the
+    // stretches in between.
+    m_motion->prepare(get_transform());
+
+    BBox samples[MOTION_SAMPLES + 1];
+    Point3D corners[8];
+    double pad = 0.0;
+    for (int i = 0; i <= MOTION_SAMPLES; i++) {
+      double time = (double)i / MOTION_SAMPLES;
+      Matrix4x4 trans, inverse;
+      transform_at(time, trans, inverse);
+      BBox local = open.interpolated(close, time);
+      for (int corner = 0; corner < 8; corner++) {
+        Point3D p = trans * Point3D((corner & 1) ? local.max()[0] : local.min()[0],
+                                    (corner & 2) ? local.max()[1] : local.min()[1],
+                                    (corner & 4) ? local.max()[2] : local.min()[2]);
+        if (i > 0) pad = std::max(pad, (p - corners[corner]).length());
+        corners[corner] = p;
+        samples[i].expand(p);
+      }
+    }
+
+    BBox first = samples[0], last = samples[MOTION_SAMPLES];
+    for (int j = 0; j < 3; j++) {
+      double drift = std::max(fabs(last.min()[j] - first.min()[j]),
+                              fabs(last.max()[j] - first.max()[j]));
+      pad += drift / MOTION_SAMPLES;
+    }
+    double excess = 0.0;
+    for (int i = 1; i < MOTION_SAMPLES; i++) {
+      BBox fitted = first.interpolated(last, (double)i / MOTION_SAMPLES);
+      for (int j = 0; j < 3; j++) {
+        excess = std::max(excess, fitted.min()[j] - samples[i].min()[j]);
+        excess = std::max(excess, samples[i].max()[j] - fitted.max()[j]);
+      }
+    }
+
+    Vector3D margin(pad + excess, pad + excess, pad + excess);
+    ends[0] = BBox(first.min() - margin, first.max() + margin);
+    ends[1] = BBox(last.min() - margin, last.max() + margin);
+  }
+
+  m_bounds = ends[0];
+  m_bounds.expand(ends[1]);
+
+  bool move = false;
+  for (int i = 0; i < 3; i++) {
+    if (ends[0].min()[i] != ends[1].min()[i] || ends[0].max()[i] != ends[1].max()[i]) {
+      move = true;
+    }
+  }
+  if (!move) {
+    m_end_bounds = 0;
+  } else {
+    if (!m_end_bounds) m_end_bounds = node_pool().allocate_array<BBox>(2);
+    m_end_bounds[0] = ends[0];
+    m_end_bounds[1] = ends[1];
+  }
+}
+
+bool SceneNode::intersect(const Ray& ray, double tmin, double tmax,
+                          Intersection& hit, Arena& arena) const
+{
+  // Skip whole subtrees the ray can't reach
+  if (!bounds_hit(ray, tmin, tmax)) return false;
+
+  // Nodes without a transform pass the ray on as it is
+  const Matrix4x4* trans = 0;
+  const Matrix4x4* inverse = 0;
+  Matrix4x4 moved, moved_inverse;
+  if (m_motion) {
+    transform_at(ray.time, moved, moved_inverse);
+    trans = &moved;
+    inverse = &moved_inverse;
+  } else if (m_transform) {
+    trans = &m_transform->trans;
+    inverse = &m_transform->inverse;
+  }
+
+  Ray local = inverse ? Ray(*inverse * ray.origin, *inverse * ray.dir, ray.time) : ray;
+
+  bool found = false;
+  if (intersect_self(local, tmin, tmax, hit, arena)) {
+    tmax = hit.t;
+    found = true;
+  }
+
+  for (int i = 0; i < m_child_count; i++) {
+    if (m_children[i]->intersect(local, tmin, tmax, hit, arena)) {
+      tmax = hit.t;
+      found = true;
+    }
+  }
+
+  if (found && inverse) {
+    // Normals transform by the inverse transpose
+    hit.normal = transNorm(*inverse, hit.normal);
+    hit.tangent = *trans * hit.tangent;
+  }
+  return found;
+}
+
+void SceneNode::spans(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  out.count = 0;
+  if (!bounds_hit(ray, -HUGE_VAL, HUGE_VAL)) return;
+
+  // Nodes without a transform pass the ray on as it is
+  const Matrix4x4* trans = 0;
+  const Matrix4x4* inverse = 0;
+  Matrix4x4 moved, moved_inverse;
+  if (m_motion) {
+    transform_at(ray.time, moved, moved_inverse);
+    trans = &moved;
+    inverse = &moved_inverse;
+  } else if (m_transform) {
+    trans = &m_transform->trans;
+    inverse = &m_transform->inverse;
+  }
+
+  Ray local = inverse ? Ray(*inverse * ray.origin, *inverse * ray.dir, ray.time) : ray;
+
+  spans_self(local, arena, out);
+
+  // Everything under a node counts as one solid
+  for (int i = 0; i < m_child_count; i++) {
+    SpanList child, merged;
+    m_children[i]->spans(local, arena, child);
+    span_union(out, child, arena, merged);
+    out = merged;
+  }
+
+  if (!inverse) return;
+  for (int i = 0; i < out.count; i++) {
+    out.spans[i].enter.normal = transNorm(*inverse, out.spans[i].enter.normal);
+    out.spans[i].exit.normal = transNorm(*inverse, out.spans[i].exit.normal);
+    out.spans[i].enter.tangent = *trans * out.spans[i].enter.tangent;
+    out.spans[i].exit.tangent = *trans * out.spans[i].exit.tangent;
+  }
+}
+
+bool SceneNode::intersect_self(const Ray& /*ray*/, double /*tmin*/, double /*tmax*/,
+                               Intersection& /*hit*/, Arena& /*arena*/) const
+{
+  return false;
+}
+
+void SceneNode::spans_self(const Ray& /*ray*/, Arena& /*arena*/, SpanList& out) const
+{
+  out.count = 0;
+}
+
+BBox SceneNode::update_self_bounds()
+{
+  return BBox();
+}
+
+void SceneNode::specular_bounds(const Matrix4x4& to_world, std::vector<BBox>& out) const
+{
+  // A moving node is aimed at where it is when the shutter opens and
+  // when it closes
+  for (int end = 0; end < (m_motion ? 2 : 1); end++) {
+    Matrix4x4 local_to_world = to_world * (end ? m_motion->close : get_transform());
+    specular_bounds_self(local_to_world, out);
+
+    for (int i = 0; i < m_child_count; i++) {
+      m_children[i]->specular_bounds(local_to_world, out);
+    }
+  }
+}
+
+void SceneNode::specular_bounds_self(const Matrix4x4&, std::vector<BBox>&) const
+{
+}
+
 JointNode::JointNode(const std::string& name)
   : SceneNode(name)
 {
@@ -63,6 +882,7 @@ void JointNode::set_joint_y(double min, double init, double max)
 
 GeometryNode::GeometryNode(const std::string& name, Primitive* primitive)
   : SceneNode(name),
+    m_material(0),
     m_primitive(primitive)
 {
 }
@@ -70,4 +890,267 @@ GeometryNode::GeometryNode(const std::string& name, Primitive* primitive)
 GeometryNode::~GeometryNode()
 {
 }
+
+const Material* GeometryNode::get_material() const
+{
+  return m_material;
+}
+
+Material* GeometryNode::get_material()
+{
+  return m_material;
+}
+
+// Some unit vector perpendicular to n
+static Vector3D surface_tangent(const Vector3D& n)
+{
+  // Cross with the axis n is least aligned with, so it can't vanish
+  double x = fabs(n[0]), y = fabs(n[1]), z = fabs(n[2]);
+  Vector3D axis(0.0, 0.0, 1.0);
+  if (x <= y && x <= z) axis = Vector3D(1.0, 0.0, 0.0);
+  else if (y <= z) axis = Vector3D(0.0, 1.0, 0.0);
+  Vector3D t = n.cross(axis);
+  double length = t.length();
+  return length > 0.0 ? (1.0 / length) * t : Vector3D(1.0, 0.0, 0.0);
+}
+
+bool GeometryNode::intersect_self(const Ray& ray, double tmin, double tmax,
+                                  Intersection& hit, Arena& /*arena*/) const
+{
+  return intersect_primitive(*m_primitive, ray, tmin, tmax, hit);
+}
+
+void GeometryNode::spans_self(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  spans_primitive(*m_primitive, ray, arena, out);
+}
+
+bool GeometryNode::intersect_primitive(const Primitive& primitive, const Ray& ray,
+                                       double tmin, double tmax, Intersection& hit) const
+{
+  if (!primitive.intersect(ray, tmin, tmax, hit)) return false;
+  hit.material = m_material;
+  hit.object = m_id;
+  hit.primitive = &primitive;
+  hit.local = ray.at(hit.t);
+  hit.tangent = surface_tangent(hit.normal);
+  return true;
+}
+
+void GeometryNode::spans_primitive(const Primitive& primitive, const Ray& ray,
+                                   Arena& arena, SpanList& out) const
+{
+  primitive.spans(ray, arena, out);
+  for (int i = 0; i < out.count; i++) {
+    Intersection* ends[2] = { &out.spans[i].enter, &out.spans[i].exit };
+    for (int j = 0; j < 2; j++) {
+      ends[j]->material = m_material;
+      ends[j]->object = m_id;
+      ends[j]->primitive = &primitive;
+      ends[j]->local = ray.at(ends[j]->t);
+      ends[j]->tangent = surface_tangent(ends[j]->normal);
+    }
+  }
+}
+
+BBox GeometryNode::update_self_bounds()
+{
+  return m_primitive->bounds();
+}
+
+void GeometryNode::specular_bounds_self(const Matrix4x4& to_world,
+                                        std::vector<BBox>& out) const
+{
+  const PhongMaterial* material = dynamic_cast<const PhongMaterial*>(m_material);
+  if (material && (material->reflectivity() > 0.0 || material->transparency() > 0.0)) {
+    out.push_back(m_primitive->bounds().transformed(to_world));
+  }
+}
+
+int ProxyNode::s_count = 0;
+int ProxyNode::s_loaded = 0;
+
+ProxyNode::ProxyNode(const std::string& name, const std::string& path, const BBox& box)
+  : GeometryNode(name, 0),
+    m_path(path),
+    m_box(box),
+    m_state(PROXY_UNLOADED),
+    m_mesh(0)
+{
+  pthread_mutex_init(&m_lock, 0);
+  s_count++;
+}
+
+ProxyNode::~ProxyNode()
+{
+  delete m_mesh;
+  pthread_mutex_destroy(&m_lock);
+}
+
+const Mesh* ProxyNode::mesh() const
+{
+  if (m_state != PROXY_UNLOADED) {
+    __sync_synchronize();
+    return m_mesh;
+  }
+
+  pthread_mutex_lock(&m_lock);
+  if (m_state == PROXY_UNLOADED) {
+    Mesh* mesh = Mesh::load(m_path);
+    if (mesh) {
+      // Parts outside the declared box are never reached
+      BBox box = mesh->bounds();
+      for (int i = 0; i < 3; i++) {
+        if (box.min()[i] < m_box.min()[i] || box.max()[i] > m_box.max()[i]) {
+          std::cerr << "Proxy " << name() << ": " << m_path
+                    << " sticks out of its bounding box and will be clipped" << std::endl;
+          break;
+        }
+      }
+      __sync_fetch_and_add(&s_loaded, 1);
+    } else {
+      std::cerr << "Proxy " << name() << " will be empty" << std::endl;
+    }
+    m_mesh = mesh;
+    __sync_synchronize();
+    m_state = mesh ? PROXY_LOADED : PROXY_FAILED;
+  }
+  pthread_mutex_unlock(&m_lock);
+
+  return m_mesh;
+}
+
+bool ProxyNode::intersect_self(const Ray& ray, double tmin, double tmax,
+                               Intersection& hit, Arena& /*arena*/) const
+{
+  // Only rays that reached the box get here, so this is what loads it
+  const Mesh* loaded = mesh();
+  return loaded && intersect_primitive(*loaded, ray, tmin, tmax, hit);
+}
+
+void ProxyNode::spans_self(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  const Mesh* loaded = mesh();
+  if (loaded) {
+    spans_primitive(*loaded, ray, arena, out);
+  } else {
+    out.count = 0;
+  }
+}
+
+BBox ProxyNode::update_self_bounds()
+{
+  return m_box;
+}
+
+void ProxyNode::specular_bounds_self(const Matrix4x4& to_world,
+                                     std::vector<BBox>& out) const
+{
+  const PhongMaterial* material = dynamic_cast<const PhongMaterial*>(m_material);
+  if (material && (material->reflectivity() > 0.0 || material->transparency() > 0.0)) {
+    out.push_back(m_box.transformed(to_world));
+  }
+}
+
+CSGNode::CSGNode(const std::string& name, Operation op,
+                 SceneNode* left, SceneNode* right)
+  : SceneNode(name),
+    m_op(op),
+    m_left(left),
+    m_right(right)
+{
+}
+
+CSGNode::~CSGNode()
+{
+}
+
+bool CSGNode::intersect_self(const Ray& ray, double tmin, double tmax,
+                             Intersection& hit, Arena& arena) const
+{
+  // The spans are only needed until we've picked out the hit
+  Arena::Mark mark = arena.mark();
+
+  SpanList list;
+  spans_self(ray, arena, list);
+
+  // The first span boundary in range is the visible surface
+  bool found = false;
+  for (int i = 0; i < list.count; i++) {
+    const Span& span = list.spans[i];
+    if (span.enter.t > tmin) {
+      if (span.enter.t < tmax) {
+        hit = span.enter;
+        found = true;
+      }
+      break;
+    }
+    if (span.exit.t > tmin) {
+      if (span.exit.t < tmax) {
+        hit = span.exit;
+        found = true;
+      }
+      break;
+    }
+  }
+
+  arena.rewind(mark);
+  return found;
+}
+
+void CSGNode::spans_self(const Ray& ray, Arena& arena, SpanList& out) const
+{
+  out.count = 0;
+
+  // Cheap bounding box checks first: a miss on one operand can make
+  // evaluating the other unnecessary
+  bool hit_left = m_left->bounds_hit(ray, -HUGE_VAL, HUGE_VAL);
+  bool hit_right = m_right->bounds_hit(ray, -HUGE_VAL, HUGE_VAL);
+
+  SpanList left, right;
+  switch (m_op) {
+  case UNION:
+    if (hit_left) m_left->spans(ray, arena, left);
+    if (hit_right) m_right->spans(ray, arena, right);
+    span_union(left, right, arena, out);
+    break;
+  case INTERSECTION:
+    if (!hit_left || !hit_right) return;
+    m_left->spans(ray, arena, left);
+    if (left.count == 0) return;
+    m_right->spans(ray, arena, right);
+    span_intersection(left, right, arena, out);
+    break;
+  case DIFFERENCE:
+    if (!hit_left) return;
+    m_left->spans(ray, arena, left);
+    if (left.count > 0 && hit_right) m_right->spans(ray, arena, right);
+    span_difference(left, right, arena, out);
+    break;
+  }
+}
+
+BBox CSGNode::update_self_bounds()
+{
+  m_left->update_bounds();
+  m_right->update_bounds();
+
+  switch (m_op) {
+  case INTERSECTION:
+    return m_left->bounds().intersection(m_right->bounds());
+  case DIFFERENCE:
+    return m_left->bounds();
+  default:
+    BBox box = m_left->bounds();
+    box.expand(m_right->bounds());
+    return box;
+  }
+}
  
+
+void CSGNode::specular_bounds_self(const Matrix4x4& to_world,
+                                   std::vector<BBox>& out) const
+{
+  m_left->specular_bounds(to_world, out);
+  m_right->specular_bounds(to_world, out);
+}
@@ -2,62 +2,188 @@
 #define SCENE_HPP
 
 #include <list>
+#include <vector>
+#include <string>
+#include <pthread.h>
 #include "algebra.hpp"
 #include "primitive.hpp"
 #include "material.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "arena.hpp"
+#include "mesh.hpp"
 
+// Scene nodes are allocated from a pool, along with their transforms
+// and child arrays, so a scene of millions of nodes is packed together
+// rather than scattered over the heap. Nodes are never freed one at a
+// time: the pool lives as long as the program.
 class SceneNode {
 public:
   SceneNode(const std::string& name);
   virtual ~SceneNode();
 
-  const Matrix4x4& get_transform() const { return m_trans; }
-  const Matrix4x4& get_inverse() const { return m_invtrans; }
-  
-  void set_transform(const Matrix4x4& m)
-  {
-    m_trans = m;
-    m_invtrans = m.invert();
-  }
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
 
-  void set_transform(const Matrix4x4& m, const Matrix4x4& i)
-  {
-    m_trans = m;
-    m_invtrans = i;
-  }
+  // Nodes made so far, and the bytes of the pool they've taken
+  static int count();
+  static size_t storage_bytes();
 
-  void add_child(SceneNode* child)
-  {
-    m_children.push_back(child);
-  }
+  // Whether to check every inverse rotate, scale and translate work out
+  // against a full inversion, and how many have come out wrong
+  static void set_check_inverses(bool check);
+  static int inverse_mismatches() { return s_inverse_mismatches; }
 
-  void remove_child(SceneNode* child)
-  {
-    m_children.remove(child);
-  }
+  const std::string& name() const { return *m_name; }
+
+  // The transform at the shutter's opening, and its inverse
+  const Matrix4x4& get_transform() const;
+  const Matrix4x4& get_inverse() const;
+
+  // Set the transform for the whole time the shutter is open, so the
+  // node stops moving
+  void set_transform(const Matrix4x4& m);
+  void set_transform(const Matrix4x4& m, const Matrix4x4& i);
+
+  void add_child(SceneNode* child);
+  void remove_child(SceneNode* child);
 
   // Callbacks to be implemented.
-  // These will be called from Lua.
+  // These will be called from Lua. Each keeps the inverse up to date
+  // from the elementary transform's own inverse, without inverting
+  // the whole matrix again.
   void rotate(char axis, double angle);
   void scale(const Vector3D& amount);
   void translate(const Vector3D& amount);
 
+  // The same, applied over the time the shutter is open: not at all
+  // when it opens, fully by the time it closes. Transforms made later
+  // apply at both ends. In between, the node moves along the shortest
+  // path: translation and scale are interpolated linearly and rotation
+  // by quaternion slerp.
+  void motion_rotate(char axis, double angle);
+  void motion_scale(const Vector3D& amount);
+  void motion_translate(const Vector3D& amount);
+
+  bool moving() const { return m_motion != 0; }
+
   // Returns true if and only if this node is a JointNode
   virtual bool is_joint() const;
+
+  // Nodes are numbered in the order they're created, from 0
+  int id() const { return m_id; }
+
+  // Work out the bounding boxes of this node and everything below it.
+  // Must be called after the scene is built and before it's traced.
+  void update_bounds();
+
+  // Below this node, replace each node's untransformed, childless
+  // NonhierSphere children that share an untextured material, if there
+  // are enough of them, with one child tracing them all through a
+  // PrimitiveSet, so the accelerator chosen for sets indexes them.
+  // Returns how many spheres were gathered.
+  int gather_spheres();
+
+  // Bounding box of this node and its descendants, in the parent's
+  // coordinate frame, over the whole time the shutter is open
+  const BBox& bounds() const { return m_bounds; }
+
+  // Might the ray, at its time, meet this node or its descendants
+  // somewhere in (tmin, tmax)? The bounds tested move with the ray's
+  // time, so a ray is only sent down a moving subtree near where the
+  // subtree is at that moment.
+  bool bounds_hit(const Ray& ray, double tmin, double tmax) const
+  {
+    if (!m_end_bounds) return m_bounds.hit(ray, tmin, tmax);
+    return m_end_bounds[0].interpolated(m_end_bounds[1], ray.time).hit(ray, tmin, tmax);
+  }
+
+  // Find the closest intersection, with t in (tmin, tmax), of the ray
+  // with this node or any of its descendants. The ray and the
+  // resulting normal are both in the parent's coordinate frame.
+  // Scratch space comes from the tracing thread's arena.
+  bool intersect(const Ray& ray, double tmin, double tmax,
+                 Intersection& hit, Arena& arena) const;
+
+  // Find the spans of the line along the ray (in the parent's frame)
+  // that are inside the solid made up of this node and its
+  // descendants. Used to evaluate CSG.
+  void spans(const Ray& ray, Arena& arena, SpanList& out) const;
+
+  // Append the world-space bounding boxes of the mirrored and
+  // transparent geometry at or below this node, given the transform
+  // from the parent's frame to world space. Used to aim photons.
+  void specular_bounds(const Matrix4x4& to_world, std::vector<BBox>& out) const;
   
 protected:
+
+  // Intersect the ray, already in this node's frame, with whatever
+  // this node itself contains (not counting its children).
+  virtual bool intersect_self(const Ray& ray, double tmin, double tmax,
+                              Intersection& hit, Arena& arena) const;
+
+  // Spans of the ray, in this node's frame, inside whatever this node
+  // itself contains (not counting its children).
+  virtual void spans_self(const Ray& ray, Arena& arena, SpanList& out) const;
+
+  // Bounding box, in this node's frame, of what this node itself
+  // contains. Nodes with operands of their own should bring those
+  // operands' bounds up to date first.
+  virtual BBox update_self_bounds();
+
+  // Append the world-space bounds of any mirrored or transparent
+  // geometry this node itself contains, given the transform from this
+  // node's frame to world space.
+  virtual void specular_bounds_self(const Matrix4x4& to_world,
+                                    std::vector<BBox>& out) const;
   
+  // Interned, so nodes of the same name share one string
+  const std::string* m_name;
+
+  // The transform and its inverse, or null for the identity
+  struct Transform {
+    Matrix4x4 trans, inverse;
+  };
+  Transform* m_transform;
+
+  // The transform at shutter close, and how to get there from the
+  // transform at opening; null for nodes that don't move
+  struct Motion;
+  Motion* m_motion;
+
+  // Hierarchy: m_child_count children, in an array with room for
+  // m_child_capacity
+  SceneNode** m_children;
+  int m_child_count, m_child_capacity;
+
   // Useful for picking
   int m_id;
-  std::string m_name;
 
-  // Transformations
-  Matrix4x4 m_trans;
-  Matrix4x4 m_invtrans;
+  // Bounds of this subtree in the parent's frame over the whole
+  // shutter. If the bounds move, m_end_bounds holds them at the
+  // shutter's opening and closing, and in between they're the
+  // interpolation of the two; otherwise it's null.
+  BBox m_bounds;
+  BBox* m_end_bounds;
+
+private:
+  SceneNode(const SceneNode&);
+  SceneNode& operator=(const SceneNode&);
+
+  // Apply a transform, whose inverse is given, after the ones made so
+  // far, at both ends of the shutter or only at its closing
+  void transform_by(const Matrix4x4& m, const Matrix4x4& inverse, bool motion);
 
-  // Hierarchy
-  typedef std::list<SceneNode*> ChildList;
-  ChildList m_children;
+  void check_inverse(const Matrix4x4& trans, const Matrix4x4& inverse) const;
+
+  static bool s_check_inverses;
+  static int s_inverse_mismatches;
+
+  // The transform, and its inverse, at the given time
+  void transform_at(double time, Matrix4x4& trans, Matrix4x4& inverse) const;
+
+  // The bounds at the opening or closing of the shutter
+  const BBox& end_bounds(int end) const { return m_end_bounds ? m_end_bounds[end] : m_bounds; }
 };
 
 class JointNode : public SceneNode {
@@ -94,9 +220,104 @@ public:
     m_material = material;
   }
 
+  Primitive* get_primitive() const { return m_primitive; }
+
 protected:
+  virtual bool intersect_self(const Ray& ray, double tmin, double tmax,
+                              Intersection& hit, Arena& arena) const;
+  virtual void spans_self(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox update_self_bounds();
+  virtual void specular_bounds_self(const Matrix4x4& to_world,
+                                    std::vector<BBox>& out) const;
+
+  // Intersect a primitive in this node's frame, labelling the hits
+  // with this node's material and id
+  bool intersect_primitive(const Primitive& primitive, const Ray& ray,
+                           double tmin, double tmax, Intersection& hit) const;
+  void spans_primitive(const Primitive& primitive, const Ray& ray,
+                       Arena& arena, SpanList& out) const;
+
   Material* m_material;
   Primitive* m_primitive;
 };
 
+// A mesh that stays on disk until a ray first reaches its bounding
+// box. Only then is the file loaded (see Mesh::load), once,
+// by whichever thread gets there first while the others wait. Meshes
+// the camera never sees cost neither load time nor memory.
+//
+// The box, in the node's frame, is taken on trust: parts of the mesh
+// outside it are never hit.
+class ProxyNode : public GeometryNode {
+public:
+  ProxyNode(const std::string& name, const std::string& path, const BBox& box);
+  virtual ~ProxyNode();
+
+  // Proxies made so far, and how many of them have been loaded
+  static int count() { return s_count; }
+  static int loaded() { return s_loaded; }
+
+protected:
+  virtual bool intersect_self(const Ray& ray, double tmin, double tmax,
+                              Intersection& hit, Arena& arena) const;
+  virtual void spans_self(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox update_self_bounds();
+  virtual void specular_bounds_self(const Matrix4x4& to_world,
+                                    std::vector<BBox>& out) const;
+
+private:
+  ProxyNode(const ProxyNode&);
+  ProxyNode& operator=(const ProxyNode&);
+
+  enum State {
+    PROXY_UNLOADED,
+    PROXY_LOADED,
+    PROXY_FAILED
+  };
+
+  // The mesh, loading it if that hasn't been tried yet; 0 if it
+  // couldn't be read
+  const Mesh* mesh() const;
+
+  std::string m_path;
+  BBox m_box;
+
+  // Set once, under m_lock
+  mutable pthread_mutex_t m_lock;
+  mutable volatile int m_state;
+  mutable Mesh* m_mesh;
+
+  static int s_count;
+  static int s_loaded;
+};
+
+// A constructive solid geometry node: the union, intersection or
+// difference of two operand subtrees, each treated as a solid.
+// Operands are evaluated by combining the spans of the ray inside
+// each of them.
+class CSGNode : public SceneNode {
+public:
+  enum Operation {
+    UNION,
+    INTERSECTION,
+    DIFFERENCE
+  };
+
+  CSGNode(const std::string& name, Operation op,
+          SceneNode* left, SceneNode* right);
+  virtual ~CSGNode();
+
+protected:
+  virtual bool intersect_self(const Ray& ray, double tmin, double tmax,
+                              Intersection& hit, Arena& arena) const;
+  virtual void spans_self(const Ray& ray, Arena& arena, SpanList& out) const;
+  virtual BBox update_self_bounds();
+  virtual void specular_bounds_self(const Matrix4x4& to_world,
+                                    std::vector<BBox>& out) const;
+
+  Operation m_op;
+  SceneNode* m_left;
+  SceneNode* m_right;
+};
+
 #endif
@@ -45,6 +45,8 @@
 #include "light.hpp"
 #include "a4.hpp"
 #include "mesh.hpp"
+#include "accel.hpp"
+#include "texture.hpp"
 
 // Uncomment the following line to enable debugging messages
 // #define GRLUA_ENABLE_DEBUG
@@ -206,6 +208,68 @@ int gr_nh_sphere_cmd(lua_State* L)
   return 1;
 }
 
+// Create a node of many non-hierarchical spheres in one call:
+// gr.nh_spheres(name, {x1, y1, z1, x2, y2, z2, ...}, radii, material)
+// where radii is a table of one radius per sphere, or a single radius
+// for all of them, and the material is optional. The spheres are kept
+// in one SphereSet instead of a node each.
+extern "C"
+int gr_nh_spheres_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+
+  const char* name = luaL_checkstring(L, 1);
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int coord_count = luaL_getn(L, 2);
+
+  luaL_argcheck(L, coord_count >= 3 && coord_count % 3 == 0, 2,
+                "Flat table of sphere centres expected");
+
+  int count = coord_count / 3;
+  std::vector<Point3D> centres(count);
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < 3; j++) {
+      lua_rawgeti(L, 2, 3 * i + j + 1);
+      centres[i][j] = luaL_checknumber(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+
+  std::vector<double> radii;
+  if (lua_type(L, 3) == LUA_TNUMBER) {
+    radii.assign(count, lua_tonumber(L, 3));
+  } else {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_argcheck(L, luaL_getn(L, 3) == count, 3, "One radius per sphere expected");
+    radii.resize(count);
+    for (int i = 0; i < count; i++) {
+      lua_rawgeti(L, 3, i + 1);
+      radii[i] = luaL_checknumber(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+
+  Material* material = 0;
+  if (!lua_isnoneornil(L, 4)) {
+    gr_material_ud* matdata = (gr_material_ud*)luaL_checkudata(L, 4, "gr.material");
+    luaL_argcheck(L, matdata != 0, 4, "Material expected");
+    material = matdata->material;
+  }
+
+  GeometryNode* node = new GeometryNode(name, new SphereSet(centres, radii));
+  node->set_material(material);
+  data->node = node;
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
 // Create a non-hierarchical box node
 extern "C"
 int gr_nh_box_cmd(lua_State* L)
@@ -230,7 +294,29 @@ int gr_nh_box_cmd(lua_State* L)
   return 1;
 }
 
-// Create a polygonal mesh node
+// Create a torus node
+extern "C"
+int gr_torus_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+
+  const char* name = luaL_checkstring(L, 1);
+  double major = luaL_checknumber(L, 2);
+  double minor = luaL_checknumber(L, 3);
+
+  data->node = new GeometryNode(name, new Torus(major, minor));
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a polygonal mesh node, from tables of vertices and faces or
+// from an OBJ or .mesh file
 extern "C"
 int gr_mesh_cmd(lua_State* L)
 {
@@ -241,6 +327,18 @@ int gr_mesh_cmd(lua_State* L)
 
   const char* name = luaL_checkstring(L, 1);
 
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    const char* path = lua_tostring(L, 2);
+    Mesh* mesh = Mesh::load(path);
+    if (!mesh) return luaL_error(L, "Could not load mesh %s", path);
+    data->node = new GeometryNode(name, mesh);
+
+    luaL_getmetatable(L, "gr.node");
+    lua_setmetatable(L, -2);
+
+    return 1;
+  }
+
   std::vector<Point3D> verts;
   std::vector< std::vector<int> > faces;
 
@@ -290,6 +388,88 @@ int gr_mesh_cmd(lua_State* L)
   return 1;
 }
 
+// Create a mesh node that's only loaded from an OBJ or .mesh file once
+// a ray reaches its bounding box, given as
+// {{xmin, ymin, zmin}, {xmax, ymax, zmax}}
+extern "C"
+int gr_proxy_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+
+  const char* name = luaL_checkstring(L, 1);
+  const char* path = luaL_checkstring(L, 2);
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  luaL_argcheck(L, luaL_getn(L, 3) == 2, 3, "Pair of corners expected");
+
+  Point3D corners[2];
+  for (int i = 0; i < 2; i++) {
+    lua_rawgeti(L, 3, i + 1);
+    get_tuple(L, -1, &corners[i][0], 3);
+    lua_pop(L, 1);
+  }
+
+  data->node = new ProxyNode(name, path, BBox(corners[0], corners[1]));
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a CSG node combining two subtrees. Shared by gr.union,
+// gr.intersect and gr.difference.
+static int gr_csg_cmd(lua_State* L, CSGNode::Operation op)
+{
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+
+  const char* name = luaL_checkstring(L, 1);
+
+  gr_node_ud* left = (gr_node_ud*)luaL_checkudata(L, 2, "gr.node");
+  luaL_argcheck(L, left != 0, 2, "Node expected");
+
+  gr_node_ud* right = (gr_node_ud*)luaL_checkudata(L, 3, "gr.node");
+  luaL_argcheck(L, right != 0, 3, "Node expected");
+
+  data->node = new CSGNode(name, op, left->node, right->node);
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a CSG union node
+extern "C"
+int gr_union_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  return gr_csg_cmd(L, CSGNode::UNION);
+}
+
+// Create a CSG intersection node
+extern "C"
+int gr_intersect_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  return gr_csg_cmd(L, CSGNode::INTERSECTION);
+}
+
+// Create a CSG difference node
+extern "C"
+int gr_difference_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  return gr_csg_cmd(L, CSGNode::DIFFERENCE);
+}
+
 // Make a point light
 extern "C"
 int gr_light_cmd(lua_State* L)
@@ -358,9 +538,22 @@ int gr_render_cmd(lua_State* L)
     lua_pop(L, 1);
   }
 
+  // An optional crop window {x, y, width, height}. One given on the
+  // command line takes precedence.
+  A4Options options = a4_options;
+  if (!lua_isnoneornil(L, 11) && options.crop_width == 0) {
+    int crop[4];
+    get_tuple(L, 11, crop, 4);
+    luaL_argcheck(L, crop[2] > 0 && crop[3] > 0, 11, "Non-empty crop window expected");
+    options.crop_x = crop[0];
+    options.crop_y = crop[1];
+    options.crop_width = crop[2];
+    options.crop_height = crop[3];
+  }
+
   a4_render(root->node, filename, width, height,
             eye, view, up, fov,
-            ambient, lights);
+            ambient, lights, options);
   
   return 0;
 }
@@ -379,10 +572,54 @@ int gr_material_cmd(lua_State* L)
   get_tuple(L, 2, ks, 3);
 
   double shininess = luaL_checknumber(L, 3);
+
+  // Optional mirror reflectivity, transparency and index of refraction
+  double reflectivity = luaL_optnumber(L, 4, 0.0);
+  double transparency = luaL_optnumber(L, 5, 0.0);
+  double ior = luaL_optnumber(L, 6, 1.0);
   
   data->material = new PhongMaterial(Colour(kd[0], kd[1], kd[2]),
                                      Colour(ks[0], ks[1], ks[2]),
-                                     shininess);
+                                     shininess,
+                                     reflectivity,
+                                     transparency, ior);
+
+  luaL_newmetatable(L, "gr.material");
+  lua_setmetatable(L, -2);
+  
+  return 1;
+}
+
+// Create a material whose diffuse colour is multiplied by an image
+// texture: gr.texture_material(filename, kd, ks, shininess, ...), with
+// the same optional arguments as gr.material
+extern "C"
+int gr_texture_material_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_material_ud* data = (gr_material_ud*)lua_newuserdata(L, sizeof(gr_material_ud));
+  data->material = 0;
+
+  const char* filename = luaL_checkstring(L, 1);
+  
+  double kd[3], ks[3];
+  get_tuple(L, 2, kd, 3);
+  get_tuple(L, 3, ks, 3);
+
+  double shininess = luaL_checknumber(L, 4);
+
+  double reflectivity = luaL_optnumber(L, 5, 0.0);
+  double transparency = luaL_optnumber(L, 6, 0.0);
+  double ior = luaL_optnumber(L, 7, 1.0);
+  
+  PhongMaterial* material = new PhongMaterial(Colour(kd[0], kd[1], kd[2]),
+                                              Colour(ks[0], ks[1], ks[2]),
+                                              shininess,
+                                              reflectivity,
+                                              transparency, ior);
+  material->set_texture(texture_cache().texture(filename));
+  data->material = material;
 
   luaL_newmetatable(L, "gr.material");
   lua_setmetatable(L, -2);
@@ -434,6 +671,32 @@ int gr_node_set_material_cmd(lua_State* L)
   return 0;
 }
 
+// Read the x, y and z arguments of a node transform command
+static Vector3D node_vector_args(lua_State* L)
+{
+  double values[3];
+  
+  for (int i = 0; i < 3; i++) {
+    values[i] = luaL_checknumber(L, i + 2);
+  }
+
+  return Vector3D(values[0], values[1], values[2]);
+}
+
+// Read the axis argument of a rotation command
+static char node_axis_arg(lua_State* L)
+{
+  const char* axis_string = luaL_checkstring(L, 2);
+
+  luaL_argcheck(L, axis_string
+                && std::strlen(axis_string) == 1, 2, "Single character expected");
+  char axis = std::tolower(axis_string[0]);
+  
+  luaL_argcheck(L, axis >= 'x' && axis <= 'z', 2, "Axis must be x, y or z");
+
+  return axis;
+}
+
 // Add a scaling transformation to a node.
 extern "C"
 int gr_node_scale_cmd(lua_State* L)
@@ -445,13 +708,7 @@ int gr_node_scale_cmd(lua_State* L)
 
   SceneNode* self = selfdata->node;
 
-  double values[3];
-  
-  for (int i = 0; i < 3; i++) {
-    values[i] = luaL_checknumber(L, i + 2);
-  }
-
-  self->scale(Vector3D(values[0], values[1], values[2]));
+  self->scale(node_vector_args(L));
 
   return 0;
 }
@@ -467,13 +724,7 @@ int gr_node_translate_cmd(lua_State* L)
 
   SceneNode* self = selfdata->node;
 
-  double values[3];
-  
-  for (int i = 0; i < 3; i++) {
-    values[i] = luaL_checknumber(L, i + 2);
-  }
-
-  self->translate(Vector3D(values[0], values[1], values[2]));
+  self->translate(node_vector_args(L));
 
   return 0;
 }
@@ -489,17 +740,64 @@ int gr_node_rotate_cmd(lua_State* L)
 
   SceneNode* self = selfdata->node;
 
-  const char* axis_string = luaL_checkstring(L, 2);
+  char axis = node_axis_arg(L);
+  double angle = luaL_checknumber(L, 3);
 
-  luaL_argcheck(L, axis_string
-                && std::strlen(axis_string) == 1, 2, "Single character expected");
-  char axis = std::tolower(axis_string[0]);
+  self->rotate(axis, angle);
+
+  return 0;
+}
+
+// Scale a node over the time the shutter is open, for motion blur:
+// node:motion_scale(x, y, z)
+extern "C"
+int gr_node_motion_scale_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
   
-  luaL_argcheck(L, axis >= 'x' && axis <= 'z', 2, "Axis must be x, y or z");
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  SceneNode* self = selfdata->node;
+
+  self->motion_scale(node_vector_args(L));
+
+  return 0;
+}
+
+// Move a node over the time the shutter is open:
+// node:motion_translate(x, y, z)
+extern "C"
+int gr_node_motion_translate_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  SceneNode* self = selfdata->node;
+
+  self->motion_translate(node_vector_args(L));
+
+  return 0;
+}
+
+// Turn a node over the time the shutter is open:
+// node:motion_rotate(axis, angle)
+extern "C"
+int gr_node_motion_rotate_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
   
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  SceneNode* self = selfdata->node;
+
+  char axis = node_axis_arg(L);
   double angle = luaL_checknumber(L, 3);
 
-  self->rotate(axis, angle);
+  self->motion_rotate(axis, angle);
 
   return 0;
 }
@@ -533,13 +831,20 @@ static const luaL_reg grlib_functions[] = {
   {"sphere", gr_sphere_cmd},
   {"joint", gr_joint_cmd},
   {"material", gr_material_cmd},
+  {"texture_material", gr_texture_material_cmd},
   // New for assignment 4
   {"cube", gr_cube_cmd},
   {"nh_sphere", gr_nh_sphere_cmd},
+  {"nh_spheres", gr_nh_spheres_cmd},
   {"nh_box", gr_nh_box_cmd},
+  {"torus", gr_torus_cmd},
   {"mesh", gr_mesh_cmd},
+  {"proxy", gr_proxy_cmd},
   {"light", gr_light_cmd},
   {"render", gr_render_cmd},
+  {"union", gr_union_cmd},
+  {"intersect", gr_intersect_cmd},
+  {"difference", gr_difference_cmd},
   {0, 0}
 };
 
@@ -562,6 +867,9 @@ static const luaL_reg grlib_node_methods[] = {
   {"scale", gr_node_scale_cmd},
   {"rotate", gr_node_rotate_cmd},
   {"translate", gr_node_translate_cmd},
+  {"motion_scale", gr_node_motion_scale_cmd},
+  {"motion_rotate", gr_node_motion_rotate_cmd},
+  {"motion_translate", gr_node_motion_translate_cmd},
   {"render", gr_render_cmd},
   {0, 0}
 };
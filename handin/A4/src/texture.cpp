@@ -0,0 +1,480 @@
+#include "texture.hpp"
+#include "image.hpp"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Bytes in one tile of the tiled file
+static const size_t TILE_BYTES = TEXTURE_TILE * TEXTURE_TILE * 4;
+
+// The tiled file's header is padded to this size, which keeps every
+// tile aligned to its own size in the file
+static const size_t HEADER_BYTES = 64;
+
+static const int SHARDS = 16;
+
+// Memory limit of texture_cache() until a4_render sets one
+static const size_t DEFAULT_CACHE_BYTES = 256 << 20;
+
+enum {
+  TEXTURE_UNOPENED,
+  TEXTURE_READY,
+  TEXTURE_FAILED
+};
+
+static uint64_t tile_key(int texture, int level, int tile_x, int tile_y)
+{
+  return ((uint64_t)texture << 40) | ((uint64_t)level << 32)
+    | ((uint64_t)tile_y << 16) | (uint64_t)tile_x;
+}
+
+// Mix the key's bits so neighbouring tiles land in different shards
+static int shard_of(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (int)(key % SHARDS);
+}
+
+// Size of the next mip-map level down. Odd sizes round down, the last
+// texel folding in three texels of the level above.
+static int next_level_size(int size)
+{
+  return std::max(1, size / 2);
+}
+
+// Texels [first, last) of a level that texel x of the next level down
+// averages
+static void source_span(int x, int size, int next_size, int& first, int& last)
+{
+  first = std::min(2 * x, size - 1);
+  last = x + 1 == next_size ? size : 2 * x + 2;
+}
+
+// The first line of a tiled file; the version changes whenever the
+// layout does, so files made by older builds are converted again
+static const char* TILED_MAGIC = "TEX2";
+
+// Open a tiled file and read its header, returning -1 if it can't be
+// read or is in another format
+static int open_tiled(const std::string& tiled, int& width, int& height, int& levels)
+{
+  int fd = ::open(tiled.c_str(), O_RDONLY);
+  if (fd < 0) return -1;
+
+  char header[HEADER_BYTES + 1];
+  char magic[8];
+  int tile = 0;
+  bool ok = pread(fd, header, HEADER_BYTES, 0) == (ssize_t)HEADER_BYTES;
+  if (ok) {
+    header[HEADER_BYTES] = 0;
+    ok = std::sscanf(header, "%7s %d %d %d %d", magic, &width, &height, &levels, &tile) == 5
+      && std::strcmp(magic, TILED_MAGIC) == 0
+      && width > 0 && height > 0 && levels > 0 && levels < 256 && tile == TEXTURE_TILE;
+  }
+  if (!ok) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int wrap(int x, int size)
+{
+  x %= size;
+  return x < 0 ? x + size : x;
+}
+
+Texture::Texture(TextureCache& cache, const std::string& path, int id)
+  : m_cache(cache), m_path(path), m_id(id),
+    m_state(TEXTURE_UNOPENED), m_fd(-1)
+{
+  pthread_mutex_init(&m_lock, 0);
+}
+
+Texture::~Texture()
+{
+  if (m_fd >= 0) close(m_fd);
+  pthread_mutex_destroy(&m_lock);
+}
+
+// Write the mip-map pyramid of the PNG to "tiled" in one go. The file
+// is written under a temporary name and renamed into place, so another
+// render converting the same texture never sees half of it.
+bool Texture::convert(const std::string& tiled) const
+{
+  Image img;
+  if (!img.loadPng(m_path)) return false;
+
+  int width = img.width(), height = img.height();
+  int elements = img.elements();
+
+  // Level 0 as 8-bit RGBA
+  std::vector<unsigned char> level(4 * width * height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double c[4];
+      for (int i = 0; i < 4; i++) {
+        if (elements <= 2) {
+          c[i] = (i < 3) ? img(x, y, 0) : (elements == 2 ? img(x, y, 1) : 1.0);
+        } else {
+          c[i] = (i < elements) ? img(x, y, i) : 1.0;
+        }
+        unsigned char* out = &level[4 * (y * width + x)];
+        out[i] = (unsigned char)(std::min(std::max(c[i], 0.0), 1.0) * 255.0 + 0.5);
+      }
+    }
+  }
+
+  std::vector<char> file(HEADER_BYTES);
+  std::ostringstream header;
+  int levels = 1;
+  for (int w = width, h = height; w > 1 || h > 1; w = next_level_size(w),
+         h = next_level_size(h)) {
+    levels++;
+  }
+  header << TILED_MAGIC << " " << width << " " << height << " " << levels << " " << TEXTURE_TILE;
+  std::string text = header.str();
+  std::fill(file.begin(), file.end(), ' ');
+  std::memcpy(&file[0], text.data(), text.size());
+  file[HEADER_BYTES - 1] = '\n';
+
+  for (int l = 0; l < levels; l++) {
+    int tiles_x = (width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+    int tiles_y = (height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+    size_t start = file.size();
+    file.resize(start + tiles_x * tiles_y * TILE_BYTES, 0);
+
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        size_t tile = (y / TEXTURE_TILE) * tiles_x + x / TEXTURE_TILE;
+        size_t texel = (y % TEXTURE_TILE) * TEXTURE_TILE + x % TEXTURE_TILE;
+        std::memcpy(&file[start + tile * TILE_BYTES + 4 * texel], &level[4 * (y * width + x)], 4);
+      }
+    }
+
+    if (l + 1 == levels) break;
+
+    // Box filter down to the next level. An odd row or column is
+    // folded into the last texel of the next level, which averages
+    // three rather than two, so the level still covers the same area.
+    int next_width = next_level_size(width);
+    int next_height = next_level_size(height);
+    std::vector<unsigned char> next(4 * next_width * next_height);
+    for (int y = 0; y < next_height; y++) {
+      int y0, y1;
+      source_span(y, height, next_height, y0, y1);
+      for (int x = 0; x < next_width; x++) {
+        int x0, x1;
+        source_span(x, width, next_width, x0, x1);
+        int count = (x1 - x0) * (y1 - y0);
+        for (int i = 0; i < 4; i++) {
+          int sum = 0;
+          for (int sy = y0; sy < y1; sy++) {
+            for (int sx = x0; sx < x1; sx++) sum += level[4 * (sy * width + sx) + i];
+          }
+          next[4 * (y * next_width + x) + i] = (unsigned char)((sum + count / 2) / count);
+        }
+      }
+    }
+    level.swap(next);
+    width = next_width;
+    height = next_height;
+  }
+
+  std::ostringstream temporary;
+  temporary << tiled << ".tmp" << getpid();
+  std::string temporary_name = temporary.str();
+
+  int fd = ::open(temporary_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Could not create " << temporary_name << ": " << std::strerror(errno) << std::endl;
+    return false;
+  }
+  const char* p = &file[0];
+  size_t left = file.size();
+  while (left > 0) {
+    ssize_t written = ::write(fd, p, left);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "Could not write " << temporary_name << ": " << std::strerror(errno) << std::endl;
+      ::close(fd);
+      unlink(temporary_name.c_str());
+      return false;
+    }
+    p += written;
+    left -= written;
+  }
+  ::close(fd);
+
+  if (rename(temporary_name.c_str(), tiled.c_str()) != 0) {
+    std::cerr << "Could not rename " << temporary_name << " to " << tiled << std::endl;
+    unlink(temporary_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Texture::open() const
+{
+  if (m_state != TEXTURE_UNOPENED) {
+    __sync_synchronize();
+    return m_state == TEXTURE_READY;
+  }
+
+  pthread_mutex_lock(&m_lock);
+  if (m_state == TEXTURE_UNOPENED) {
+    std::string tiled = m_path + ".tiles";
+    struct stat source, converted;
+    bool have_source = stat(m_path.c_str(), &source) == 0;
+    bool have_tiled = stat(tiled.c_str(), &converted) == 0;
+
+    bool ok = true, fresh = false;
+    if (!have_tiled || (have_source && converted.st_mtime < source.st_mtime)) {
+      std::cerr << "Converting texture " << m_path << " to " << tiled << std::endl;
+      ok = convert(tiled);
+      fresh = true;
+    }
+
+    int width = 0, height = 0, levels = 0;
+    if (ok) {
+      m_fd = open_tiled(tiled, width, height, levels);
+      if (m_fd < 0 && !fresh && have_source) {
+        // Probably made by an older build, in a layout this one doesn't
+        // read
+        std::cerr << "Converting texture " << m_path << " to " << tiled
+                  << " again, in the current format" << std::endl;
+        if (convert(tiled)) m_fd = open_tiled(tiled, width, height, levels);
+      }
+      ok = m_fd >= 0;
+    }
+
+    if (ok) {
+      off_t offset = HEADER_BYTES;
+      for (int l = 0; l < levels; l++) {
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.tiles_x = (width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        level.tiles_y = (height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        level.offset = offset;
+        m_levels.push_back(level);
+
+        offset += (off_t)level.tiles_x * level.tiles_y * TILE_BYTES;
+        width = next_level_size(width);
+        height = next_level_size(height);
+      }
+      __sync_synchronize();
+      m_state = TEXTURE_READY;
+    } else {
+      std::cerr << "Could not read texture " << m_path << "; using white" << std::endl;
+      __sync_synchronize();
+      m_state = TEXTURE_FAILED;
+    }
+  }
+  pthread_mutex_unlock(&m_lock);
+
+  return m_state == TEXTURE_READY;
+}
+
+void Texture::texel(int level, int x, int y, unsigned char rgba[4]) const
+{
+  m_cache.texel(*this, level, x / TEXTURE_TILE, y / TEXTURE_TILE,
+                x % TEXTURE_TILE, y % TEXTURE_TILE, rgba);
+}
+
+Colour Texture::bilinear(int level, double u, double v) const
+{
+  const Level& l = m_levels[level];
+  double x = (u - floor(u)) * l.width - 0.5;
+  double y = (v - floor(v)) * l.height - 0.5;
+  int x0 = (int)floor(x), y0 = (int)floor(y);
+  double fx = x - x0, fy = y - y0;
+
+  double sum[3] = { 0.0, 0.0, 0.0 };
+  for (int j = 0; j < 2; j++) {
+    for (int i = 0; i < 2; i++) {
+      unsigned char rgba[4];
+      texel(level, wrap(x0 + i, l.width), wrap(y0 + j, l.height), rgba);
+      double w = (i ? fx : 1.0 - fx) * (j ? fy : 1.0 - fy);
+      for (int c = 0; c < 3; c++) sum[c] += w * rgba[c];
+    }
+  }
+  return Colour(sum[0] / 255.0, sum[1] / 255.0, sum[2] / 255.0);
+}
+
+Colour Texture::sample(double u, double v, double width) const
+{
+  if (!open()) return Colour(1.0);
+
+  int levels = m_levels.size();
+  double size = std::max(m_levels[0].width, m_levels[0].height);
+  double lod = width * size > 1.0 ? log(width * size) / log(2.0) : 0.0;
+  lod = std::min(lod, levels - 1.0);
+
+  int level = (int)lod;
+  double blend = lod - level;
+  Colour c = bilinear(level, u, v);
+  if (blend > 0.0 && level + 1 < levels) {
+    c = (1.0 - blend) * c + blend * bilinear(level + 1, u, v);
+  }
+  return c;
+}
+
+TextureCache::TextureCache(size_t max_bytes)
+  : m_max_bytes(max_bytes)
+{
+  for (int i = 0; i < SHARDS; i++) {
+    Shard* shard = new Shard;
+    pthread_mutex_init(&shard->lock, 0);
+    shard->head = shard->tail = 0;
+    shard->bytes = 0;
+    m_shards.push_back(shard);
+  }
+}
+
+TextureCache::~TextureCache()
+{
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    Shard* shard = m_shards[i];
+    for (Tile* tile = shard->head; tile; ) {
+      Tile* next = tile->next;
+      delete[] tile->data;
+      delete tile;
+      tile = next;
+    }
+    pthread_mutex_destroy(&shard->lock);
+    delete shard;
+  }
+  for (std::map<std::string, Texture*>::iterator I = m_textures.begin();
+       I != m_textures.end(); ++I) {
+    delete I->second;
+  }
+}
+
+Texture* TextureCache::texture(const std::string& path)
+{
+  Texture*& texture = m_textures[path];
+  if (!texture) texture = new Texture(*this, path, m_textures.size() - 1);
+  return texture;
+}
+
+void TextureCache::set_max_bytes(size_t max_bytes)
+{
+  // Takes effect as each shard next loads a tile
+  m_max_bytes = max_bytes;
+}
+
+TextureStats TextureCache::stats() const
+{
+  TextureStats total;
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    Shard& shard = *m_shards[i];
+    pthread_mutex_lock(&shard.lock);
+    total.hits += shard.stats.hits;
+    total.misses += shard.stats.misses;
+    total.evictions += shard.stats.evictions;
+    total.bytes_loaded += shard.stats.bytes_loaded;
+    pthread_mutex_unlock(&shard.lock);
+  }
+  return total;
+}
+
+void TextureCache::reset_stats()
+{
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    Shard& shard = *m_shards[i];
+    pthread_mutex_lock(&shard.lock);
+    shard.stats = TextureStats();
+    pthread_mutex_unlock(&shard.lock);
+  }
+}
+
+size_t TextureCache::bytes() const
+{
+  size_t total = 0;
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    Shard& shard = *m_shards[i];
+    pthread_mutex_lock(&shard.lock);
+    total += shard.bytes;
+    pthread_mutex_unlock(&shard.lock);
+  }
+  return total;
+}
+
+void TextureCache::unlink(Shard& shard, Tile* tile)
+{
+  if (tile->prev) tile->prev->next = tile->next;
+  else shard.head = tile->next;
+  if (tile->next) tile->next->prev = tile->prev;
+  else shard.tail = tile->prev;
+}
+
+void TextureCache::push_front(Shard& shard, Tile* tile)
+{
+  tile->prev = 0;
+  tile->next = shard.head;
+  if (shard.head) shard.head->prev = tile;
+  shard.head = tile;
+  if (!shard.tail) shard.tail = tile;
+}
+
+void TextureCache::texel(const Texture& texture, int level, int tile_x, int tile_y,
+                         int x, int y, unsigned char rgba[4])
+{
+  uint64_t key = tile_key(texture.m_id, level, tile_x, tile_y);
+  Shard& shard = *m_shards[shard_of(key)];
+
+  pthread_mutex_lock(&shard.lock);
+
+  Tile* tile;
+  std::map<uint64_t, Tile*>::iterator found = shard.tiles.find(key);
+  if (found != shard.tiles.end()) {
+    tile = found->second;
+    unlink(shard, tile);
+    shard.stats.hits++;
+  } else {
+    const Texture::Level& l = texture.m_levels[level];
+    tile = new Tile;
+    tile->key = key;
+    tile->data = new unsigned char[TILE_BYTES];
+    off_t offset = l.offset + ((off_t)tile_y * l.tiles_x + tile_x) * TILE_BYTES;
+    if (pread(texture.m_fd, tile->data, TILE_BYTES, offset) != (ssize_t)TILE_BYTES) {
+      std::memset(tile->data, 255, TILE_BYTES);
+    }
+    shard.tiles[key] = tile;
+    shard.bytes += TILE_BYTES;
+    shard.stats.misses++;
+    shard.stats.bytes_loaded += TILE_BYTES;
+
+    // Make room, keeping at least the tile just loaded
+    size_t limit = m_max_bytes / SHARDS;
+    while (shard.bytes > limit && shard.tail) {
+      Tile* victim = shard.tail;
+      unlink(shard, victim);
+      shard.tiles.erase(victim->key);
+      shard.bytes -= TILE_BYTES;
+      shard.stats.evictions++;
+      delete[] victim->data;
+      delete victim;
+    }
+  }
+  push_front(shard, tile);
+
+  std::memcpy(rgba, tile->data + 4 * (y * TEXTURE_TILE + x), 4);
+  pthread_mutex_unlock(&shard.lock);
+}
+
+TextureCache& texture_cache()
+{
+  static TextureCache cache(DEFAULT_CACHE_BYTES);
+  return cache;
+}
@@ -0,0 +1,142 @@
+#ifndef CS488_TEXTURE_HPP
+#define CS488_TEXTURE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "algebra.hpp"
+
+class TextureCache;
+
+// An image texture, read through the shared TextureCache.
+//
+// The first time a texture is sampled, its PNG is converted into a
+// ".tiles" file beside it (unless that's already there and newer): a
+// full mip-map pyramid, 8-bit RGBA, cut into TEXTURE_TILE x
+// TEXTURE_TILE tiles. After that, only the tiles that lookups actually
+// touch are read in, and the cache can drop them again when memory is
+// short.
+class Texture {
+public:
+  ~Texture();
+
+  const std::string& path() const { return m_path; }
+
+  // Colour at texture coordinates (u, v), which wrap around, filtered
+  // over a square "width" texture units across: trilinear
+  // interpolation between the two mip levels nearest that width.
+  // Textures that can't be read are white.
+  Colour sample(double u, double v, double width) const;
+
+private:
+  friend class TextureCache;
+
+  Texture(TextureCache& cache, const std::string& path, int id);
+  Texture(const Texture&);
+  Texture& operator=(const Texture&);
+
+  // Convert and open the tiled file if that hasn't been done yet.
+  // Returns false if the texture can't be used.
+  bool open() const;
+  bool convert(const std::string& tiled) const;
+
+  Colour bilinear(int level, double u, double v) const;
+  void texel(int level, int x, int y, unsigned char rgba[4]) const;
+
+  struct Level {
+    int width, height;
+    int tiles_x, tiles_y;
+    // Offset of the level's first tile in the tiled file
+    off_t offset;
+  };
+
+  TextureCache& m_cache;
+  std::string m_path;
+  int m_id;
+
+  // Set up by open(), once, under m_lock
+  mutable pthread_mutex_t m_lock;
+  mutable volatile int m_state;
+  mutable int m_fd;
+  mutable std::vector<Level> m_levels;
+};
+
+// Counts of tile reads since the cache was last reset
+struct TextureStats {
+  TextureStats() : hits(0), misses(0), evictions(0), bytes_loaded(0) {}
+
+  long hits, misses;
+  long evictions;
+  long long bytes_loaded;
+};
+
+// Tiles of every texture, kept up to a memory limit and dropped least
+// recently used first.
+//
+// The cache is split into shards, each with its own lock, list and
+// share of the memory limit, picked by hashing the tile. Threads
+// looking up different tiles rarely wait for each other, and a miss
+// only holds up lookups in its own shard while the tile is read.
+class TextureCache {
+public:
+  explicit TextureCache(size_t max_bytes);
+  ~TextureCache();
+
+  // The texture for a PNG file, shared by everything that uses that
+  // file. Not thread-safe; call it while building the scene.
+  Texture* texture(const std::string& path);
+
+  void set_max_bytes(size_t max_bytes);
+  size_t max_bytes() const { return m_max_bytes; }
+
+  TextureStats stats() const;
+  void reset_stats();
+
+  // Bytes of tile data currently held
+  size_t bytes() const;
+
+private:
+  friend class Texture;
+
+  TextureCache(const TextureCache&);
+  TextureCache& operator=(const TextureCache&);
+
+  struct Tile {
+    uint64_t key;
+    unsigned char* data;
+    Tile* prev;
+    Tile* next;
+  };
+
+  struct Shard {
+    pthread_mutex_t lock;
+    std::map<uint64_t, Tile*> tiles;
+    // Most recently used first
+    Tile* head;
+    Tile* tail;
+    size_t bytes;
+    TextureStats stats;
+  };
+
+  // Copy one texel of a tile, reading the tile in if it isn't cached
+  void texel(const Texture& texture, int level, int tile_x, int tile_y,
+             int x, int y, unsigned char rgba[4]);
+
+  void unlink(Shard& shard, Tile* tile);
+  void push_front(Shard& shard, Tile* tile);
+
+  size_t m_max_bytes;
+  std::vector<Shard*> m_shards;
+  std::map<std::string, Texture*> m_textures;
+};
+
+// Texels across and down a tile
+const int TEXTURE_TILE = 32;
+
+// The cache all textures are read through
+TextureCache& texture_cache();
+
+#endif
@@ -0,0 +1,195 @@
+// accelbench: the accelerators compared on a cloud of spheres.
+//
+// The same spheres are put in a PrimitiveSet with each
+// AcceleratorType, and the same rays are traced through each. For
+// each we report:
+//
+//   build s       time to build the index
+//   index B/shape bytes taken by the index per sphere
+//   Mrays/s       closest-hit throughput, on one thread
+//   mismatches    rays whose hit differs from the BVH's
+//
+// Without a file, N equal spheres are scattered uniformly through a
+// cube, with about "fill" of the cube's volume inside them; -clumped
+// packs half of them into a corner an eighth of the cube across.
+// A file has one sphere per line: x y z radius.
+//
+// Rays start on a sphere around the cloud and aim at random points
+// within it.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <sys/time.h>
+#include "accel.hpp"
+#include "rng.hpp"
+
+static double wall_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double uniform(SampleRng& rng, double lo, double hi)
+{
+  return lo + (hi - lo) * rng.next();
+}
+
+static std::vector<Primitive*> make_spheres(const std::vector<Point3D>& centres,
+                                            const std::vector<double>& radii)
+{
+  std::vector<Primitive*> spheres;
+  for (size_t i = 0; i < centres.size(); i++) {
+    spheres.push_back(new NonhierSphere(centres[i], radii[i]));
+  }
+  return spheres;
+}
+
+static void usage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options] [spheres.txt]\n"
+            << "  -n N       spheres to make up (default 100000)\n"
+            << "  -fill F    fraction of the cube inside spheres (default 0.05)\n"
+            << "  -clumped   put half the spheres in one corner\n"
+            << "  -rays N    rays to trace (default 1000000)\n"
+            << "  -seed N    random seed (default 0)"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  long count = 100000;
+  double fill = 0.05;
+  bool clumped = false;
+  long ray_count = 1000000;
+  unsigned int seed = 0;
+  const char* filename = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = std::atol(argv[++i]);
+      if (count < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-fill") == 0 && i + 1 < argc) {
+      fill = std::atof(argv[++i]);
+      if (fill <= 0.0 || fill >= 1.0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-clumped") == 0) {
+      clumped = true;
+    } else if (std::strcmp(argv[i], "-rays") == 0 && i + 1 < argc) {
+      ray_count = std::atol(argv[++i]);
+      if (ray_count < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], 0, 10);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  std::vector<Point3D> centres;
+  std::vector<double> radii;
+  if (filename) {
+    std::ifstream in(filename);
+    if (!in) {
+      std::cerr << "Could not open " << filename << std::endl;
+      return 1;
+    }
+    Point3D p;
+    double r;
+    while (in >> p[0] >> p[1] >> p[2] >> r) {
+      centres.push_back(p);
+      radii.push_back(r);
+    }
+  } else {
+    // Spheres in a unit cube, with total volume "fill"
+    double radius = pow(3.0 * fill / (4.0 * M_PI * count), 1.0 / 3.0);
+    for (long i = 0; i < count; i++) {
+      SampleRng rng(seed, (uint32_t)i, 0, 1);
+      double size = clumped && i % 2 ? 0.125 : 1.0;
+      centres.push_back(Point3D(uniform(rng, 0.0, size), uniform(rng, 0.0, size),
+                                uniform(rng, 0.0, size)));
+      radii.push_back(radius);
+    }
+  }
+  if (centres.empty()) {
+    std::cerr << "No spheres" << std::endl;
+    return 1;
+  }
+
+  std::vector<Ray> rays;
+  std::vector<double> reference;
+
+  std::cout << centres.size() << " spheres, " << ray_count << " rays\n"
+            << std::left << std::setw(8) << "index"
+            << std::right << std::setw(10) << "build s"
+            << std::setw(15) << "index B/shape"
+            << std::setw(10) << "Mrays/s"
+            << std::setw(12) << "mismatches" << std::endl;
+
+  const AcceleratorType types[] = { ACCEL_BVH, ACCEL_GRID, ACCEL_GRID2 };
+  for (int k = 0; k < 3; k++) {
+    std::vector<Primitive*> spheres = make_spheres(centres, radii);
+    double start = wall_time();
+    PrimitiveSet set(spheres, types[k]);
+    double build = wall_time() - start;
+
+    if (rays.empty()) {
+      BBox box = set.bounds();
+      Point3D middle = box.min() + 0.5 * (box.max() - box.min());
+      double radius = (box.max() - box.min()).length();
+      rays.reserve(ray_count);
+      for (long i = 0; i < ray_count; i++) {
+        SampleRng rng(seed, (uint32_t)i, 0, 0);
+        Vector3D from(uniform(rng, -1.0, 1.0), uniform(rng, -1.0, 1.0), uniform(rng, -1.0, 1.0));
+        from.normalize();
+        Point3D origin = middle + radius * from;
+        Point3D target(uniform(rng, box.min()[0], box.max()[0]),
+                       uniform(rng, box.min()[1], box.max()[1]),
+                       uniform(rng, box.min()[2], box.max()[2]));
+        Vector3D dir = target - origin;
+        dir.normalize();
+        rays.push_back(Ray(origin, dir));
+      }
+    }
+
+    std::vector<double> ts(rays.size());
+    start = wall_time();
+    for (size_t i = 0; i < rays.size(); i++) {
+      Intersection hit;
+      ts[i] = set.intersect(rays[i], 1e-9, HUGE_VAL, hit) ? hit.t : -1.0;
+    }
+    double seconds = wall_time() - start;
+
+    if (reference.empty()) reference = ts;
+    long mismatches = 0;
+    for (size_t i = 0; i < ts.size(); i++) {
+      if (fabs(ts[i] - reference[i]) > 1e-9 * std::max(1.0, fabs(reference[i]))) mismatches++;
+    }
+
+    std::cout << std::left << std::setw(8) << accelerator_name(types[k])
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << build
+              << std::setprecision(1)
+              << std::setw(15) << (double)set.accelerator().memory_bytes() / centres.size()
+              << std::setprecision(2)
+              << std::setw(10) << rays.size() / seconds * 1e-6
+              << std::setw(12) << mismatches << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,205 @@
+// bvhbench: memory and speed of the mesh hierarchies.
+//
+// The same mesh is built with each Mesh::TreeLayout, and the same rays
+// are traced through each. For each layout we report:
+//
+//   build s       time to build the tree (and collapse it, for wide)
+//   nodes         nodes in the tree
+//   tree B/tri    bytes of tree nodes per triangle
+//   total B/tri   the same, counting the triangles (and their packets,
+//                 if any) and vertices too
+//   Mrays/s       closest-hit throughput, on one thread
+//   mismatches    rays whose hit differs from the binary tree's
+//
+// Rays start on a sphere around the mesh and aim at random points in
+// its bounding box. Without an OBJ file, a bumpy sphere of about
+// 2 N^2 triangles is made up, or with -coincident, N copies of one
+// triangle, which the hierarchy can't separate by position.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <sys/time.h>
+#include "mesh.hpp"
+#include "rng.hpp"
+
+static double wall_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double uniform(SampleRng& rng, double lo, double hi)
+{
+  return lo + (hi - lo) * rng.next();
+}
+
+// count faces all on the same three vertices
+static void coincident_triangles(int count, std::vector<Point3D>& verts,
+                                 std::vector< std::vector<int> >& faces)
+{
+  verts.push_back(Point3D(-1.0, -1.0, 0.0));
+  verts.push_back(Point3D(1.0, -1.0, 0.0));
+  verts.push_back(Point3D(0.0, 1.0, 0.0));
+  for (int i = 0; i < count; i++) {
+    std::vector<int> face;
+    for (int k = 0; k < 3; k++) face.push_back(k);
+    faces.push_back(face);
+  }
+}
+
+// A unit sphere with ripples, n rings by 2n segments
+static void bumpy_sphere(int n, std::vector<Point3D>& verts,
+                         std::vector< std::vector<int> >& faces)
+{
+  for (int i = 0; i <= n; i++) {
+    for (int j = 0; j <= 2 * n; j++) {
+      double theta = M_PI * i / n, phi = M_PI * j / n;
+      double r = 1.0 + 0.05 * sin(7.0 * theta) * cos(11.0 * phi);
+      verts.push_back(Point3D(r * sin(theta) * cos(phi), r * cos(theta),
+                              r * sin(theta) * sin(phi)));
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < 2 * n; j++) {
+      int a = i * (2 * n + 1) + j, b = a + 2 * n + 1;
+      std::vector<int> face;
+      face.push_back(a);
+      face.push_back(b);
+      face.push_back(b + 1);
+      face.push_back(a + 1);
+      faces.push_back(face);
+    }
+  }
+}
+
+static void usage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options] [mesh.obj]\n"
+            << "  -n N            rings in the made-up sphere (default 500)\n"
+            << "  -coincident N   make up N copies of one triangle instead\n"
+            << "  -rays N         rays to trace (default 1000000)\n"
+            << "  -seed N         random seed (default 0)"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  int rings = 500;
+  int coincident = 0;
+  long ray_count = 1000000;
+  unsigned int seed = 0;
+  const char* filename = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      rings = std::atoi(argv[++i]);
+      if (rings < 2) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-coincident") == 0 && i + 1 < argc) {
+      coincident = std::atoi(argv[++i]);
+      if (coincident < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-rays") == 0 && i + 1 < argc) {
+      ray_count = std::atol(argv[++i]);
+      if (ray_count < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], 0, 10);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  std::vector<Point3D> verts;
+  std::vector< std::vector<int> > faces;
+  if (!filename && coincident > 0) {
+    coincident_triangles(coincident, verts, faces);
+  } else if (!filename) {
+    bumpy_sphere(rings, verts, faces);
+  }
+
+  const Mesh::TreeLayout layouts[] = { Mesh::TREE_BINARY, Mesh::TREE_WIDE };
+  const char* names[] = { "binary", "wide" };
+  std::vector<Ray> rays;
+  std::vector<double> reference;
+
+  std::cout << std::left << std::setw(8) << "tree"
+            << std::right << std::setw(10) << "build s"
+            << std::setw(10) << "nodes"
+            << std::setw(12) << "tree B/tri"
+            << std::setw(13) << "total B/tri"
+            << std::setw(10) << "Mrays/s"
+            << std::setw(12) << "mismatches" << std::endl;
+
+  for (int l = 0; l < 2; l++) {
+    Mesh::set_tree_layout(layouts[l]);
+    double start = wall_time();
+    Mesh* mesh = filename ? Mesh::read_obj(filename) : new Mesh(verts, faces);
+    if (!mesh) return 1;
+    double build = wall_time() - start;
+
+    if (rays.empty()) {
+      BBox box = mesh->bounds();
+      Point3D centre = box.min() + 0.5 * (box.max() - box.min());
+      double radius = (box.max() - box.min()).length();
+      rays.reserve(ray_count);
+      for (long i = 0; i < ray_count; i++) {
+        SampleRng rng(seed, (uint32_t)i, 0, 0);
+        Vector3D from(uniform(rng, -1.0, 1.0), uniform(rng, -1.0, 1.0), uniform(rng, -1.0, 1.0));
+        from.normalize();
+        Point3D origin = centre + radius * from;
+        Point3D target(uniform(rng, box.min()[0], box.max()[0]),
+                       uniform(rng, box.min()[1], box.max()[1]),
+                       uniform(rng, box.min()[2], box.max()[2]));
+        Vector3D dir = target - origin;
+        dir.normalize();
+        rays.push_back(Ray(origin, dir));
+      }
+    }
+
+    std::vector<double> ts(rays.size());
+    start = wall_time();
+    for (size_t i = 0; i < rays.size(); i++) {
+      Intersection hit;
+      ts[i] = mesh->intersect(rays[i], 1e-9, HUGE_VAL, hit) ? hit.t : -1.0;
+    }
+    double seconds = wall_time() - start;
+
+    if (reference.empty()) reference = ts;
+    long mismatches = 0;
+    for (size_t i = 0; i < ts.size(); i++) {
+      if (fabs(ts[i] - reference[i]) > 1e-9 * std::max(1.0, fabs(reference[i]))) mismatches++;
+    }
+
+    double triangles = mesh->triangle_count();
+    double geometry = mesh->triangle_bytes() + mesh->vertex_count() * sizeof(Point3D);
+    std::cout << std::left << std::setw(8) << names[l]
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << build
+              << std::setw(10) << mesh->node_count()
+              << std::setprecision(1)
+              << std::setw(12) << mesh->tree_bytes() / triangles
+              << std::setw(13) << (mesh->tree_bytes() + geometry) / triangles
+              << std::setprecision(2)
+              << std::setw(10) << rays.size() / seconds * 1e-6
+              << std::setw(12) << mismatches << std::endl;
+
+    delete mesh;
+  }
+
+  return 0;
+}
@@ -0,0 +1,47 @@
+// meshconvert: turn an OBJ file into a .mesh file for Mesh::map.
+//
+//   meshconvert input.obj output.mesh
+//
+// The mesh is read and its hierarchy built in memory, so this needs
+// room for the whole mesh once; the renderer then only needs room for
+// the parts rays visit. The output holds raw structs, so it has to be
+// made by the same build, on the same kind of machine, as the renderer
+// that maps it. Mesh::map refuses files that don't match.
+
+#include <iostream>
+#include <sys/time.h>
+#include "mesh.hpp"
+
+static double wall_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " input.obj output.mesh" << std::endl;
+    return 1;
+  }
+
+  // Only binary trees with indexed triangles can be saved
+  Mesh::set_tree_layout(Mesh::TREE_BINARY);
+  Mesh::set_triangle_layout(Mesh::TRIANGLES_INDEXED);
+
+  double start = wall_time();
+  Mesh* mesh = Mesh::read_obj(argv[1]);
+  if (!mesh) return 1;
+  double built = wall_time();
+
+  std::cerr << argv[1] << ": " << mesh->vertex_count() << " vertices, "
+            << mesh->triangle_count() << " triangles, " << mesh->node_count()
+            << " nodes, read and built in " << built - start << "s" << std::endl;
+
+  if (!mesh->write(argv[2])) return 1;
+  std::cerr << "Wrote " << argv[2] << " in " << wall_time() - built << "s" << std::endl;
+
+  delete mesh;
+  return 0;
+}
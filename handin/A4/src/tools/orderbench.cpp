@@ -0,0 +1,203 @@
+// orderbench: render time and cache misses for each traversal order.
+//
+// The same scene is rendered with -order scanline, morton and hilbert
+// in turn. For each we report:
+//
+//   seconds       wall time of a4_render, including writing the image
+//   cache-misses  the CPU's generic cache-miss count (usually the last
+//                 level cache), across all render threads
+//   LLC-misses    reads that missed the last level cache
+//
+// The counts come from perf_event_open(2); on machines that don't
+// expose the hardware counters to this user (or at all, as in many
+// VMs) they're shown as "n/a", and only the times are meaningful.
+//
+// The scene is a bumpy sphere of about 2 N^2 triangles filling the
+// frame, so that its hierarchy is far bigger than the caches and the
+// order pixels are visited in matters.
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <linux/perf_event.h>
+#include "a4.hpp"
+#include "mesh.hpp"
+
+static double wall_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// A hardware counter for this process and the threads it starts from
+// now on, or -1 if it can't be had
+static int open_counter(uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static std::string counter_text(int fd)
+{
+  uint64_t count;
+  if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) return "n/a";
+  std::ostringstream text;
+  text << count;
+  return text.str();
+}
+
+// A unit sphere with ripples, n rings by 2n segments
+static void bumpy_sphere(int n, std::vector<Point3D>& verts,
+                         std::vector< std::vector<int> >& faces)
+{
+  for (int i = 0; i <= n; i++) {
+    for (int j = 0; j <= 2 * n; j++) {
+      double theta = M_PI * i / n, phi = M_PI * j / n;
+      double r = 1.0 + 0.05 * sin(7.0 * theta) * cos(11.0 * phi);
+      verts.push_back(Point3D(r * sin(theta) * cos(phi), r * cos(theta),
+                              r * sin(theta) * sin(phi)));
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < 2 * n; j++) {
+      int a = i * (2 * n + 1) + j, b = a + 2 * n + 1;
+      std::vector<int> face;
+      face.push_back(a);
+      face.push_back(b);
+      face.push_back(b + 1);
+      face.push_back(a + 1);
+      faces.push_back(face);
+    }
+  }
+}
+
+static void usage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  -n N        rings in the sphere (default 700)\n"
+            << "  -size N     image width and height (default 512)\n"
+            << "  -tile N     tile size in pixels (default 16)\n"
+            << "  -threads N  render threads (default 1)\n"
+            << "  -o FILE     image to write (default orderbench.png)"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  int rings = 700;
+  int size = 512;
+  const char* filename = "orderbench.png";
+  A4Options options;
+  options.threads = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      rings = std::atoi(argv[++i]);
+      if (rings < 2) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+      size = std::atoi(argv[++i]);
+      if (size < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-tile") == 0 && i + 1 < argc) {
+      options.tile_size = std::atoi(argv[++i]);
+      if (options.tile_size < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+      options.threads = std::atoi(argv[++i]);
+      if (options.threads < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      filename = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<Point3D> verts;
+  std::vector< std::vector<int> > faces;
+  bumpy_sphere(rings, verts, faces);
+  PhongMaterial* material = new PhongMaterial(Colour(0.7, 0.5, 0.3), Colour(0.5, 0.5, 0.5), 25);
+  SceneNode* root = new SceneNode("root");
+  GeometryNode* ball = new GeometryNode("ball", new Mesh(verts, faces));
+  ball->set_material(material);
+  root->add_child(ball);
+
+  Light* light = new Light();
+  light->colour = Colour(0.9, 0.9, 0.9);
+  light->position = Point3D(-3.0, 4.0, 5.0);
+  std::list<Light*> lights;
+  lights.push_back(light);
+
+  const TraversalOrder orders[] = { TRAVERSE_SCANLINE, TRAVERSE_MORTON, TRAVERSE_HILBERT };
+  const char* names[] = { "scanline", "morton", "hilbert" };
+  struct Result {
+    double seconds;
+    std::string misses, llc_misses;
+  } results[3];
+
+  for (int k = 0; k < 3; k++) {
+    options.order = orders[k];
+    int misses = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int llc_misses = open_counter(PERF_TYPE_HW_CACHE,
+                                  PERF_COUNT_HW_CACHE_LL
+                                  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+    if (llc_misses >= 0) ioctl(llc_misses, PERF_EVENT_IOC_ENABLE, 0);
+
+    double start = wall_time();
+    a4_render(root, filename, size, size, Point3D(0.0, 0.0, 2.6), Vector3D(0.0, 0.0, -1.0),
+              Vector3D(0.0, 1.0, 0.0), 50, Colour(0.2, 0.2, 0.2), lights, options);
+    results[k].seconds = wall_time() - start;
+
+    if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+    if (llc_misses >= 0) ioctl(llc_misses, PERF_EVENT_IOC_DISABLE, 0);
+    results[k].misses = counter_text(misses);
+    results[k].llc_misses = counter_text(llc_misses);
+    if (misses >= 0) close(misses);
+    if (llc_misses >= 0) close(llc_misses);
+  }
+
+  std::cout << faces.size() * 2 << " triangles, " << size << "x" << size << ", tile "
+            << options.tile_size << ", " << options.threads << " thread(s)\n"
+            << std::left << std::setw(10) << "order"
+            << std::right << std::setw(10) << "seconds"
+            << std::setw(16) << "cache-misses"
+            << std::setw(16) << "LLC-misses" << std::endl;
+  for (int k = 0; k < 3; k++) {
+    std::cout << std::left << std::setw(10) << names[k]
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << results[k].seconds
+              << std::setw(16) << results[k].misses
+              << std::setw(16) << results[k].llc_misses << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,352 @@
+// polybench: throughput and accuracy of the polyroots solvers.
+//
+// Every test polynomial is built by multiplying out known roots, so a
+// solver's output can be checked against the truth. For each solver
+// and each family of polynomials we report:
+//
+//   polys/s, roots/s   throughput of the solve loop alone
+//   max/mean residual  |p(x)| / sum |c_i x^i| over the finite roots
+//   missed             true real roots with no returned root nearby
+//   spurious           returned roots with no true root nearby,
+//                      including NaNs and infinities
+//
+// "nearby" means within 1e-6 * max(1, |root|) for the double solvers
+// and 1e-4 * max(1, |root|) for the float ones.
+//
+// cubicRoots* and quarticRoots* are the double solvers given the
+// coefficients rounded to float, and held to the float tolerance. Some
+// roots are lost in the rounding alone, so these rows are the most
+// the float solvers could hope for.
+//
+// The "random" family has real roots and complex pairs spread over
+// [-10, 10]. The "near-double" family always includes two real roots
+// 1e-2 to 1e-9 apart, which is where solvers tend to decide the pair
+// is complex and drop both.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cstddef>
+#include <sys/time.h>
+#include "polyroots.hpp"
+#include "rng.hpp"
+
+// A monic polynomial c[0] + c[1] x + ... + x^degree, and its real roots
+struct TestPoly {
+  int degree;
+  double c[4];
+  int real_count;
+  double real[4];
+};
+
+enum Family {
+  FAMILY_RANDOM,
+  FAMILY_NEAR_DOUBLE
+};
+
+static const char* family_name(Family family)
+{
+  return family == FAMILY_RANDOM ? "random" : "near-double";
+}
+
+// Solvers all take the low coefficients of a monic polynomial
+typedef int (*SolveFn)(const double c[4], double roots[4]);
+
+static int painter_quadratic(const double c[4], double roots[4])
+{
+  return quadraticRoots(1.0, c[1], c[0], roots);
+}
+
+static int painter_cubic(const double c[4], double roots[4])
+{
+  return cubicRoots(c[2], c[1], c[0], roots);
+}
+
+static int painter_quartic(const double c[4], double roots[4])
+{
+  return quarticRoots(c[3], c[2], c[1], c[0], roots);
+}
+
+static int gems_quadratic(const double c[4], double roots[4])
+{
+  double g[3] = { c[0], c[1], 1.0 };
+  return SolveQuadric(g, roots);
+}
+
+static int gems_cubic(const double c[4], double roots[4])
+{
+  double g[4] = { c[0], c[1], c[2], 1.0 };
+  return SolveCubic(g, roots);
+}
+
+static int gems_quartic(const double c[4], double roots[4])
+{
+  double g[5] = { c[0], c[1], c[2], c[3], 1.0 };
+  return SolveQuartic(g, roots);
+}
+
+static int float_cubic(const double c[4], double roots[4])
+{
+  float r[3];
+  int n = cubicRootsf((float)c[2], (float)c[1], (float)c[0], r);
+  for (int i = 0; i < n; i++) roots[i] = r[i];
+  return n;
+}
+
+static int float_quartic(const double c[4], double roots[4])
+{
+  float r[4];
+  int n = quarticRootsf((float)c[3], (float)c[2], (float)c[1], (float)c[0], r);
+  for (int i = 0; i < n; i++) roots[i] = r[i];
+  return n;
+}
+
+static int rounded_cubic(const double c[4], double roots[4])
+{
+  return cubicRoots((float)c[2], (float)c[1], (float)c[0], roots);
+}
+
+static int rounded_quartic(const double c[4], double roots[4])
+{
+  return quarticRoots((float)c[3], (float)c[2], (float)c[1], (float)c[0], roots);
+}
+
+struct Solver {
+  const char* name;
+  int degree;
+  SolveFn solve;
+  // Relative distance within which a returned root matches a true one
+  double tolerance;
+};
+
+static const Solver solvers[] = {
+  { "quadraticRoots", 2, painter_quadratic, 1e-6 },
+  { "SolveQuadric", 2, gems_quadratic, 1e-6 },
+  { "cubicRoots", 3, painter_cubic, 1e-6 },
+  { "SolveCubic", 3, gems_cubic, 1e-6 },
+  { "cubicRoots*", 3, rounded_cubic, 1e-4 },
+  { "cubicRootsf", 3, float_cubic, 1e-4 },
+  { "quarticRoots", 4, painter_quartic, 1e-6 },
+  { "SolveQuartic", 4, gems_quartic, 1e-6 },
+  { "quarticRoots*", 4, rounded_quartic, 1e-4 },
+  { "quarticRootsf", 4, float_quartic, 1e-4 },
+};
+
+static double wall_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double uniform(SampleRng& rng, double lo, double hi)
+{
+  return lo + (hi - lo) * rng.next();
+}
+
+// Multiply the polynomial c (ascending, of the given degree) by the
+// monic factor f[0] + f[1] x + ... + x^n.
+static void multiply(double c[5], int& degree, const double* f, int n)
+{
+  double out[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+  for (int i = 0; i <= degree; i++) {
+    for (int j = 0; j <= n; j++) {
+      out[i + j] += c[i] * (j == n ? 1.0 : f[j]);
+    }
+  }
+  degree += n;
+  std::memcpy(c, out, sizeof(out));
+}
+
+static void add_real_root(TestPoly& poly, double c[5], int& degree, double r)
+{
+  double f[1] = { -r };
+  multiply(c, degree, f, 1);
+  poly.real[poly.real_count++] = r;
+}
+
+static void add_complex_pair(double c[5], int& degree, double a, double b)
+{
+  // (x - (a + bi)) (x - (a - bi)) = x^2 - 2a x + a^2 + b^2
+  double f[2] = { a * a + b * b, -2.0 * a };
+  multiply(c, degree, f, 2);
+}
+
+static TestPoly make_poly(Family family, int target, SampleRng& rng)
+{
+  TestPoly poly;
+  poly.degree = target;
+  poly.real_count = 0;
+
+  double c[5] = { 1.0, 0.0, 0.0, 0.0, 0.0 };
+  int degree = 0;
+
+  if (family == FAMILY_NEAR_DOUBLE) {
+    double r = uniform(rng, -10.0, 10.0);
+    double gap = std::pow(10.0, uniform(rng, -9.0, -2.0));
+    add_real_root(poly, c, degree, r);
+    add_real_root(poly, c, degree, r + gap);
+  }
+
+  while (degree < target) {
+    if (target - degree >= 2 && rng.next() < 0.5) {
+      add_complex_pair(c, degree, uniform(rng, -10.0, 10.0),
+                       uniform(rng, 0.01, 10.0));
+    } else {
+      add_real_root(poly, c, degree, uniform(rng, -10.0, 10.0));
+    }
+  }
+
+  for (int i = 0; i < 4; i++) poly.c[i] = c[i];
+  return poly;
+}
+
+static bool is_finite(double x)
+{
+  return x == x && std::fabs(x) != HUGE_VAL;
+}
+
+static bool close(double a, double b, double tolerance)
+{
+  double scale = std::fabs(b) > 1.0 ? std::fabs(b) : 1.0;
+  return std::fabs(a - b) <= tolerance * scale;
+}
+
+struct Result {
+  double seconds;
+  long roots;
+  double max_residual;
+  double sum_residual;
+  long missed;
+  long spurious;
+};
+
+static Result run(const Solver& solver, const std::vector<TestPoly>& polys)
+{
+  size_t n = polys.size();
+  std::vector<double> found(4 * n);
+  std::vector<int> counts(n);
+
+  double start = wall_time();
+  for (size_t i = 0; i < n; i++) {
+    counts[i] = solver.solve(polys[i].c, &found[4 * i]);
+  }
+
+  Result result;
+  result.seconds = wall_time() - start;
+  result.roots = 0;
+  result.max_residual = 0.0;
+  result.sum_residual = 0.0;
+  result.missed = 0;
+  result.spurious = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    const TestPoly& poly = polys[i];
+    const double* roots = &found[4 * i];
+    result.roots += counts[i];
+
+    for (int k = 0; k < counts[i]; k++) {
+      double x = roots[k];
+      if (!is_finite(x)) {
+        result.spurious++;
+        continue;
+      }
+
+      double value = 1.0, scale = 1.0;
+      for (int j = poly.degree - 1; j >= 0; j--) {
+        value = value * x + poly.c[j];
+        scale = scale * std::fabs(x) + std::fabs(poly.c[j]);
+      }
+      double residual = std::fabs(value) / scale;
+      if (residual > result.max_residual) result.max_residual = residual;
+      result.sum_residual += residual;
+
+      bool matched = false;
+      for (int j = 0; j < poly.real_count; j++) {
+        if (close(x, poly.real[j], solver.tolerance)) matched = true;
+      }
+      if (!matched) result.spurious++;
+    }
+
+    for (int j = 0; j < poly.real_count; j++) {
+      bool matched = false;
+      for (int k = 0; k < counts[i]; k++) {
+        if (close(roots[k], poly.real[j], solver.tolerance)) matched = true;
+      }
+      if (!matched) result.missed++;
+    }
+  }
+
+  return result;
+}
+
+static void usage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  -n N      polynomials per degree and family (default 1000000)\n"
+            << "  -seed N   random seed (default 0)"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  long count = 1000000;
+  unsigned int seed = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = std::atol(argv[++i]);
+      if (count < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], 0, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::cout << std::left << std::setw(16) << "solver"
+            << std::setw(13) << "family"
+            << std::right << std::setw(10) << "Mpolys/s"
+            << std::setw(10) << "Mroots/s"
+            << std::setw(12) << "max resid"
+            << std::setw(12) << "mean resid"
+            << std::setw(10) << "missed"
+            << std::setw(10) << "spurious" << std::endl;
+
+  const Family families[] = { FAMILY_RANDOM, FAMILY_NEAR_DOUBLE };
+  for (int degree = 2; degree <= 4; degree++) {
+    for (int f = 0; f < 2; f++) {
+      std::vector<TestPoly> polys;
+      polys.reserve(count);
+      for (long i = 0; i < count; i++) {
+        SampleRng rng(seed, (uint32_t)i, degree, f);
+        polys.push_back(make_poly(families[f], degree, rng));
+      }
+
+      for (size_t s = 0; s < sizeof(solvers) / sizeof(solvers[0]); s++) {
+        if (solvers[s].degree != degree) continue;
+        Result result = run(solvers[s], polys);
+
+        std::cout << std::left << std::setw(16) << solvers[s].name
+                  << std::setw(13) << family_name(families[f])
+                  << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(10) << count / result.seconds * 1e-6
+                  << std::setw(10) << result.roots / result.seconds * 1e-6
+                  << std::scientific << std::setprecision(2)
+                  << std::setw(12) << result.max_residual
+                  << std::setw(12) << (result.roots > 0 ? result.sum_residual / result.roots : 0.0)
+                  << std::setw(10) << result.missed
+                  << std::setw(10) << result.spurious << std::endl;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "traversal.hpp"
+
+// Pull the even bits of a 32-bit Morton code down into the low 16 bits.
+static unsigned int morton_compact(unsigned int v)
+{
+  v &= 0x55555555;
+  v = (v | (v >> 1)) & 0x33333333;
+  v = (v | (v >> 2)) & 0x0f0f0f0f;
+  v = (v | (v >> 4)) & 0x00ff00ff;
+  v = (v | (v >> 8)) & 0x0000ffff;
+  return v;
+}
+
+// Convert a distance along a Hilbert curve covering an n x n grid
+// (n a power of two) into grid coordinates.
+static void hilbert_cell(unsigned int n, unsigned int d,
+                         unsigned int& x, unsigned int& y)
+{
+  x = y = 0;
+  for (unsigned int s = 1; s < n; s *= 2) {
+    unsigned int rx = 1 & (d / 2);
+    unsigned int ry = 1 & (d ^ rx);
+
+    // Rotate the quadrant so the curve stays connected
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      unsigned int t = x;
+      x = y;
+      y = t;
+    }
+
+    x += s * rx;
+    y += s * ry;
+    d /= 4;
+  }
+}
+
+void traversal_order(TraversalOrder order, int width, int height,
+                     std::vector<GridCell>& cells)
+{
+  cells.clear();
+  if (width <= 0 || height <= 0) return;
+  cells.reserve(width * height);
+
+  if (order == TRAVERSE_SCANLINE) {
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        cells.push_back(GridCell(x, y));
+      }
+    }
+    return;
+  }
+
+  unsigned int side = 1;
+  while (side < (unsigned int)width || side < (unsigned int)height) side *= 2;
+
+  for (unsigned int d = 0; d < side * side; d++) {
+    unsigned int x, y;
+    if (order == TRAVERSE_MORTON) {
+      x = morton_compact(d);
+      y = morton_compact(d >> 1);
+    } else {
+      hilbert_cell(side, d, x, y);
+    }
+    if (x < (unsigned int)width && y < (unsigned int)height) {
+      cells.push_back(GridCell(x, y));
+    }
+  }
+}
+
+bool parse_traversal_order(const std::string& name, TraversalOrder& order)
+{
+  if (name == "scanline") {
+    order = TRAVERSE_SCANLINE;
+  } else if (name == "morton") {
+    order = TRAVERSE_MORTON;
+  } else if (name == "hilbert") {
+    order = TRAVERSE_HILBERT;
+  } else {
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,35 @@
+#ifndef CS488_TRAVERSAL_HPP
+#define CS488_TRAVERSAL_HPP
+
+#include <vector>
+#include <string>
+
+// Order in which a4_render visits image tiles, and the pixels within
+// each tile. Following a space-filling curve keeps consecutive samples
+// spatially close, so they tend to touch the same parts of the scene.
+enum TraversalOrder {
+  TRAVERSE_SCANLINE,
+  TRAVERSE_MORTON,
+  TRAVERSE_HILBERT
+};
+
+// One cell of a 2D grid (a tile, or a pixel within a tile).
+struct GridCell {
+  GridCell() : x(0), y(0) {}
+  GridCell(int x_, int y_) : x(x_), y(y_) {}
+
+  int x, y;
+};
+
+// Fill "cells" with every cell of a width x height grid, in the given
+// order. Grids that aren't a power of two on a side are handled by
+// walking the enclosing power-of-two curve and skipping cells that
+// fall outside.
+void traversal_order(TraversalOrder order, int width, int height,
+                     std::vector<GridCell>& cells);
+
+// Parse "scanline", "morton" or "hilbert". Returns false if the name
+// isn't recognised.
+bool parse_traversal_order(const std::string& name, TraversalOrder& order);
+
+#endif